@@ -0,0 +1,578 @@
+#include "utility.h" // includes vec3 and ray
+#include "Color.h"
+#include "HittableList.h"
+#include "Sphere.h"
+#include "Camera.h"
+#include "Material.h"
+#include "aarect.h"
+#include "Box.h"
+#include "Shader.h"
+#include "BVH.h"
+#include "LBVH.h"
+#include "CompressedBVH.h"
+#include "OutOfCore.h"
+#include "rotation.h"
+#include "Scenes.h"
+#include "Timer.h"
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+Microbenchmarks for the renderer
+
+It does not render an image, it times the pieces a render is made of on the canonical scenes
+(the cornell box plus generated scenes with a lot of primitives):
+    the same spheres and rects as separate objects and as one SphereSet / RectSet (PrimitiveSets.h)
+    BVH build time (BVH.h and the parallel LBVH.h, plain and with SAH refined top levels)
+    bytes of the trees (BVH.h, LBVH.h and the quantized 4-wide CompressedBVH.h)
+    rays/sec for primary, shadow and secondary rays against the full scene
+    rays/sec on the cornell box with a growing number of lights
+    cost of one intersection test for each primitive type
+    cost of shading one sample for each material
+    out-of-core render (OutOfCore.h) with a memory budget of a quarter of the scene, against render() with a BVH
+
+Everything is printed as JSON so that two versions can be diffed or plotted.
+
+usage: bench [--quick] [--out results.json] [--chunks directory]
+    --quick uses smaller scenes and fewer rays so the whole thing runs in a few seconds
+    --chunks is where the chunk files of the out-of-core scenes go (removed at the end), the current directory by default
+*/
+
+// one line of the JSON output => a group ("bvh_build", "rays", ...), a name and a list of metrics
+struct BenchResult {
+    std::string group;
+    std::string name;
+    std::vector<std::pair<std::string, double>> metrics;
+
+    BenchResult(const std::string& _group, const std::string& _name) : group(_group), name(_name) {}
+
+    void add(const std::string& key, double value) { metrics.push_back(std::make_pair(key, value)); }
+};
+
+struct BenchScene {
+    SceneArena arena; // first => destroyed after the lists that point into it
+    std::string name;
+    HittableList flat; // primitives before the BVH is built
+    LightSources lights;
+};
+
+// the same camera as the main render
+Camera bench_camera() {
+    Point3 lookfrom(278, 278, -800);
+    Point3 lookat(278, 278, 0);
+    Vec3 vup(0, 1, 0);
+    return Camera(lookfrom, lookat, vup, 40.0, 1.0, 1.0);
+}
+
+// ---------------------------------------------------------------------------------------------
+// BVH build
+
+BenchResult bench_bvh_build(const BenchScene& scene) {
+    BenchResult res("bvh_build", scene.name);
+
+    // small scenes build in microseconds => repeat until we have a measurable amount of time
+    int builds = 0;
+    Timer timer;
+    do {
+        BVH bvh(scene.flat);
+        builds++;
+    } while (timer.seconds() < 0.2);
+
+    res.add("primitives", scene.flat.objects.size());
+    res.add("builds", builds);
+    res.add("ms_per_build", 1000.0 * timer.seconds() / builds);
+    return res;
+}
+
+// one LBVH is rebuilt in place like for a dynamic scene => the arrays are only allocated once
+BenchResult bench_lbvh_build(const BenchScene& scene, const LBVHSettings& settings) {
+    BenchResult res("lbvh_build", scene.name);
+
+    LBVH lbvh(scene.flat, settings);
+    int builds = 0;
+    Timer timer;
+    do {
+        lbvh.build(scene.flat.objects);
+        builds++;
+    } while (timer.seconds() < 0.2);
+
+    res.add("primitives", scene.flat.objects.size());
+    res.add("threads", num_worker_threads(settings.num_threads));
+    res.add("sah_levels", settings.sah_levels);
+    res.add("builds", builds);
+    res.add("ms_per_build", 1000.0 * timer.seconds() / builds);
+    return res;
+}
+
+// bytes of the nodes and of the arrays next to them (the primitives belong to the scene)
+// a BVH.h node holds its children => n - 1 nodes of sizeof(BVH) for n primitives, more with make_shared
+BenchResult bench_bvh_memory(const BenchScene& scene) {
+    BenchResult res("bvh_memory", scene.name);
+    size_t n = scene.flat.objects.size();
+    LBVH lbvh(scene.flat, LBVHSettings(6, 0));
+    CompressedBVH compressed(scene.flat);
+
+    size_t lbvh_bytes = lbvh.nodes.size() * sizeof(LBVH::Node) + n * (sizeof(aabb) + sizeof(shared_ptr<Hittable>) + sizeof(int));
+    res.add("primitives", n);
+    res.add("bvh_bytes", (n - 1) * sizeof(BVH));
+    res.add("lbvh_bytes", lbvh_bytes);
+    res.add("compressed_nodes", compressed.num_nodes());
+    res.add("compressed_bytes", compressed.memory_bytes());
+    return res;
+}
+
+// ---------------------------------------------------------------------------------------------
+// rays/sec against a full scene
+
+// time world.hit over a batch of rays, the hit records are returned so they can seed the next kind of ray
+BenchResult time_rays(const std::string& kind, const std::string& scene_name, const Hittable& world,
+                      const std::vector<Ray>& rays, const std::vector<double>& t_max,
+                      std::vector<Ray>* hit_rays, std::vector<HitRecord>* hit_records) {
+    BenchResult res("rays_" + kind, scene_name);
+
+    size_t hits = 0;
+    Timer timer;
+    for (size_t i = 0; i < rays.size(); i++) {
+        HitRecord rec;
+        if (world.hit(rays[i], epsilon, t_max[i], rec)) {
+            hits++;
+            if (hit_records) {
+                hit_rays->push_back(rays[i]);
+                hit_records->push_back(rec);
+            }
+        }
+    }
+    double seconds = timer.seconds();
+
+    res.add("rays", rays.size());
+    res.add("hit_fraction", rays.empty() ? 0.0 : double(hits) / rays.size());
+    res.add("seconds", seconds);
+    res.add("mrays_per_sec", rays.size() / seconds / 1e6);
+    return res;
+}
+
+void bench_rays(const BenchScene& scene, const Hittable& world, const std::string& scene_name,
+                int resolution, int num_sample_lights, std::vector<BenchResult>& results) {
+    Camera cam = bench_camera();
+
+    // primary => one jittered ray per pixel
+    std::vector<Ray> primary;
+    for (int j = 0; j < resolution; j++) {
+        for (int i = 0; i < resolution; i++) {
+            auto u = (i + random_double()) / (resolution - 1);
+            auto v = (j + random_double()) / (resolution - 1);
+            primary.push_back(cam.get_ray(u, v));
+        }
+    }
+    std::vector<double> primary_t_max(primary.size(), infinity);
+
+    std::vector<Ray> hit_rays;
+    std::vector<HitRecord> hit_records;
+    results.push_back(time_rays("primary", scene_name, world, primary, primary_t_max, &hit_rays, &hit_records));
+
+    // shadow => same as the Shader, num_sample_lights points on each light sampled from the hit point,
+    // up to just before the light (the lights are in the world)
+    std::vector<Ray> shadow;
+    std::vector<double> shadow_t_max;
+    for (const auto& rec : hit_records) {
+        for (int i = 0; i < scene.lights.size(); i++) {
+            for (int s = 0; s < num_sample_lights; s++) {
+                Vec3 light_vector = scene.lights.light(i).random_direction(rec.p);
+                double distance = light_vector.norm();
+                light_vector /= distance;
+                shadow.push_back(Ray(rec.p, light_vector));
+                shadow_t_max.push_back(0.999 * distance);
+            }
+        }
+    }
+    results.push_back(time_rays("shadow", scene_name, world, shadow, shadow_t_max, nullptr, nullptr));
+
+    // secondary => whatever the material scatters at the primary hit
+    std::vector<Ray> secondary;
+    for (size_t i = 0; i < hit_records.size(); i++) {
+        if (hit_records[i].mat_ptr->type() == light_emitter) continue;
+        secondary.push_back(hit_records[i].mat_ptr->scatter(hit_rays[i], hit_records[i]).ray_to_trace);
+    }
+    std::vector<double> secondary_t_max(secondary.size(), infinity);
+    results.push_back(time_rays("secondary", scene_name, world, secondary, secondary_t_max, nullptr, nullptr));
+}
+
+// primary and secondary rays on the cornell box with more and more small lights
+// the lights are in the BVH with the rest => the cost of a ray should barely move with the number of lights
+void bench_light_count(int resolution, std::vector<BenchResult>& results) {
+    for (int extra_lights : {0, 64, 1024}) {
+        SceneArena arena;
+        HittableList flat;
+        LightSources lights;
+        cornell_box_objects(arena, flat, lights);
+        auto light = arena.make<DiffuseLight>(create_color(255, 255, 255));
+        for (int i = 0; i < extra_lights; i++) {
+            Point3 center(random_double(0, 555), random_double(450, 550), random_double(0, 555));
+            add_light(flat, lights, arena.make<Sphere>(center, 2, light));
+        }
+        BVH world(flat);
+        std::string name = "cornell_box_" + std::to_string(lights.size()) + "_lights";
+
+        Camera cam = bench_camera();
+        std::vector<Ray> primary;
+        for (int j = 0; j < resolution; j++) {
+            for (int i = 0; i < resolution; i++) {
+                primary.push_back(cam.get_ray((i + random_double()) / (resolution - 1), (j + random_double()) / (resolution - 1)));
+            }
+        }
+        std::vector<double> t_max(primary.size(), infinity);
+        std::vector<Ray> hit_rays;
+        std::vector<HitRecord> hit_records;
+        results.push_back(time_rays("primary", name, world, primary, t_max, &hit_rays, &hit_records));
+
+        std::vector<Ray> secondary;
+        for (size_t i = 0; i < hit_records.size(); i++) {
+            if (hit_records[i].mat_ptr->type() == light_emitter) continue;
+            secondary.push_back(hit_records[i].mat_ptr->scatter(hit_rays[i], hit_records[i]).ray_to_trace);
+        }
+        t_max.assign(secondary.size(), infinity);
+        results.push_back(time_rays("secondary", name, world, secondary, t_max, nullptr, nullptr));
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// cost of one intersection test per primitive
+
+BenchResult bench_primitive(const std::string& name, const Hittable& object, int num_rays) {
+    BenchResult res("primitive_hit", name);
+
+    aabb box;
+    object.bounding_box(box);
+    Point3 center = 0.5 * (box.min() + box.max());
+    auto radius = 0.5 * (box.max() - box.min()).norm();
+
+    // rays from a sphere around the object aimed at random points of its box => mix of hits and misses
+    std::vector<Ray> rays;
+    for (int i = 0; i < num_rays; i++) {
+        Point3 origin = center + 3 * radius * random_unit_vector();
+        Point3 target(random_double(box.min().x(), box.max().x()),
+                      random_double(box.min().y(), box.max().y()),
+                      random_double(box.min().z(), box.max().z()));
+        rays.push_back(Ray(origin, target - origin));
+    }
+
+    size_t hits = 0;
+    Timer timer;
+    for (const auto& r : rays) {
+        HitRecord rec;
+        if (object.hit(r, epsilon, infinity, rec)) hits++;
+    }
+    double seconds = timer.seconds();
+
+    res.add("tests", num_rays);
+    res.add("hit_fraction", double(hits) / num_rays);
+    res.add("ns_per_test", 1e9 * seconds / num_rays);
+    return res;
+}
+
+void bench_primitives(int num_rays, std::vector<BenchResult>& results) {
+    auto white = make_shared<Matte>(create_color(255, 251, 242));
+    auto red = make_shared<Matte>(create_color(193, 2, 6));
+
+    auto box = make_shared<Box>(Point3(0, 0, 0), Point3(100, 100, 100), white, red);
+
+    results.push_back(bench_primitive("Sphere", Sphere(Point3(0, 0, 0), 100, white), num_rays));
+    results.push_back(bench_primitive("xy_rect", xy_rect(0, 100, 0, 100, 0, white), num_rays));
+    results.push_back(bench_primitive("xz_rect", xz_rect(0, 100, 0, 100, 0, white), num_rays));
+    results.push_back(bench_primitive("yz_rect", yz_rect(0, 100, 0, 100, 0, white), num_rays));
+    results.push_back(bench_primitive("Box", *box, num_rays));
+    results.push_back(bench_primitive("rotate_x(Box)", rotate_x(box, 30), num_rays));
+    results.push_back(bench_primitive("rotate_y(Box)", rotate_y(box, 30), num_rays));
+    results.push_back(bench_primitive("rotate_z(Box)", rotate_z(box, 30), num_rays));
+}
+
+// ---------------------------------------------------------------------------------------------
+// cost of shading one sample per material
+
+BenchResult bench_material(const std::string& name, shared_ptr<Material> material, int num_samples, int num_sample_lights) {
+    BenchResult res("shading", name);
+
+    // one sphere with the material under one light => the cost is dominated by the material code and its shadow rays
+    HittableList world;
+    world.add(make_shared<Sphere>(Point3(0, 0, 0), 100, material));
+    LightSources lights;
+    add_light(world, lights, make_shared<Sphere>(Point3(0, 300, -200), 20, make_shared<DiffuseLight>(create_color(255, 255, 255))));
+
+    Color background(0, 0, 0);
+    Shader shader(background, world, lights, num_sample_lights);
+
+    std::vector<Ray> rays;
+    for (int i = 0; i < num_samples; i++) {
+        Point3 target(random_double(-70, 70), random_double(-70, 70), 0);
+        Point3 origin(0, 0, -400);
+        rays.push_back(Ray(origin, target - origin));
+    }
+
+    // depth 1 => the primary hit is shaded but the secondary ray is not traced
+    Color sum(0, 0, 0);
+    Timer timer;
+    for (const auto& r : rays) {
+        sum += shader.trace(r, 1);
+    }
+    double seconds = timer.seconds();
+
+    res.add("samples", num_samples);
+    res.add("light_samples", num_sample_lights);
+    res.add("mean_luminance", sum.sum() / (3.0 * num_samples)); // also keeps the loop from being optimised away
+    res.add("ns_per_sample", 1e9 * seconds / num_samples);
+    return res;
+}
+
+void bench_materials(int num_samples, int num_sample_lights, std::vector<BenchResult>& results) {
+    auto floral_white = create_color(255, 251, 242);
+    auto raisin_black = create_color(33, 29, 33);
+    auto checker = make_shared<RectCheckerTexture>(floral_white, raisin_black, 555, 555, 20, 20);
+
+    results.push_back(bench_material("Matte", make_shared<Matte>(floral_white), num_samples, num_sample_lights));
+    results.push_back(bench_material("Matte(RectCheckerTexture)", make_shared<Matte>(checker), num_samples, num_sample_lights));
+    results.push_back(bench_material("Metal", make_shared<Metal>(floral_white), num_samples, num_sample_lights));
+    results.push_back(bench_material("FuzzyMetal", make_shared<FuzzyMetal>(floral_white, 0.2), num_samples, num_sample_lights));
+    results.push_back(bench_material("Dielectric", make_shared<Dielectric>(1.5), num_samples, num_sample_lights));
+    results.push_back(bench_material("DiffuseLight", make_shared<DiffuseLight>(floral_white), num_samples, num_sample_lights));
+}
+
+// ---------------------------------------------------------------------------------------------
+// out-of-core render
+
+// root mean square of the difference of two frames of the same size, over the channels
+double frame_rmse(const Framebuffer& a, const Framebuffer& b) {
+    double sum = 0;
+    for (size_t k = 0; k < a.pixels.size(); k++) sum += (a.pixels[k] - b.pixels[k]).squaredNorm();
+    return std::sqrt(sum / (3.0 * a.pixels.size()));
+}
+
+// the spheres and rects of the scene go into chunk files, the lights and everything else stay in memory
+// the budget is a quarter of the chunks => the render has to page them in and out
+// the camera rays are checked against a BVH over the same spheres and rects, the frame against render() with a BVH
+// (1 light sample => the paths stay in the dimensions the sampler makes, the frames only differ by rounding)
+// and the same render() with the scene in the world shows what the rays cost one at a time through hit()
+BenchResult bench_out_of_core(const BenchScene& scene, const std::string& directory, int resolution, int samples) {
+    const int num_sample_lights = 1;
+    BenchResult res("out_of_core", scene.name);
+
+    OutOfCoreSettings ooc_settings;
+    ooc_settings.directory = directory;
+    OutOfCoreScene chunked(ooc_settings);
+    HittableList resident, geometry;
+    aabb bounds, box;
+    for (size_t k = 0; k < scene.flat.objects.size(); k++) {
+        if (scene.flat.objects[k]->bounding_box(box)) bounds = k == 0 ? box : surrounding_box(bounds, box);
+    }
+    OutOfCoreWriter writer(chunked, bounds);
+    for (const auto& object : scene.flat.objects) {
+        const Hittable* o = object.get();
+        const Sphere* sphere = dynamic_cast<const Sphere*>(o);
+        const xy_rect* xy = dynamic_cast<const xy_rect*>(o);
+        const xz_rect* xz = dynamic_cast<const xz_rect*>(o);
+        const yz_rect* yz = dynamic_cast<const yz_rect*>(o);
+        if (scene.lights.index_of(o) >= 0 || !(sphere || xy || xz || yz)) {
+            resident.add(object);
+            continue;
+        }
+        if (sphere) writer.add_sphere(sphere->center, sphere->radius, sphere->mat_ptr);
+        else if (xy) writer.add_xy(xy->x0, xy->x1, xy->y0, xy->y1, xy->k, xy->mp);
+        else if (xz) writer.add_xz(xz->x0, xz->x1, xz->z0, xz->z1, xz->k, xz->mp);
+        else writer.add_yz(yz->y0, yz->y1, yz->z0, yz->z1, yz->k, yz->mp);
+        geometry.add(object);
+    }
+    Timer write_timer;
+    bool written = writer.finish();
+    double write_seconds = write_timer.seconds();
+    if (!written) std::cerr << "cannot write the chunks of " << scene.name << " in " << directory << "\n";
+    const size_t scene_bytes = chunked.total_bytes();
+    chunked.set_memory_budget(scene_bytes / 4);
+
+    // same closest hits as a BVH over the same primitives
+    Camera cam = bench_camera();
+    std::vector<Ray> rays;
+    for (int j = 0; j < resolution; j++) {
+        for (int i = 0; i < resolution; i++) {
+            rays.push_back(cam.get_ray((i + random_double()) / (resolution - 1), (j + random_double()) / (resolution - 1)));
+        }
+    }
+    BVH geometry_bvh(geometry);
+    std::vector<HitRecord> recs;
+    std::vector<char> hits;
+    chunked.intersect(rays, epsilon, nullptr, recs, hits);
+    int mismatches = 0;
+    for (size_t k = 0; k < rays.size(); k++) {
+        HitRecord rec;
+        bool hit = geometry_bvh.hit(rays[k], epsilon, infinity, rec);
+        if (hit != bool(hits[k]) || (hit && rec.t != recs[k].t)) mismatches++;
+    }
+
+    RenderSettings settings;
+    settings.image_width = settings.image_height = resolution;
+    settings.samples = samples;
+    settings.show_progress = false;
+    Color background(0, 0, 0);
+
+    // the shader picks the light positions of emit_light() at random => the same seed for both shaders
+    BVH world(scene.flat);
+    seed_random(5);
+    Shader shader(background, world, scene.lights, num_sample_lights);
+    Framebuffer reference;
+    Timer in_core_timer;
+    render(cam, shader, settings, reference);
+    double in_core_seconds = in_core_timer.seconds();
+
+    chunked.set_memory_budget(scene_bytes / 4); // the check above paged chunks in
+    seed_random(5);
+    Shader resident_shader(background, resident, scene.lights, num_sample_lights);
+    Framebuffer frame;
+    Timer timer;
+    render_out_of_core(cam, resident_shader, chunked, &resident, settings, frame);
+    double seconds = timer.seconds();
+    ChunkCacheStats stats = chunked.cache_stats();
+
+    HittableList per_ray_world;
+    per_ray_world.objects = resident.objects;
+    per_ray_world.add(shared_ptr<Hittable>(shared_ptr<Hittable>(), &chunked)); // not owned
+    chunked.set_memory_budget(scene_bytes / 4);
+    seed_random(5);
+    Shader per_ray_shader(background, per_ray_world, scene.lights, num_sample_lights);
+    Framebuffer per_ray_frame;
+    Timer per_ray_timer;
+    render(cam, per_ray_shader, settings, per_ray_frame);
+    double per_ray_seconds = per_ray_timer.seconds();
+    ChunkCacheStats per_ray_stats = chunked.cache_stats();
+    chunked.remove_files();
+
+    double mean = 0;
+    for (const Color& c : reference.pixels) mean += c.sum();
+    mean /= 3.0 * reference.pixels.size();
+
+    res.add("primitives", geometry.objects.size());
+    res.add("chunks", chunked.num_chunks());
+    res.add("scene_mb", scene_bytes / 1e6);
+    res.add("budget_mb", scene_bytes / 4 / 1e6);
+    res.add("write_seconds", write_seconds);
+    res.add("camera_ray_mismatches", mismatches);
+    res.add("samples_per_pixel", samples);
+    res.add("in_core_seconds", in_core_seconds);
+    res.add("seconds", seconds);
+    res.add("page_ins", stats.page_ins);
+    res.add("evictions", stats.evictions);
+    res.add("mb_read", stats.bytes_read / 1e6);
+    res.add("mean_luminance", mean);
+    res.add("rmse_vs_in_core", frame_rmse(frame, reference));
+    res.add("per_ray_seconds", per_ray_seconds);
+    res.add("per_ray_page_ins", per_ray_stats.page_ins);
+    return res;
+}
+
+// ---------------------------------------------------------------------------------------------
+// output
+
+void write_json(std::ostream& out, const std::vector<BenchResult>& results, bool quick) {
+    out << "{\n";
+    out << "  \"version\": 1,\n";
+    out << "  \"quick\": " << (quick ? "true" : "false") << ",\n";
+    out << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        out << "    {\"group\": \"" << r.group << "\", \"name\": \"" << r.name << "\"";
+        for (const auto& metric : r.metrics) {
+            out << ", \"" << metric.first << "\": ";
+            if (std::isfinite(metric.second)) out << metric.second;
+            else out << "null"; // JSON has no inf/nan
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+int main(int argc, char** argv) {
+    bool quick = false;
+    std::string out_file;
+    std::string chunk_directory = ".";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--quick") quick = true;
+        else if (arg == "--out" && i + 1 < argc) out_file = argv[++i];
+        else if (arg == "--chunks" && i + 1 < argc) chunk_directory = argv[++i];
+        else {
+            std::cerr << "usage: bench [--quick] [--out results.json] [--chunks directory]\n";
+            return 1;
+        }
+    }
+
+    seed_random(1); // same scenes and rays on every run
+    const int num_sample_lights = 8;
+    const int resolution = quick ? 64 : 256;
+    const int num_primitive_rays = quick ? 100000 : 1000000;
+    const int num_shading_samples = quick ? 10000 : 100000;
+
+    // the *_set scenes have the same primitives as the scene before them in one SphereSet / RectSet
+    const int num_spheres = quick ? 10000 : 30000;
+    const int floor_tiles = quick ? 50 : 150;
+    std::vector<BenchScene> scenes(6);
+    scenes[0].name = "cornell_box";
+    cornell_box_objects(scenes[0].arena, scenes[0].flat, scenes[0].lights);
+    scenes[1].name = "random_spheres_" + std::to_string(num_spheres / 1000) + "k";
+    seed_random(10);
+    random_spheres_objects(scenes[1].arena, scenes[1].flat, scenes[1].lights, num_spheres, quick ? 15 : 10);
+    scenes[2].name = scenes[1].name + "_set";
+    seed_random(10);
+    random_spheres_objects(scenes[2].arena, scenes[2].flat, scenes[2].lights, num_spheres, quick ? 15 : 10, true);
+    scenes[3].name = quick ? "random_boxes_2k" : "random_boxes_10k";
+    random_boxes_objects(scenes[3].arena, scenes[3].flat, scenes[3].lights, quick ? 2000 : 10000, quick ? 20 : 12);
+    scenes[4].name = "tiled_floor_" + std::to_string(floor_tiles * floor_tiles);
+    tiled_floor_objects(scenes[4].arena, scenes[4].flat, scenes[4].lights, floor_tiles);
+    scenes[5].name = scenes[4].name + "_set";
+    tiled_floor_objects(scenes[5].arena, scenes[5].flat, scenes[5].lights, floor_tiles, true);
+
+    std::vector<BenchResult> results;
+    for (const auto& scene : scenes) {
+        std::cerr << "scene " << scene.name << "\n";
+        results.push_back(bench_bvh_build(scene));
+        results.push_back(bench_lbvh_build(scene, LBVHSettings(0, 1)));
+        results.push_back(bench_lbvh_build(scene, LBVHSettings(0, 0)));
+        results.push_back(bench_lbvh_build(scene, LBVHSettings(6, 0)));
+        results.push_back(bench_bvh_memory(scene));
+
+        // same rays against the four trees => what the faster builds cost at render time
+        seed_random(2);
+        bench_rays(scene, BVH(scene.flat), scene.name, resolution, num_sample_lights, results);
+        seed_random(2);
+        bench_rays(scene, LBVH(scene.flat), scene.name + " (LBVH)", resolution, num_sample_lights, results);
+        seed_random(2);
+        bench_rays(scene, LBVH(scene.flat, LBVHSettings(6, 0)), scene.name + " (LBVH+SAH)", resolution, num_sample_lights, results);
+        seed_random(2);
+        bench_rays(scene, CompressedBVH(scene.flat), scene.name + " (compressed)", resolution, num_sample_lights, results);
+    }
+
+    std::cerr << "lights\n";
+    seed_random(3);
+    bench_light_count(resolution, results);
+
+    std::cerr << "primitives\n";
+    bench_primitives(num_primitive_rays, results);
+
+    std::cerr << "materials\n";
+    bench_materials(num_shading_samples, num_sample_lights, results);
+
+    // the random spheres and the tiled floor as separate objects => they can be cut into chunks
+    std::cerr << "out of core\n";
+    for (int k : {1, 4}) {
+        seed_random(4);
+        results.push_back(bench_out_of_core(scenes[k], chunk_directory, resolution / 2, quick ? 2 : 8));
+    }
+
+    if (out_file.empty()) {
+        write_json(std::cout, results, quick);
+    } else {
+        std::ofstream out(out_file);
+        write_json(out, results, quick);
+    }
+    return 0;
+}
@@ -0,0 +1,264 @@
+#include "utility.h" // includes vec3 and ray
+#include "Color.h"
+#include "HittableList.h"
+#include "Camera.h"
+#include "Shader.h"
+#include "BVH.h"
+#include "Scenes.h"
+#include "Renderer.h"
+#include "Sampler.h"
+#include "Timer.h"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+Time to quality => how long the current build takes to reach a given noise level
+
+Rays/sec says nothing about a sampler or a shading change that needs fewer rays for the same image,
+and a faster tree that makes the image wrong looks like a win. What we want is the error against the right image
+for the time spent, so for every canonical scene:
+    a reference is rendered once with many samples and kept as a PFM file in the references directory
+    (rendered again when the size or the sample count changes, or with --rebuild-references)
+    then whole renders with 1, 2, 4, 8... samples per pixel are timed and compared to the reference
+    until a render takes more than --max-seconds
+Every render is a separate render() => the sampler spreads each sample count properly, like a normal render would.
+
+The errors:
+    rmse   => root mean square error of the 8 bit displayed values (gamma 2, what the README numbers use)
+    relmse => mean of (x - ref)^2 / (ref^2 + 0.01) over the linear colors => the dark parts count as much as the bright ones
+    psnr   => 20 log10(255 / rmse) in dB
+The counts stop at reference_samples / 16, past that the noise of the reference itself starts to show in the errors.
+
+The number to track is the time to reach --target-relmse for each scene, interpolated on the log-log curve
+between the two renders around it (extrapolated from the last one with relMSE ~ 1/time if no render got there),
+and the geometric mean of these times over the scenes.
+
+usage: quality [--quick] [--width N] [--reference-samples N] [--max-seconds S] [--sampler NAME] [--threads N]
+               [--references DIR] [--rebuild-references] [--target-relmse X] [--out curves.csv] [--summary summary.csv]
+    --quick => small images, a short reference and short budgets so the whole thing runs in about a minute
+*/
+
+struct QualityScene {
+    SceneArena arena; // first => destroyed after the lists that point into it
+    std::string name;
+    HittableList objects;
+    LightSources lights;
+};
+
+struct ErrorMetrics {
+    double rmse = 0;
+    double relmse = 0;
+    double psnr = 0;
+};
+
+// one render of the curve
+struct CurvePoint {
+    int samples;
+    double seconds;
+    ErrorMetrics error;
+};
+
+ErrorMetrics compare(const Framebuffer& image, const Framebuffer& reference) {
+    double squared = 0, relative = 0;
+    for (size_t k = 0; k < image.pixels.size(); k++) {
+        RGB a = scale_color(image.pixels[k], 1), b = scale_color(reference.pixels[k], 1);
+        for (int c = 0; c < 3; c++) {
+            double d = double(a[c]) - double(b[c]);
+            squared += d * d;
+            double x = image.pixels[k][c], ref = reference.pixels[k][c];
+            relative += (x - ref) * (x - ref) / (ref * ref + 0.01);
+        }
+    }
+    size_t n = 3 * image.pixels.size();
+    ErrorMetrics res;
+    res.rmse = std::sqrt(squared / n);
+    res.relmse = relative / n;
+    res.psnr = res.rmse > 0 ? 20 * std::log10(255 / res.rmse) : infinity;
+    return res;
+}
+
+// PFM => floats, rows from the bottom, little endian when the scale is negative
+bool write_pfm(const std::string& filename, const Framebuffer& frame, int samples) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) return false;
+    out << "PF\n" << frame.width << " " << frame.height << "\n-1.0\n";
+    for (int row = frame.height - 1; row >= 0; row--) {
+        for (int col = 0; col < frame.width; col++) {
+            float rgb[3] = {float(frame(row, col).x()), float(frame(row, col).y()), float(frame(row, col).z())};
+            out.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+        }
+    }
+    // the sample count goes after the pixels => readers of PFM ignore it
+    out << "\n" << samples << "\n";
+    return bool(out);
+}
+
+bool read_pfm(const std::string& filename, Framebuffer& frame, int& samples) {
+    std::ifstream in(filename, std::ios::binary);
+    std::string magic;
+    int width = 0, height = 0;
+    double scale = 0;
+    if (!(in >> magic >> width >> height >> scale) || magic != "PF" || scale >= 0 || width <= 0 || height <= 0) return false;
+    in.get(); // the single white space before the pixels
+    frame = Framebuffer(width, height);
+    for (int row = height - 1; row >= 0; row--) {
+        for (int col = 0; col < width; col++) {
+            float rgb[3];
+            if (!in.read(reinterpret_cast<char*>(rgb), sizeof(rgb))) return false;
+            frame(row, col) = Color(rgb[0], rgb[1], rgb[2]);
+        }
+    }
+    samples = 0;
+    in >> samples;
+    return true;
+}
+
+// from the references directory if it was made with the same size and sample count, rendered and saved otherwise
+Framebuffer reference_image(const QualityScene& scene, const Shader& shader, const Camera& camera, RenderSettings settings,
+                            int reference_samples, const std::string& directory, bool rebuild) {
+    std::string filename = directory + "/" + scene.name + "_" + std::to_string(settings.image_width) + ".pfm";
+    Framebuffer reference;
+    int samples = 0;
+    if (!rebuild && read_pfm(filename, reference, samples) && samples == reference_samples
+        && reference.width == settings.image_width && reference.height == settings.image_height) {
+        std::cerr << "  reference " << filename << "\n";
+        return reference;
+    }
+
+    settings.samples = reference_samples;
+    settings.sampler = stratified_sampler;
+    Timer timer;
+    render(camera, shader, settings, reference);
+    std::cerr << "  reference rendered in " << timer.seconds() << "s";
+    if (write_pfm(filename, reference, reference_samples)) std::cerr << " => " << filename << "\n";
+    else std::cerr << ", cannot write " << filename << "\n";
+    return reference;
+}
+
+// seconds to reach target, interpolated on the log-log curve, extrapolated => relMSE ~ 1/time after the last point
+double time_to_target(const std::vector<CurvePoint>& curve, double target, bool& extrapolated) {
+    extrapolated = false;
+    for (size_t k = 0; k < curve.size(); k++) {
+        if (curve[k].error.relmse > target) continue;
+        if (k == 0) return curve[0].seconds;
+        const CurvePoint& a = curve[k - 1];
+        const CurvePoint& b = curve[k];
+        double f = std::log(a.error.relmse / target) / std::log(a.error.relmse / b.error.relmse);
+        return std::exp(std::log(a.seconds) + f * std::log(b.seconds / a.seconds));
+    }
+    if (curve.empty()) return infinity;
+    extrapolated = true;
+    return curve.back().seconds * curve.back().error.relmse / target;
+}
+
+int main(int argc, char** argv) {
+    bool quick = false;
+    bool rebuild = false;
+    int width = 0;
+    int reference_samples = 0;
+    double max_seconds = 0;
+    double target_relmse = 0.01;
+    int num_threads = 0;
+    SamplerType sampler = stratified_sampler;
+    std::string references = ".";
+    std::string out_file, summary_file;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--quick") quick = true;
+        else if (arg == "--rebuild-references") rebuild = true;
+        else if (arg == "--width" && i + 1 < argc) width = atoi(argv[++i]);
+        else if (arg == "--reference-samples" && i + 1 < argc) reference_samples = atoi(argv[++i]);
+        else if (arg == "--max-seconds" && i + 1 < argc) max_seconds = atof(argv[++i]);
+        else if (arg == "--target-relmse" && i + 1 < argc) target_relmse = atof(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc) num_threads = atoi(argv[++i]);
+        else if (arg == "--sampler" && i + 1 < argc && parse_sampler_type(argv[i + 1], sampler)) i++;
+        else if (arg == "--references" && i + 1 < argc) references = argv[++i];
+        else if (arg == "--out" && i + 1 < argc) out_file = argv[++i];
+        else if (arg == "--summary" && i + 1 < argc) summary_file = argv[++i];
+        else {
+            std::cerr << "usage: quality [--quick] [--width N] [--reference-samples N] [--max-seconds S] [--sampler NAME] [--threads N]\n"
+                         "               [--references DIR] [--rebuild-references] [--target-relmse X] [--out curves.csv] [--summary summary.csv]\n";
+            return 1;
+        }
+    }
+    if (width <= 0) width = quick ? 64 : 128;
+    if (reference_samples <= 0) reference_samples = quick ? 256 : 1024;
+    if (max_seconds <= 0) max_seconds = quick ? 2 : 30;
+
+    // same scenes on every run
+    std::vector<QualityScene> scenes(3);
+    scenes[0].name = "cornell_box";
+    cornell_box(scenes[0].arena, scenes[0].objects, scenes[0].lights);
+    scenes[1].name = "random_spheres_500";
+    seed_random(10);
+    random_spheres(scenes[1].arena, scenes[1].objects, scenes[1].lights, 500, 30);
+    scenes[2].name = "tiled_floor_400";
+    {
+        HittableList tiles;
+        tiled_floor_objects(scenes[2].arena, tiles, scenes[2].lights, 20);
+        scenes[2].objects.add(scenes[2].arena.make<BVH>(tiles, &scenes[2].arena));
+    }
+
+    RenderSettings settings;
+    settings.image_width = width;
+    settings.image_height = width;
+    settings.max_depth = 5;
+    settings.num_threads = num_threads;
+    settings.sampler = sampler;
+    settings.show_progress = false;
+    const int num_sample_lights = 8;
+    const Color background(0, 0, 0); // the shader keeps a reference to it
+    Camera camera(Point3(278, 278, -800), Point3(278, 278, 0), Vec3(0, 1, 0), 40.0, 1.0, 1.0);
+
+    std::ofstream out_stream;
+    if (!out_file.empty()) out_stream.open(out_file);
+    std::ostream& out = out_file.empty() ? std::cout : out_stream;
+    out << "scene,sampler,samples,seconds,rmse,relmse,psnr\n";
+
+    std::vector<double> times;
+    std::vector<std::string> summary;
+    for (const QualityScene& scene : scenes) {
+        std::cerr << "scene " << scene.name << "\n";
+        Shader shader(background, scene.objects, scene.lights, num_sample_lights);
+        Framebuffer reference = reference_image(scene, shader, camera, settings, reference_samples, references, rebuild);
+
+        std::vector<CurvePoint> curve;
+        for (int samples = 1; samples <= std::max(1, reference_samples / 16); samples *= 2) {
+            settings.samples = samples;
+            Framebuffer frame;
+            Timer timer;
+            render(camera, shader, settings, frame);
+            CurvePoint point{samples, timer.seconds(), compare(frame, reference)};
+            curve.push_back(point);
+
+            out << scene.name << "," << sampler_name(sampler) << "," << samples << "," << point.seconds << ","
+                << point.error.rmse << "," << point.error.relmse << "," << point.error.psnr << "\n";
+            std::cerr << "  " << samples << " spp  " << point.seconds << "s  rmse " << point.error.rmse
+                      << "  relmse " << point.error.relmse << "  psnr " << point.error.psnr << "\n";
+            if (point.seconds > max_seconds) break;
+        }
+
+        bool extrapolated;
+        double seconds = time_to_target(curve, target_relmse, extrapolated);
+        times.push_back(seconds);
+        summary.push_back(scene.name + "," + std::to_string(seconds) + "," + (extrapolated ? "true" : "false"));
+        std::cerr << "  relmse " << target_relmse << " after " << seconds << "s" << (extrapolated ? " (extrapolated)" : "") << "\n";
+    }
+
+    double log_sum = 0;
+    for (double t : times) log_sum += std::log(t);
+    double geometric_mean = std::exp(log_sum / times.size());
+    std::cerr << "time to relmse " << target_relmse << ", geometric mean over the scenes: " << geometric_mean << "s\n";
+
+    if (!summary_file.empty()) {
+        std::ofstream s(summary_file);
+        s << "scene,seconds_to_target,extrapolated\n";
+        for (const std::string& line : summary) s << line << "\n";
+        s << "geometric_mean," << geometric_mean << ",\n";
+    }
+    return 0;
+}
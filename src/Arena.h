@@ -0,0 +1,112 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using std::shared_ptr;
+
+/*
+Arena for everything a scene is made of => primitives, instances, materials, textures and BVH nodes
+
+With make_shared every object is its own heap allocation with its own reference count next to it,
+so the objects of a scene end up all over the heap and the BVH traversal jumps around memory.
+
+The arena keeps one pool per type: all the spheres are next to each other, all the xz_rects, all the BVH nodes, ...
+A pool grows by chunks of objects that never move so a pointer to an object stays valid while the scene is built.
+
+arena.make<T>(...) is used exactly like make_shared<T>(...) and still returns a shared_ptr so the scene code does not change,
+a rotate_y can still take the Box it rotates. But that shared_ptr is only a handle => it has no reference count at all
+(aliasing constructor with an empty owner), copying it is copying a pointer.
+The arena owns every object and destroys all of them at once when it goes away
+=> THE ARENA HAS TO OUTLIVE THE SCENE, declare it before the lists and the shader that use the objects.
+
+    SceneArena arena;
+    auto white = arena.make<Matte>(create_color(255, 251, 242));
+    objects.add(arena.make<Sphere>(Point3(150, 100, 400), 120, white));
+
+make() is not thread safe => build the scene on one thread (rendering afterwards is fine, the objects are only read).
+*/
+
+class SceneArena {
+    public:
+        SceneArena() {}
+        SceneArena(SceneArena&&) = default;
+        SceneArena& operator=(SceneArena&&) = default;
+        SceneArena(const SceneArena&) = delete;
+        SceneArena& operator=(const SceneArena&) = delete;
+
+        template <class T, class... Args>
+        shared_ptr<T> make(Args&&... args) {
+            // the slot is taken before the constructor runs => a BVH node can make its children in the same pool
+            T* object = new (get_pool<T>().allocate()) T(std::forward<Args>(args)...);
+            // aliasing constructor with an empty owner => points to the object, owns nothing
+            return shared_ptr<T>(shared_ptr<T>(), object);
+        }
+
+        // number of objects and bytes reserved for them, all the types together
+        size_t num_objects() const {
+            size_t n = 0;
+            for (const auto& pool : pools) n += pool.second->size();
+            return n;
+        }
+
+        size_t bytes() const {
+            size_t n = 0;
+            for (const auto& pool : pools) n += pool.second->bytes();
+            return n;
+        }
+
+    private:
+        class PoolBase {
+            public:
+                virtual ~PoolBase() {}
+                virtual size_t size() const = 0;
+                virtual size_t bytes() const = 0;
+        };
+
+        // objects of one type in chunks of chunk_size => a new chunk never moves the objects already made
+        template <class T>
+        class Pool : public PoolBase {
+            public:
+                static const size_t chunk_size = 256;
+                typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+                Pool() : constructed(0) {}
+
+                ~Pool() {
+                    for (size_t i = constructed; i-- > 0;) {
+                        reinterpret_cast<T*>(&chunks[i / chunk_size][i % chunk_size])->~T();
+                    }
+                }
+
+                void* allocate() {
+                    if (constructed == chunks.size() * chunk_size) chunks.emplace_back(new Slot[chunk_size]);
+                    size_t i = constructed++;
+                    return &chunks[i / chunk_size][i % chunk_size];
+                }
+
+                virtual size_t size() const override { return constructed; }
+                virtual size_t bytes() const override { return chunks.size() * chunk_size * sizeof(Slot); }
+
+            public:
+                std::vector<std::unique_ptr<Slot[]>> chunks;
+                size_t constructed;
+        };
+
+        template <class T>
+        Pool<T>& get_pool() {
+            std::unique_ptr<PoolBase>& pool = pools[std::type_index(typeid(T))];
+            if (!pool) pool.reset(new Pool<T>());
+            return static_cast<Pool<T>&>(*pool);
+        }
+
+        std::unordered_map<std::type_index, std::unique_ptr<PoolBase>> pools;
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include "aabb.h"
 #include "Ray.h"
 #include "Hittable.h"
+#include "Arena.h"
 #include <vector>
 #include <algorithm>
 
@@ -42,6 +43,9 @@ To do this in C++ => you need to use std::sort
 
 Doing BVH(list) returns a hittable that is A TREE as the constructor recursively divides everything on its own...
 
+BVH(list, &arena) puts all the nodes of the tree in the arena of the scene (see Arena.h) instead of one make_shared per node
+=> the nodes are next to each other in memory.
+
 */
 
 // we need to create a comparator to sort hte objects based on the axes
@@ -78,10 +82,10 @@ class BVH : public Hittable {
     public:
         BVH();
         // calls the comparator that does the work with a start and an end pointer into the list. Needs to specify which axis to use as well
-        BVH(const HittableList& list) : BVH(list.objects, 0, list.objects.size(), 0) {}
+        BVH(const HittableList& list, SceneArena* arena = nullptr) : BVH(list.objects, 0, list.objects.size(), 0, arena) {}
         BVH(const std::vector<shared_ptr<Hittable>>& src_objects, size_t start, size_t end) : BVH(src_objects, start, end, 0) {}
 
-        BVH(const std::vector<shared_ptr<Hittable>>& src_objects, size_t start, size_t end, int axis) {
+        BVH(const std::vector<shared_ptr<Hittable>>& src_objects, size_t start, size_t end, int axis, SceneArena* arena = nullptr) {
             auto objects = src_objects; // Create a modifiable array of the source scene objects
 
             // pick a comparator based on the axis
@@ -114,8 +118,9 @@ class BVH : public Hittable {
                 // find midpoint and recurse on mid...
                 // pick the next logical axis using % => we divide on x, then on y, then on z and so on...
                 auto mid = start + object_span/2;
-                left = make_shared<BVH>(objects, start, mid, (axis + 1) % 3);
-                right = make_shared<BVH>(objects, mid, end, (axis + 1) % 3);
+                int next_axis = (axis + 1) % 3;
+                left = arena ? arena->make<BVH>(objects, start, mid, next_axis, arena) : make_shared<BVH>(objects, start, mid, next_axis);
+                right = arena ? arena->make<BVH>(objects, mid, end, next_axis, arena) : make_shared<BVH>(objects, mid, end, next_axis);
             }
 
             aabb box_left, box_right;
@@ -125,16 +130,30 @@ class BVH : public Hittable {
             box = surrounding_box(box_left, box_right); // the root is a box that contains the other two boxes
         }
 
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override {
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            STAT_INC(stat_bvh_nodes);
             if (!box.hit(r, t_min, t_max)) return false;
 
             // the left and the right are HITTABLE OBJECTS...
             // so we can recurse into a hit record with just this
             bool hit_left = left->hit(r, t_min, t_max, rec);
+            if (left == right) return hit_left; // a node with a single object has it on both sides => test it once
             bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
             return hit_left || hit_right;
         }
 
+        // the rays that do not enter the box are put aside and come back active after the children
+        virtual void occlude(ShadowPacket& packet) const override {
+            STAT_INC(stat_bvh_nodes);
+            uint32_t entering = packet.enter(box, packet.active);
+            if (!entering) return;
+            uint32_t others = packet.active & ~entering;
+            packet.active = entering;
+            left->occlude(packet);
+            if (left != right && packet.active) right->occlude(packet);
+            packet.active |= others;
+        }
+
         virtual bool bounding_box(aabb& output_box) const override {
             output_box = box;
             return true;
@@ -144,6 +163,16 @@ class BVH : public Hittable {
             return left->name() +  " BVH " + right->name();
         }
 
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            if (!left->rasterize(out, owner, to_world)) return false;
+            return left == right || right->rasterize(out, owner, to_world);
+        }
+
+        virtual void list_primitives(std::vector<const Hittable*>& out) const override {
+            left->list_primitives(out);
+            if (left != right) right->list_primitives(out);
+        }
+
         virtual Vec3 random_surface_point() const override {
             int rand = random_int(0, 1);
             return rand == 0 ? left->random_surface_point() : right->random_surface_point();
@@ -0,0 +1,172 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "utility.h"
+#include "Camera.h"
+#include "Image.h"
+#include "Renderer.h"
+#include "Shader.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Headless batch rendering => many cameras and frames from one process
+
+The scene and its BVH are built once and every frame is rendered with the same shader.
+No window is opened, each frame is saved on a background thread while the next one is rendering.
+
+A batch file has one frame per line made of key=value pairs, anything not given keeps the default:
+
+    # lookfrom and lookat are x,y,z
+    lookfrom=278,278,-800 lookat=278,278,0 fov=40 width=500 height=500 spp=7 depth=5 out=front.png
+    lookfrom=150,50,-200 lookat=370,350,400 fov=60 out=inside.png
+    samples=20 sampler=sobol out=sobol.png      # any sample count, sampler names in Sampler.h
+
+A turntable can also be generated from a single camera => the camera goes around lookat along vup.
+*/
+
+struct FrameSpec {
+    Point3 lookfrom = Point3(278, 278, -800);
+    Point3 lookat = Point3(278, 278, 0);
+    Vec3 vup = Vec3(0, 1, 0);
+    double field_of_view = 40.0;
+    RenderSettings settings;
+    std::string output;
+
+    Camera camera() const {
+        double aspect_ratio = double(settings.image_width) / settings.image_height;
+        return Camera(lookfrom, lookat, vup, field_of_view, aspect_ratio, 1.0);
+    }
+};
+
+// default name of frame i => frame_0000.png, frame_0001.png, ...
+inline std::string frame_name(int i) {
+    char name[32];
+    snprintf(name, sizeof(name), "frame_%04d.png", i);
+    return name;
+}
+
+inline bool parse_vec3(const std::string& text, Vec3& v) {
+    double x, y, z;
+    if (sscanf(text.c_str(), "%lf,%lf,%lf", &x, &y, &z) != 3) return false;
+    v = Vec3(x, y, z);
+    return true;
+}
+
+// returns false if a line of the file could not be read
+inline bool read_batch_file(const std::string& filename, const FrameSpec& defaults, std::vector<FrameSpec>& frames) {
+    std::ifstream in(filename);
+    if (!in) {
+        std::cerr << "cannot open batch file " << filename << "\n";
+        return false;
+    }
+
+    std::string line;
+    int line_number = 0;
+    while (std::getline(in, line)) {
+        line_number++;
+        std::istringstream tokens(line);
+        std::string token;
+        FrameSpec frame = defaults;
+        bool empty = true;
+
+        while (tokens >> token) {
+            if (token[0] == '#') break;
+            empty = false;
+
+            auto eq = token.find('=');
+            std::string key = token.substr(0, eq);
+            std::string value = eq == std::string::npos ? "" : token.substr(eq + 1);
+
+            bool ok = !value.empty();
+            if (key == "lookfrom") ok = ok && parse_vec3(value, frame.lookfrom);
+            else if (key == "lookat") ok = ok && parse_vec3(value, frame.lookat);
+            else if (key == "vup") ok = ok && parse_vec3(value, frame.vup);
+            else if (key == "fov") frame.field_of_view = atof(value.c_str());
+            else if (key == "width") frame.settings.image_width = atoi(value.c_str());
+            else if (key == "height") frame.settings.image_height = atoi(value.c_str());
+            else if (key == "spp") frame.settings.samples_per_pixel = atoi(value.c_str());
+            else if (key == "samples") frame.settings.samples = atoi(value.c_str());
+            else if (key == "sampler") ok = ok && parse_sampler_type(value, frame.settings.sampler);
+            else if (key == "depth") frame.settings.max_depth = atoi(value.c_str());
+            else if (key == "out") frame.output = value;
+            else ok = false;
+
+            if (!ok) {
+                std::cerr << filename << ":" << line_number << ": cannot read '" << token << "'\n";
+                return false;
+            }
+        }
+
+        if (empty) continue;
+        if (frame.output.empty()) frame.output = frame_name(static_cast<int>(frames.size()));
+        frames.push_back(frame);
+    }
+    return true;
+}
+
+// num_frames cameras evenly spaced on the circle that base.lookfrom makes around base.lookat (axis is vup)
+// the images are numbered from first_index => frame_<first_index>.png, ... (after the frames of a batch file)
+inline std::vector<FrameSpec> turntable(const FrameSpec& base, int num_frames, int first_index = 0) {
+    std::vector<FrameSpec> frames;
+    Vec3 axis = base.vup.normalized();
+    Vec3 offset = base.lookfrom - base.lookat;
+    Vec3 along_axis = offset.dot(axis) * axis;
+    Vec3 radial = offset - along_axis;
+    Vec3 tangent = axis.cross(radial);
+
+    for (int i = 0; i < num_frames; i++) {
+        double angle = 2 * pi * i / num_frames;
+        FrameSpec frame = base;
+        frame.lookfrom = base.lookat + along_axis + cos(angle) * radial + sin(angle) * tangent;
+        frame.output = frame_name(first_index + i);
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+// saves images on a background thread => only one save in flight, the next save waits for the previous one
+class AsyncSaver {
+    public:
+        ~AsyncSaver() { wait(); }
+
+        void save(const Image& image, const std::string& filename) {
+            wait();
+            pending = std::thread([](Image to_save, std::string name) { to_save.save(name); }, image, filename);
+        }
+
+        void wait() {
+            if (pending.joinable()) pending.join();
+        }
+
+    private:
+        std::thread pending;
+};
+
+inline void render_batch(const std::vector<FrameSpec>& frames, const Shader& shader) {
+    AsyncSaver saver;
+
+    for (size_t f = 0; f < frames.size(); f++) {
+        const FrameSpec& spec = frames[f];
+        std::cerr << "Frame " << f + 1 << "/" << frames.size() << " => " << spec.output << "\n";
+
+        auto start = std::chrono::steady_clock::now();
+        Framebuffer frame;
+        render(spec.camera(), shader, spec.settings, frame);
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        std::cerr << "    rendered in " << seconds.count() << "s\n";
+
+        // a new Image per frame => the saver thread owns the pixels of the previous one
+        Image image(spec.settings.image_width, spec.settings.image_height);
+        to_image(frame, image);
+        saver.save(image, spec.output);
+    }
+}
+
+#endif
@@ -4,50 +4,49 @@
 #include "utility.h"
 
 #include "aarect.h"
-#include "HittableList.h"
+#include "Stats.h"
 
 /*
  A box is 6 rectangles => we use aarects here
 the box is axis aligned => WE ROTATE IT USING INSTANCES...
 
-store a list of 6 aarects. to intersect, check which object from the list the ray hits first
+the 6 aarects are stored inside the box (not in a list of pointers) => a box is one object in memory and building it allocates nothing.
+to intersect, check which of the rectangles the ray hits first
 bounding box is itself.
 */
 class Box : public Hittable  {
     public:
         Box() {}
-        Box(const Point3& p0, const Point3& p1, shared_ptr<Material> ptr) {
-            box_min = p0;
-            box_max = p1;
-
-            // make six rectangles, one for each sides
-            sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-            sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
-
-            sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-            sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
-
-            sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-            sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
-        }
+        Box(const Point3& p0, const Point3& p1, shared_ptr<Material> ptr) : Box(p0, p1, ptr, ptr) {}
 
+        // ptr1 is used for the sides at p1 and ptr2 for the sides at p0
         Box(const Point3& p0, const Point3& p1, shared_ptr<Material> ptr1, shared_ptr<Material> ptr2) {
             box_min = p0;
             box_max = p1;
             
             // make six rectangles, one for each sides
-            sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr1));
-            sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr2));
+            xy[0] = xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr1);
+            xy[1] = xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr2);
 
-            sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr1));
-            sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr2));
+            xz[0] = xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr1);
+            xz[1] = xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr2);
 
-            sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr1));
-            sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr2));
+            yz[0] = yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr1);
+            yz[1] = yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr2);
         }
 
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override {
-            return sides.hit(r, t_min, t_max, rec);
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            STAT_INC(stat_box_tests);
+            // the rects only write rec when they are hit => shrinking t_max keeps the closest one
+            bool hit_anything = false;
+            for (int i = 0; i < 2; i++) {
+                if (xy[i].hit(r, t_min, t_max, rec)) { hit_anything = true; t_max = rec.t; }
+                if (xz[i].hit(r, t_min, t_max, rec)) { hit_anything = true; t_max = rec.t; }
+                if (yz[i].hit(r, t_min, t_max, rec)) { hit_anything = true; t_max = rec.t; }
+            }
+            if (!hit_anything) return false;
+            rec.object = this;
+            return true;
         }
 
         virtual bool bounding_box(aabb& output_box) const override {
@@ -58,14 +57,29 @@ class Box : public Hittable  {
             return "box";
         }
 
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            // the sides keep the box as the owner => same object as Box::hit() reports
+            for (int i = 0; i < 2; i++) {
+                xy[i].rasterize(out, owner ? owner : this, to_world);
+                xz[i].rasterize(out, owner ? owner : this, to_world);
+                yz[i].rasterize(out, owner ? owner : this, to_world);
+            }
+            return true;
+        }
+
         virtual Vec3 random_surface_point() const override {
-            return sides.random_surface_point();
+            int side = random_int(0, 5);
+            if (side < 2) return xy[side].random_surface_point();
+            if (side < 4) return xz[side - 2].random_surface_point();
+            return yz[side - 4].random_surface_point();
         }
 
     public:
         Point3 box_min;
         Point3 box_max;
-        HittableList sides;
+        xy_rect xy[2];
+        xz_rect xz[2];
+        yz_rect yz[2];
 };
 
 #endif
\ No newline at end of file
@@ -56,6 +56,34 @@ class Camera {
             );
         }
 
+        // same ray with its differentials (see Ray.h), ds and dt => step in s and t to the next sample
+        Ray get_ray(double s, double t, double ds, double dt) const {
+            Ray r = get_ray(s, t);
+            Real length = r.direction().norm();
+            Vec3 d = r.direction() / length;
+            // derivative of D / |D| along a direction e of the image plane => (e - d (d.e)) / |D|
+            RayDifferentials diff; // the origin is the same for every ray
+            diff.dddx = ds * (horizontal - d * d.dot(horizontal)) / length;
+            diff.dddy = dt * (vertical - d * d.dot(vertical)) / length;
+            r.set_differentials(diff);
+            return r;
+        }
+
+        // inverse of get_ray => (s, t) of the ray through p, false if p is not in front of the camera
+        bool project(const Point3& p, double& s, double& t) const {
+            Vec3 q = p - origin;
+            Real z = -q.dot(w);
+            if (z <= 0) return false;
+            Vec3 to_corner = lower_left_corner - origin;
+            Real focus_dist = -to_corner.dot(w);
+            Vec3 on_plane = q * (focus_dist / z) - to_corner; // = s * horizontal + t * vertical
+            s = on_plane.dot(horizontal) / horizontal.squaredNorm();
+            t = on_plane.dot(vertical) / vertical.squaredNorm();
+            return true;
+        }
+
+        Point3 position() const { return origin; }
+
     private:
         Point3 origin;
         Point3 lower_left_corner;
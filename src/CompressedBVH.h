@@ -0,0 +1,359 @@
+#ifndef COMPRESSED_BVH_H
+#define COMPRESSED_BVH_H
+
+#include "utility.h"
+#include "HittableList.h"
+#include "aabb.h"
+#include "Ray.h"
+#include "Hittable.h"
+#include "LBVH.h"
+#include "Simd.h"
+#include "Stats.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+/*
+A 4-wide BVH with quantized boxes => for scenes where the BVH itself takes gigabytes
+
+A node of BVH.h is a Hittable of its own: vtable, two shared_ptrs and a box of two Vec3 => 80 bytes for every
+2 children, each in its own allocation (or its own arena slot), and a ray visits log2(n) of them one after the other.
+Here (Ylitie et al. 2017, "Efficient Incoherent Ray Traversal on GPUs Using Compressed Wide BVHs", on 4 lanes):
+    a node has up to 4 children => about n / 3 nodes for n primitives instead of n - 1, and half as many levels
+    the box of a child is stored as 8 bits per plane, relative to the box of the node:
+        plane = origin + q * 2^exponent      (the power of two scale => decoding is exact)
+    with the low planes rounded down and the high planes rounded up => a child box only ever grows a little
+    the internal children of a node are next to each other in the node array and its leaves are next to each other
+    in the primitive array => one base index for each plus one byte per child
+
+    origin          12 bytes
+    exponents        3
+    child count      1
+    quantized boxes 24      (low and high plane, 3 axes, 4 children)
+    child base       4
+    leaf base        4
+    child slots      4
+    padding         12   => 64 bytes, the 4 boxes of a node are read from one or two cache lines
+
+The traversal decodes the 4 boxes on the fly: per axis, t = (q * 2^exponent + origin - o) / d is computed
+for the 4 children at a time (load_bytes() in Simd.h turns the bytes into floats),
+then the children that are hit are visited nearest first.
+
+The tree comes from the LBVH builder (with its SAH top levels) collapsed 2 levels at a time: a node takes the
+children of its children with the biggest boxes until it has 4. Subtrees of at most max_leaf_size primitives
+become a single leaf child => the primitives of a leaf are consecutive and the slot byte holds their count.
+The leaves hold the index of the primitive in the list the tree was built from (4 bytes, not a shared_ptr of 16)
+=> that list has to live as long as the tree, like the arena of the scene.
+
+    auto world = make_shared<CompressedBVH>(list);
+    auto world = make_shared<CompressedBVH>(list, CompressedBVHSettings(LBVHSettings(6, 0), 1)); // one primitive per leaf
+    std::cerr << world->memory_bytes() << " bytes\n";
+*/
+
+struct CompressedBVHSettings {
+    LBVHSettings tree = LBVHSettings(6, 0); // of the binary tree that is collapsed
+    // primitives in a leaf child (1 to 7) => fewer nodes, but they are all tested when the leaf box is hit
+    // 2 is best for spheres and rects, 1 for expensive primitives (rotated boxes, instances)
+    int max_leaf_size = 2;
+
+    CompressedBVHSettings() {}
+    CompressedBVHSettings(const LBVHSettings& _tree, int _max_leaf_size) : tree(_tree), max_leaf_size(_max_leaf_size) {}
+};
+
+class CompressedBVH : public Hittable {
+    public:
+        struct Node {
+            float origin[3];        // low corner of the node box
+            int8_t exponent[3];     // scale of the quantized planes along each axis
+            uint8_t num_children;
+            uint8_t lo[3][4];       // [axis][child], rounded down
+            uint8_t hi[3][4];       // [axis][child], rounded up
+            uint32_t child_base;    // first internal child in nodes
+            uint32_t leaf_base;     // first leaf child in primitives
+            uint8_t slot[4];        // internal => offset from child_base, leaf => count << 5 | offset from leaf_base
+            uint8_t padding[12];
+        };
+
+        CompressedBVH(const HittableList& list, const CompressedBVHSettings& _settings = CompressedBVHSettings()) : settings(_settings) {
+            build(list.objects);
+        }
+
+        CompressedBVH(const std::vector<shared_ptr<Hittable>>& objects, const CompressedBVHSettings& _settings = CompressedBVHSettings()) : settings(_settings) {
+            build(objects);
+        }
+
+        // objects is kept by address => it has to outlive the tree
+        void build(const std::vector<shared_ptr<Hittable>>& objects) {
+            nodes.clear();
+            primitives.clear();
+            scene = &objects;
+            max_stack = 1;
+            if (objects.empty()) return;
+
+            LBVH binary(objects, settings.tree);
+            index_of.clear();
+            for (size_t k = 0; k < objects.size(); k++) index_of.insert(std::make_pair(objects[k].get(), static_cast<uint32_t>(k)));
+            // a node has at most as many levels below it as the binary node it comes from, and pushes 3 entries more than it pops
+            max_stack = 3 * binary.height + 4;
+            std::vector<int> sizes(binary.nodes.size(), 0);
+            count_primitives(binary, binary.root, sizes);
+            primitives.reserve(objects.size());
+            nodes.push_back(Node());
+            collapse(binary, binary.root, 0, sizes);
+            index_of.clear();
+        }
+
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            if (nodes.empty()) return false;
+
+            struct Entry {
+                uint32_t ref; // node index, or leaf_bit | count << count_shift | first primitive
+                float t;      // where the ray enters its box => skipped if something closer was found since
+            };
+            Entry local_stack[256];
+            std::vector<Entry> deep_stack; // only for the trees deeper than the radix tree (see LBVH.h)
+            Entry* stack = local_stack;
+            if (max_stack > 256) {
+                deep_stack.resize(max_stack);
+                stack = deep_stack.data();
+            }
+            int stack_size = 0;
+            stack[stack_size++] = Entry{0, static_cast<float>(t_min)};
+            bool hit_anything = false;
+
+            const Vec3& o = r.origin();
+            const Vec3& inv = r.inverse_direction();
+            const shared_ptr<Hittable>* objects = scene->data();
+            while (stack_size > 0) {
+                Entry entry = stack[--stack_size];
+                if (entry.t > t_max) continue;
+
+                if (entry.ref & leaf_bit) {
+                    uint32_t first = entry.ref & index_mask, last = first + (entry.ref >> count_shift & 7);
+                    for (uint32_t k = first; k < last; k++) {
+                        if (objects[primitives[k]]->hit(r, t_min, t_max, rec)) {
+                            hit_anything = true;
+                            t_max = rec.t;
+                        }
+                    }
+                    continue;
+                }
+
+                const Node& node = nodes[entry.ref];
+                STAT_INC(stat_bvh_nodes);
+                STAT_ADD(stat_aabb_tests, node.num_children);
+
+                // slab test of the 4 children at once, planes relative to the ray origin then times 1/d
+                vfloat4 t_near(static_cast<float>(t_min)), t_far(static_cast<float>(t_max));
+                for (int axis = 0; axis < 3; axis++) {
+                    vfloat4 scale(scale_of(node.exponent[axis]));
+                    vfloat4 offset(static_cast<float>(node.origin[axis] - o[axis]));
+                    vfloat4 inv_d(static_cast<float>(inv[axis]));
+                    vfloat4 t0 = (load_bytes(node.lo[axis]) * scale + offset) * inv_d;
+                    vfloat4 t1 = (load_bytes(node.hi[axis]) * scale + offset) * inv_d;
+                    t_near = vmax(t_near, vmin(t0, t1));
+                    t_far = vmin(t_far, vmax(t0, t1));
+                }
+                // a little slack on the far side => float rounding never loses a box the ray grazes
+                int mask = bits(t_near <= t_far * vfloat4(1.0f + 4e-7f)) & ((1 << node.num_children) - 1);
+                if (!mask) continue;
+
+                // nearest child last on the stack => visited first
+                float near[4];
+                t_near.store(near);
+                Entry hits[4];
+                int num_hits = 0;
+                for (int c = 0; c < 4; c++) {
+                    if (!(mask & (1 << c))) continue;
+                    uint32_t slot = node.slot[c], count = slot >> 5;
+                    uint32_t ref = count ? leaf_bit | count << count_shift | (node.leaf_base + (slot & 31))
+                                         : node.child_base + slot;
+                    int k = num_hits++;
+                    for (; k > 0 && hits[k - 1].t < near[c]; k--) hits[k] = hits[k - 1];
+                    hits[k] = Entry{ref, near[c]};
+                }
+                for (int k = 0; k < num_hits; k++) stack[stack_size++] = hits[k];
+            }
+            return hit_anything;
+        }
+
+        virtual bool bounding_box(aabb& output_box) const override {
+            if (nodes.empty()) return false;
+            const Node& root = nodes[0];
+            Point3 lo, hi;
+            for (int axis = 0; axis < 3; axis++) {
+                uint8_t low = 255, high = 0;
+                for (int c = 0; c < root.num_children; c++) {
+                    low = std::min(low, root.lo[axis][c]);
+                    high = std::max(high, root.hi[axis][c]);
+                }
+                lo[axis] = root.origin[axis] + low * scale_of(root.exponent[axis]);
+                hi[axis] = root.origin[axis] + high * scale_of(root.exponent[axis]);
+            }
+            output_box = aabb(lo, hi);
+            return true;
+        }
+
+        virtual std::string name() const override {
+            return "CompressedBVH";
+        }
+
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            for (uint32_t k : primitives) {
+                if (!(*scene)[k]->rasterize(out, owner, to_world)) return false;
+            }
+            return true;
+        }
+
+        virtual void list_primitives(std::vector<const Hittable*>& out) const override {
+            for (uint32_t k : primitives) (*scene)[k]->list_primitives(out);
+        }
+
+        virtual Vec3 random_surface_point() const override {
+            return (*scene)[primitives[random_int(0, static_cast<int>(primitives.size()) - 1)]]->random_surface_point();
+        }
+
+        int num_nodes() const { return static_cast<int>(nodes.size()); }
+
+        // nodes and the index array => the primitives themselves belong to the scene
+        size_t memory_bytes() const { return nodes.size() * sizeof(Node) + primitives.size() * sizeof(primitives[0]); }
+
+    private:
+        static const uint32_t leaf_bit = 0x80000000u;
+        static const int count_shift = 28;
+        static const uint32_t index_mask = (1u << count_shift) - 1;
+
+        // 2^exponent as a float, exact => built from its bits instead of calling ldexp in the traversal
+        static float scale_of(int8_t exponent) {
+            uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+            float scale;
+            std::memcpy(&scale, &bits, 4);
+            return scale;
+        }
+
+        static aabb box_of(const LBVH& binary, int ref) {
+            return ref < 0 ? binary.leaf_boxes[~ref] : binary.nodes[ref].box;
+        }
+
+        // primitives under every internal node of the binary tree
+        static int count_primitives(const LBVH& binary, int ref, std::vector<int>& sizes) {
+            if (ref < 0) return 1;
+            const LBVH::Node& node = binary.nodes[ref];
+            return sizes[ref] = count_primitives(binary, node.left, sizes) + count_primitives(binary, node.right, sizes);
+        }
+
+        bool is_leaf(int ref, const std::vector<int>& sizes) const {
+            return ref < 0 || sizes[ref] <= std::min(std::max(settings.max_leaf_size, 1), 7);
+        }
+
+        void gather_primitives(const LBVH& binary, int ref) {
+            if (ref < 0) {
+                primitives.push_back(index_of.at(binary.primitives[~ref].get()));
+                return;
+            }
+            gather_primitives(binary, binary.nodes[ref].left);
+            gather_primitives(binary, binary.nodes[ref].right);
+        }
+
+        // fills nodes[index] with the subtree of binary node ref
+        void collapse(const LBVH& binary, int ref, uint32_t index, const std::vector<int>& sizes) {
+            // open the biggest child that is not small enough to be a leaf until there are 4 children
+            std::vector<int> children(1, ref);
+            while (children.size() < 4) {
+                int best = -1;
+                double best_area = -1;
+                for (size_t c = 0; c < children.size(); c++) {
+                    if (is_leaf(children[c], sizes)) continue;
+                    double area = box_of(binary, children[c]).surface_area();
+                    if (area > best_area) {
+                        best_area = area;
+                        best = static_cast<int>(c);
+                    }
+                }
+                if (best < 0) break;
+                int opened = children[best];
+                children[best] = binary.nodes[opened].left;
+                children.push_back(binary.nodes[opened].right);
+            }
+            fill_node(binary, index, children, sizes);
+
+            // the internal children got consecutive slots from child_base => fill them now
+            uint32_t child = nodes[index].child_base;
+            for (int c : children) {
+                if (!is_leaf(c, sizes)) collapse(binary, c, child++, sizes);
+            }
+        }
+
+        // quantized boxes and child slots of nodes[index], reserves the slots of the internal children
+        void fill_node(const LBVH& binary, uint32_t index, const std::vector<int>& children, const std::vector<int>& sizes) {
+            Node node = Node();
+            node.num_children = static_cast<uint8_t>(children.size());
+
+            aabb box = box_of(binary, children[0]);
+            for (size_t c = 1; c < children.size(); c++) box = surrounding_box(box, box_of(binary, children[c]));
+            Point3 lo = box.min(), hi = box.max();
+            for (int axis = 0; axis < 3; axis++) {
+                node.origin[axis] = static_cast<float>(lo[axis]);
+                if (node.origin[axis] > lo[axis]) node.origin[axis] = std::nextafter(node.origin[axis], -std::numeric_limits<float>::infinity());
+                // smallest power of two such that 255 steps cover the box (from the rounded origin)
+                double extent = double(hi[axis]) - node.origin[axis];
+                int e = extent > 0 ? std::max(static_cast<int>(std::ceil(std::log2(extent / 255))), -100) : -100;
+                while (node.origin[axis] + 255 * double(scale_of(e)) < hi[axis]) e++;
+                node.exponent[axis] = static_cast<int8_t>(e);
+            }
+
+            uint32_t num_internal = 0;
+            for (int c : children) num_internal += !is_leaf(c, sizes);
+            node.child_base = static_cast<uint32_t>(nodes.size());
+            node.leaf_base = static_cast<uint32_t>(primitives.size());
+            nodes.resize(nodes.size() + num_internal);
+
+            uint8_t next_internal = 0;
+            for (size_t c = 0; c < children.size(); c++) {
+                aabb child_box = box_of(binary, children[c]);
+                for (int axis = 0; axis < 3; axis++) {
+                    float scale = scale_of(node.exponent[axis]);
+                    node.lo[axis][c] = quantize(child_box.min()[axis], node.origin[axis], scale, false);
+                    node.hi[axis][c] = quantize(child_box.max()[axis], node.origin[axis], scale, true);
+                }
+                if (is_leaf(children[c], sizes)) {
+                    size_t offset = primitives.size() - node.leaf_base;
+                    gather_primitives(binary, children[c]);
+                    size_t count = primitives.size() - node.leaf_base - offset;
+                    node.slot[c] = static_cast<uint8_t>(count << 5 | offset);
+                } else {
+                    node.slot[c] = next_internal++;
+                }
+            }
+            nodes[index] = node;
+        }
+
+        // conservative => the decoded plane (in float, like the traversal) is never inside the real box
+        static uint8_t quantize(Real value, float origin, float scale, bool round_up) {
+            double q = (double(value) - origin) / scale;
+            int k = static_cast<int>(round_up ? std::ceil(q) : std::floor(q));
+            k = std::min(std::max(k, 0), 255);
+            if (round_up) {
+                while (k < 255 && origin + k * scale < value) k++;
+            } else {
+                while (k > 0 && origin + k * scale > value) k--;
+            }
+            return static_cast<uint8_t>(k);
+        }
+
+    public:
+        CompressedBVHSettings settings;
+        std::vector<Node> nodes; // nodes[0] is the root
+        std::vector<uint32_t> primitives; // leaf children as indices in *scene, consecutive for each node
+        int max_stack; // entries the traversal can need at most
+
+    private:
+        const std::vector<shared_ptr<Hittable>>* scene = nullptr; // the list the tree was built from
+        std::unordered_map<const Hittable*, uint32_t> index_of;   // only while building
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "utility.h"
+#include "Color.h"
+#include "Renderer.h"
+#include "Parallel.h"
+#include <cmath>
+#include <vector>
+
+/*
+Edge-aware a-trous wavelet denoiser (Dammertz et al., "Edge-Avoiding A-Trous Wavelet Transform")
+with the variance guided color weight of SVGF (Schied et al.)
+
+A low sample render is noisy but the feature buffers (albedo, normal, depth, object id of the first hit) are almost clean
+because they do not depend on the lights. We blur the noisy colors but stop at edges of the feature buffers.
+
+One pass is a 5x5 B3-spline blur whose taps are 'step' pixels apart.
+Every pass doubles the step => 5 passes cover a 61x61 footprint for the price of 5 x 25 taps per pixel.
+
+The weight of a tap q for pixel p is the spline weight times how similar p and q are:
+    color   exp(-|l_p - l_q| / (sigma_color * sqrt(variance_p)))    l is the luminance
+    normal  exp(-(1 - n_p . n_q) / sigma_normal)
+    depth   exp(-|d_p - d_q| / (sigma_depth * d_p * step))
+    albedo  exp(-|a_p - a_q|^2 / sigma_albedo^2)                     keeps the checkerboards sharp
+    object  0 if p and q are not the same object
+
+The color weight uses how noisy the pixel is => a difference that is bigger than the noise is an edge we keep,
+a smaller one is noise that we blur away. The variance is filtered along with the colors so that it goes down every pass.
+
+Every pass runs on all the cores, one row per task.
+*/
+
+struct DenoiseSettings {
+    int iterations = 5;
+    float sigma_color = 4.0;
+    float sigma_normal = 0.1;
+    float sigma_depth = 0.02;
+    float sigma_albedo = 0.1;
+    int num_threads = 0; // 0 => all the cores
+};
+
+inline void atrous_pass(const std::vector<Color>& in, const std::vector<float>& in_variance,
+                        std::vector<Color>& out, std::vector<float>& out_variance,
+                        const FeatureBuffers& features, const DenoiseSettings& settings, int step) {
+    static const float spline[5] = { 1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16 };
+    const int width = features.width;
+    const int height = features.height;
+
+    parallel_for(height, [&](int row) {
+        for (int col = 0; col < width; col++) {
+            int p = features.index(row, col);
+            float luminance_p = in[p].mean();
+            float color_scale = settings.sigma_color * std::sqrt(in_variance[p]) + 1e-4f;
+            const Vec3& normal_p = features.normal[p];
+            const Color& albedo_p = features.albedo[p];
+            float depth_p = features.depth[p];
+            uint32_t id_p = features.object_id[p];
+
+            Color sum(0, 0, 0);
+            float weight_sum = 0;
+            float variance_sum = 0;
+
+            for (int dy = -2; dy <= 2; dy++) {
+                int r = row + dy * step;
+                if (r < 0 || r >= height) continue;
+
+                for (int dx = -2; dx <= 2; dx++) {
+                    int c = col + dx * step;
+                    if (c < 0 || c >= width) continue;
+
+                    int q = features.index(r, c);
+                    if (features.object_id[q] != id_p) continue;
+
+                    float w_color = std::exp(-std::fabs(luminance_p - in[q].mean()) / color_scale);
+                    float w_normal = std::exp(-std::max(Real(0), 1 - normal_p.dot(features.normal[q])) / settings.sigma_normal);
+                    float w_depth = std::exp(-std::fabs(depth_p - features.depth[q]) / (settings.sigma_depth * depth_p * step + 1e-6f));
+                    float w_albedo = std::exp(-(albedo_p - features.albedo[q]).squaredNorm() / (settings.sigma_albedo * settings.sigma_albedo));
+
+                    float weight = spline[dx + 2] * spline[dy + 2] * w_color * w_normal * w_depth * w_albedo;
+                    sum += weight * in[q];
+                    weight_sum += weight;
+                    variance_sum += weight * weight * in_variance[q];
+                }
+            }
+
+            // the center tap always has weight > 0 so weight_sum is never 0
+            out[p] = sum / weight_sum;
+            out_variance[p] = variance_sum / (weight_sum * weight_sum);
+        }
+    }, settings.num_threads);
+}
+
+inline void denoise(Framebuffer& frame, const FeatureBuffers& features, const DenoiseSettings& settings = DenoiseSettings()) {
+    std::vector<Color> next(frame.pixels.size());
+    std::vector<float> variance = features.variance, next_variance(variance.size());
+
+    for (int i = 0; i < settings.iterations; i++) {
+        atrous_pass(frame.pixels, variance, next, next_variance, features, settings, 1 << i);
+        frame.pixels.swap(next);
+        variance.swap(next_variance);
+    }
+}
+
+#endif
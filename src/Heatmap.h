@@ -0,0 +1,64 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include "Stats.h"
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include <cmath>
+#include <string>
+#include <vector>
+
+/*
+Per-pixel cost images built from the render counters (see Stats.h)
+
+For every pixel we keep the number of BVH nodes visited and the number of primitive tests
+made by all the rays of that pixel (primary, secondary and shadow rays).
+The counts are put on a log scale and saved with a colormap => blue is cheap, red is expensive.
+
+Only works when the counters are compiled in (RT_STATS), otherwise all pixels are 0.
+*/
+
+class Heatmap {
+    public:
+        Heatmap(int _rows, int _cols)
+            : rows(_rows), cols(_cols), traversal(_rows * _cols, 0), primitives(_rows * _cols, 0) {}
+
+        // cost is a snapshot taken before the first sample of the pixel
+        void add(int row, int col, const PixelCost& cost) {
+            RenderStats pixel = cost.so_far();
+            traversal[row * cols + col] += pixel.traversal_steps();
+            primitives[row * cols + col] += pixel.primitive_tests();
+        }
+
+        // writes <prefix>_traversal.png and <prefix>_primitives.png
+        void save(const std::string& prefix) const {
+            save_channel(traversal, prefix + "_traversal.png");
+            save_channel(primitives, prefix + "_primitives.png");
+        }
+
+    private:
+        void save_channel(const std::vector<uint64_t>& values, const std::string& filename) const {
+            uint64_t max_value = 1;
+            for (auto value : values) max_value = std::max(max_value, value);
+
+            cv::Mat gray(rows, cols, CV_8UC1);
+            for (int row = 0; row < rows; row++) {
+                for (int col = 0; col < cols; col++) {
+                    double scaled = std::log1p(double(values[row * cols + col])) / std::log1p(double(max_value));
+                    gray.at<unsigned char>(row, col) = static_cast<unsigned char>(255 * scaled);
+                }
+            }
+
+            cv::Mat color;
+            cv::applyColorMap(gray, color, cv::COLORMAP_JET);
+            cv::imwrite(filename, color);
+        }
+
+    private:
+        int rows, cols;
+        std::vector<uint64_t> traversal;
+        std::vector<uint64_t> primitives;
+};
+
+#endif
@@ -4,6 +4,9 @@
 #include "utility.h"
 #include "aabb.h"
 #include "string.h"
+#include "RasterPrimitives.h"
+#include <cstdint>
+#include <vector>
 
 /*
 File defines what a SURFACE is.
@@ -15,21 +18,54 @@ until we get the closest hit
 
 My hittable object also has a name() method which can be used for debugging
 and a random_surface_point() which is used to do area_lights.
+
+The objects that are lights can also be sampled from the point being shaded (see Shader::perform_blinn_phong):
+    random_direction(o) => vector from o to a random point of the object, ideally only where o can see it
+    pdf_value(o, v)     => density of random_direction(o) giving the direction v, per unit of solid angle
+    solid_angle(o)      => how much of the directions around o the object covers
+Sphere does a cone around the visible cap and the rects sample their area, for the other objects
+the defaults below fall back to random_surface_point() with solid_angle() == 0 => all the points count the same.
+
+Lights also shoot the photons of the caustics pass (PhotonMap.h):
+    random_emission_point(point, normal) => random point of the surface and the normal the light leaves along,
+                                            returns the emitting area, 0 if the object cannot emit photons
+
+Shadow rays that start at the same point go together in a ShadowPacket (the light samples of one light, see Shader::sample_light):
+    occlude(packet) => clears the bit of every active ray blocked by the object (anything but packet.ignore before its t_max)
+                       by default each active ray is tested with hit(), BVH tests its box once for the whole packet
+                       and HittableList stops as soon as no ray is left
+
+The hybrid renderer (Rasterizer.h) draws the camera's view of the objects instead of tracing the camera rays:
+    rasterize(out, owner, to_world) => adds the spheres and quads of the object to out (RasterPrimitives.h)
+                                       to_world => rotation of the instances above, owner => what the BVH stores (nullptr => this)
+                                       the containers pass owner down, false if the object cannot be drawn
+
+The G-buffer (GBuffer.h) numbers what the camera rays hit by a walk of the scene:
+    list_primitives(out) => adds what a hit of the object reports as rec.object, the containers add their content in order
 */
 
 // Cannot do this as circular dependency => #include "Material.h"
 class Material; // alerts the C++ compiler that material is a class
+class Hittable;
 
 struct HitRecord {
     Point3 p;
     Vec3 normal;
-    shared_ptr<Material> mat_ptr;
-    double t;
+    const Material* mat_ptr; // plain pointer => copying a HitRecord does not touch any reference count
+    const Hittable* object; // what was hit => boxes and instances put themselves here so it is always what the BVH stores
+    Real t;
     bool front_face; // says if the normal is pointing inwards or outwards
 
     // (u, v) coordinates for textures
-    double u;
-    double v;
+    Real u;
+    Real v;
+
+    // for the ray differentials (see Shader::trace), every primitive sets them when it is hit
+    Vec3 dpdu = Vec3(0, 0, 0), dpdv = Vec3(0, 0, 0); // how p moves with u and v, zero => the texture is point sampled
+    Real curvature = 0; // 1 / radius => the outward normal moves by curvature * dp, 0 for flat surfaces
+
+    // size of the pixel footprint in (u, v), set by the shader => textures average over it, 0 => point sample
+    Real du = 0, dv = 0;
 
     inline void set_face_normal(const Ray& r, const Vec3& outward_normal) {
         front_face = r.direction().dot(outward_normal) < 0;
@@ -37,10 +73,74 @@ struct HitRecord {
     }
 };
 
+// up to 16 shadow rays from one origin, the rays still to decide have their bit set in active
+struct ShadowPacket {
+    static const int max_size = 16;
+    Point3 origin;
+    int count = 0;
+    uint32_t active = 0;
+    const Hittable* ignore = nullptr; // the light the rays go to => hitting it is not a block
+    Ray rays[max_size];
+    Real distance[max_size];
+    const Hittable* blocker[max_size];
+    float inv_x[max_size], inv_y[max_size], inv_z[max_size], t_max[max_size]; // 4 rays load in a vfloat4
+
+    void reset(const Point3& _origin, const Hittable* light) {
+        origin = _origin;
+        ignore = light;
+        count = 0;
+        active = 0;
+    }
+
+    void add(const Vec3& direction, Real _distance) {
+        int k = count++;
+        rays[k] = Ray(origin, direction);
+        distance[k] = _distance;
+        blocker[k] = nullptr;
+        inv_x[k] = static_cast<float>(1 / direction.x());
+        inv_y[k] = static_cast<float>(1 / direction.y());
+        inv_z[k] = static_cast<float>(1 / direction.z());
+        t_max[k] = static_cast<float>(_distance);
+        active |= 1u << k;
+        // the lanes after the last ray never enter a box
+        for (int pad = count; pad < (count + 3) / 4 * 4; pad++) {
+            inv_x[pad] = inv_y[pad] = inv_z[pad] = 1;
+            t_max[pad] = -1;
+        }
+    }
+
+    void block(int k, const Hittable* object) {
+        active &= ~(1u << k);
+        blocker[k] = object;
+    }
+
+    // the rays of mask that go through the box before their t_max
+    // box - origin is worked out once for the packet, then the slabs of 4 rays at a time
+    uint32_t enter(const aabb& box, uint32_t mask) const {
+        STAT_INC(stat_aabb_tests);
+        Vec3 lo = box.min() - origin, hi = box.max() - origin;
+        const vfloat4 lx(static_cast<float>(lo.x())), ly(static_cast<float>(lo.y())), lz(static_cast<float>(lo.z()));
+        const vfloat4 hx(static_cast<float>(hi.x())), hy(static_cast<float>(hi.y())), hz(static_cast<float>(hi.z()));
+        uint32_t res = 0;
+        for (int g = 0; g < count; g += 4) {
+            if (!((mask >> g) & 0xf)) continue;
+            vfloat4 ix = vfloat4::load(&inv_x[g]), iy = vfloat4::load(&inv_y[g]), iz = vfloat4::load(&inv_z[g]);
+            vfloat4 tx0 = lx * ix, tx1 = hx * ix;
+            vfloat4 ty0 = ly * iy, ty1 = hy * iy;
+            vfloat4 tz0 = lz * iz, tz1 = hz * iz;
+            vfloat4 t_near = vmax(vmax(vmin(tx0, tx1), vmin(ty0, ty1)), vmax(vmin(tz0, tz1), vfloat4(epsilon)));
+            vfloat4 t_far = vmin(vmin(vmax(tx0, tx1), vmax(ty0, ty1)), vmin(vmax(tz0, tz1), vfloat4::load(&t_max[g])));
+            // a bit wider than the box => float is enough for the double build too
+            res |= static_cast<uint32_t>(bits(t_near * vfloat4(1 - 1e-5f) <= t_far * vfloat4(1 + 1e-5f))) << g;
+        }
+        return res & mask;
+    }
+};
+
 class Hittable {
     public:
         // make all geometries return if a ray hits it or not. We pass rec by ref for clearner code for list of hittables
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const = 0;
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const = 0;
 
         // make a hittable return a bouding box. again we use a ref so that we can group objects into one box if needed
         virtual bool bounding_box(aabb& output_box) const = 0;
@@ -49,6 +149,43 @@ class Hittable {
         virtual std::string name() const = 0;
 
         virtual Vec3 random_surface_point() const = 0;
+
+        // light sampling, see above
+        virtual Vec3 random_direction(const Point3& o) const {
+            return random_surface_point() - o;
+        }
+
+        virtual Real pdf_value(const Point3& o, const Vec3& v) const {
+            return 0;
+        }
+
+        virtual Real solid_angle(const Point3& o) const {
+            return 0;
+        }
+
+        // photon emission, see above
+        virtual Real random_emission_point(Point3& point, Vec3& normal) const {
+            return 0;
+        }
+
+        // shadow packets, see above
+        virtual void occlude(ShadowPacket& packet) const {
+            for (int k = 0; k < packet.count; k++) {
+                if (!(packet.active & (1u << k))) continue;
+                HitRecord rec;
+                if (hit(packet.rays[k], epsilon, packet.distance[k], rec) && rec.object != packet.ignore) packet.block(k, rec.object);
+            }
+        }
+
+        // primary visibility by rasterization, see above
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const {
+            return false;
+        }
+
+        // walk of the scene, see above
+        virtual void list_primitives(std::vector<const Hittable*>& out) const {
+            out.push_back(this);
+        }
 };
 
 #endif
\ No newline at end of file
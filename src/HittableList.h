@@ -26,7 +26,7 @@ class HittableList : public Hittable {
         void clear() { objects.clear(); }
         void add(shared_ptr<Hittable> object) { objects.push_back(object); }
 
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override;
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override;
         
         virtual bool bounding_box(aabb& output_box) const override;
 
@@ -34,6 +34,24 @@ class HittableList : public Hittable {
             return "hittable list";
         }
         
+        virtual void occlude(ShadowPacket& packet) const override {
+            for (const auto& object : objects) {
+                if (!packet.active) return;
+                object->occlude(packet);
+            }
+        }
+
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            for (const auto& object : objects) {
+                if (!object->rasterize(out, owner, to_world)) return false;
+            }
+            return true;
+        }
+
+        virtual void list_primitives(std::vector<const Hittable*>& out) const override {
+            for (const auto& object : objects) object->list_primitives(out);
+        }
+
         virtual Vec3 random_surface_point() const override {
             int which = random_int(0, objects.size());
             return objects[which]->random_surface_point();
@@ -44,7 +62,7 @@ class HittableList : public Hittable {
 };
 
 
-bool HittableList::hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const {
+bool HittableList::hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const {
     HitRecord temp_rec;
     bool hit_anything = false;
     auto closest_so_far = t_max;
@@ -1,4 +1,5 @@
 #include "Image.h"
+#include "Trace.h"
 
 cv::Vec3b& Image::operator()(int row, int col)
 {
@@ -13,5 +14,6 @@ void Image::display() {
 }
 
 void Image::save(const std::string& filename) {
+	TRACE_SCOPE("imwrite");
 	cv::imwrite(filename, image);
 }
\ No newline at end of file
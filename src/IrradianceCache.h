@@ -0,0 +1,251 @@
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include "utility.h"
+#include "Color.h"
+
+/*
+Irradiance cache (Ward et al. 1988, gradients from Ward and Heckbert 1992)
+
+The light that bounces off the walls of the cornell box changes slowly over a matte surface,
+yet every matte hit sends one random ray and gets a very noisy estimate of it.
+The cache computes that indirect light carefully (a few hundred rays) at a few points only
+and interpolates between them everywhere else.
+
+A record at point p_i with normal n_i stores:
+    value   => average of the incoming light over the hemisphere, cosine weighted (what the matte scatter ray estimates)
+    radius  => harmonic mean of the distances to what the rays hit => close walls = the light changes fast = small radius
+    the translation and rotation gradients of the value => how it changes when we move or tilt away from p_i
+
+At a new point p with normal n every record close enough gets the weight
+    w_i = 1 / (|p - p_i| / R_i + sqrt(1 - n.n_i))
+and is used if w_i > 1 / accuracy. The result is the weighted average of the extrapolated values
+    value_i + translation_gradient * (p - p_i) + rotation_gradient * (n_i x n)
+If no record is usable, a new one is made at p.
+
+The hemisphere is sampled in M x N strata (M in theta, N in phi) with cosine weighting,
+the gradients come out of the same rays for free (differences between neighbouring strata).
+
+Records go in a grid of cells, a record is put in every cell its sphere of influence (accuracy * radius) touches
+so a lookup only reads the cell of the point.
+The render threads fill the cache while they render:
+    lookups take no lock => the lists of the cells are only ever prepended with an atomic store,
+                            a record never changes after it is published
+    new records take a lock => they are rare and cost hundreds of rays anyway
+The rays traced for a record can hit matte surfaces too => they use the records that exist but do not make new ones
+(a record inside a record inside a record... would never finish), they fall back to the random scatter ray.
+*/
+
+struct IrradianceCacheSettings {
+    Real accuracy = 0.25;      // 'a' of Ward => smaller means more records
+    Real min_spacing = 4;      // clamp of the record radius, in scene units
+    Real max_spacing = 120;
+    int theta_samples = 8;     // M
+    int phi_samples = 24;      // N => M * N rays per record
+};
+
+class IrradianceCache {
+    public:
+        typedef Eigen::Matrix<Real, 3, 3> Gradient; // column j => change of the color along axis j
+
+        // trace(ray, distance) => light coming back along the ray and the distance to what it hit (infinity if nothing)
+        typedef std::function<Color(const Ray&, Real&)> TraceFunction;
+
+        explicit IrradianceCache(const IrradianceCacheSettings& _settings = IrradianceCacheSettings())
+            : settings(_settings),
+              cell_size(_settings.accuracy * _settings.max_spacing),
+              buckets(num_buckets) {
+            for (auto& bucket : buckets) bucket.store(nullptr, std::memory_order_relaxed);
+        }
+
+        IrradianceCache(const IrradianceCache&) = delete;
+        IrradianceCache& operator=(const IrradianceCache&) = delete;
+
+        // interpolated value at (p, n), false if no record is close enough
+        bool lookup(const Point3& p, const Vec3& n, Color& value) const {
+            CellKey key = cell_of(p);
+            Color sum(0, 0, 0);
+            Real weight_sum = 0;
+            for (const Node* node = buckets[bucket_of(key)].load(std::memory_order_acquire); node; node = node->next) {
+                if (!(node->key == key)) continue;
+                const Record& record = *node->record;
+
+                Vec3 offset = p - record.p;
+                Real error = offset.norm() / record.radius + std::sqrt(std::max(Real(0), 1 - n.dot(record.n)));
+                if (error >= settings.accuracy) continue;
+                // a record in front of p sees things that p does not see
+                if (offset.dot(n + record.n) < -0.1 * record.radius) continue;
+
+                Real weight = 1 / std::max(error, Real(1e-4));
+                Color extrapolated = record.value + record.translation_gradient * offset
+                                                  + record.rotation_gradient * record.n.cross(n);
+                sum += weight * extrapolated.cwiseMax(Real(0));
+                weight_sum += weight;
+            }
+            if (weight_sum <= 0) return false;
+            value = sum / weight_sum;
+            return true;
+        }
+
+        // false while the calling thread is already computing a record
+        bool can_add() const { return !computing_record(); }
+
+        // samples the hemisphere at (p, n), stores the record and returns its value
+        Color add(const Point3& p, const Vec3& n, const TraceFunction& trace) {
+            computing_record() = true;
+            Record record = compute_record(p, n, trace);
+            computing_record() = false;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            records.push_back(record);
+            insert(records.back());
+            return record.value;
+        }
+
+        size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return records.size();
+        }
+
+    private:
+        struct Record {
+            Point3 p;
+            Vec3 n;
+            Color value;
+            Real radius;
+            Gradient translation_gradient;
+            Gradient rotation_gradient;
+        };
+
+        struct CellKey {
+            int32_t x, y, z;
+            bool operator==(const CellKey& other) const { return x == other.x && y == other.y && z == other.z; }
+        };
+
+        struct Node {
+            CellKey key; // two cells can share a bucket => the key says which cell the node is for
+            const Record* record;
+            const Node* next;
+        };
+
+        static const int num_buckets = 1 << 16;
+
+        Record compute_record(const Point3& p, const Vec3& n, const TraceFunction& trace) const {
+            const int M = settings.theta_samples, N = settings.phi_samples;
+            Vec3 s, t;
+            orthonormal_basis(n, s, t);
+
+            std::vector<Color> L(M * N);
+            std::vector<Real> R(M * N);
+            std::vector<Real> tan_theta(M);
+            Real inverse_distance_sum = 0;
+            Color sum(0, 0, 0);
+            for (int j = 0; j < M; j++) {
+                for (int k = 0; k < N; k++) {
+                    // cosine weighted => sin^2(theta) uniform in the stratum
+                    Real sin2 = (j + random_double()) / M;
+                    Real phi = 2 * pi * (k + random_double()) / N;
+                    Real sin_theta = std::sqrt(sin2), cos_theta = std::sqrt(1 - sin2);
+                    Vec3 direction = sin_theta * std::cos(phi) * s + sin_theta * std::sin(phi) * t + cos_theta * n;
+
+                    Real distance = infinity;
+                    L[j * N + k] = trace(Ray(p, direction), distance);
+                    R[j * N + k] = std::max(distance, settings.min_spacing);
+                    inverse_distance_sum += 1 / R[j * N + k];
+                    sum += L[j * N + k];
+                }
+                Real sin2 = (j + 0.5) / M;
+                tan_theta[j] = std::sqrt(sin2 / (1 - sin2));
+            }
+
+            Record record;
+            record.p = p;
+            record.n = n;
+            record.value = sum / (M * N);
+            Real harmonic_mean = (M * N) / std::max(inverse_distance_sum, Real(1e-12));
+            record.radius = std::min(std::max(harmonic_mean, settings.min_spacing), settings.max_spacing);
+
+            // Ward and Heckbert's gradients for irradiance E = pi/(MN) sum L, divided by pi for the value
+            Gradient translation = Gradient::Zero(), rotation = Gradient::Zero();
+            for (int k = 0; k < N; k++) {
+                Real phi = 2 * pi * (k + 0.5) / N;
+                Real phi_minus = 2 * pi * k / N; // boundary with the stratum k-1
+                Vec3 u_k = std::cos(phi) * s + std::sin(phi) * t;
+                Vec3 v_k = -std::sin(phi) * s + std::cos(phi) * t;
+                Vec3 v_k_minus = -std::sin(phi_minus) * s + std::cos(phi_minus) * t;
+                int k_prev = (k + N - 1) % N;
+
+                Color along_theta(0, 0, 0), along_phi(0, 0, 0), rotation_sum(0, 0, 0);
+                for (int j = 0; j < M; j++) {
+                    Real sin_minus = std::sqrt(Real(j) / M), sin_plus = std::sqrt(Real(j + 1) / M);
+                    if (j > 0) {
+                        Real cos2_minus = 1 - Real(j) / M;
+                        along_theta += sin_minus * cos2_minus / std::min(R[j * N + k], R[(j - 1) * N + k])
+                                     * (L[j * N + k] - L[(j - 1) * N + k]);
+                    }
+                    along_phi += (sin_plus - sin_minus) / std::min(R[j * N + k], R[j * N + k_prev])
+                               * (L[j * N + k] - L[j * N + k_prev]);
+                    rotation_sum -= tan_theta[j] * L[j * N + k];
+                }
+                translation += (2 * pi / N) * along_theta * u_k.transpose() + along_phi * v_k_minus.transpose();
+                rotation += rotation_sum * v_k.transpose();
+            }
+            record.translation_gradient = translation / pi;
+            record.rotation_gradient = rotation / (M * N);
+            return record;
+        }
+
+        // called with the lock held => one writer at a time, readers see a node only once it is complete
+        void insert(const Record& record) {
+            Real reach = settings.accuracy * record.radius;
+            CellKey lo = cell_of(record.p - Vec3(reach, reach, reach));
+            CellKey hi = cell_of(record.p + Vec3(reach, reach, reach));
+            for (int32_t x = lo.x; x <= hi.x; x++) {
+                for (int32_t y = lo.y; y <= hi.y; y++) {
+                    for (int32_t z = lo.z; z <= hi.z; z++) {
+                        CellKey key = {x, y, z};
+                        std::atomic<const Node*>& bucket = buckets[bucket_of(key)];
+                        nodes.push_back(Node{key, &record, bucket.load(std::memory_order_relaxed)});
+                        bucket.store(&nodes.back(), std::memory_order_release);
+                    }
+                }
+            }
+        }
+
+        CellKey cell_of(const Point3& p) const {
+            return CellKey{
+                static_cast<int32_t>(std::floor(p.x() / cell_size)),
+                static_cast<int32_t>(std::floor(p.y() / cell_size)),
+                static_cast<int32_t>(std::floor(p.z() / cell_size))
+            };
+        }
+
+        static int bucket_of(const CellKey& key) {
+            uint32_t h = static_cast<uint32_t>(key.x) * 73856093u
+                       ^ static_cast<uint32_t>(key.y) * 19349663u
+                       ^ static_cast<uint32_t>(key.z) * 83492791u;
+            return static_cast<int>(h & (num_buckets - 1));
+        }
+
+        static bool& computing_record() {
+            static thread_local bool computing = false;
+            return computing;
+        }
+
+        IrradianceCacheSettings settings;
+        Real cell_size;
+        std::vector<std::atomic<const Node*>> buckets;
+        mutable std::mutex mutex;
+        std::deque<Record> records; // deques never move their elements => the nodes can point into them
+        std::deque<Node> nodes;
+};
+
+#endif
@@ -0,0 +1,484 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include "utility.h"
+#include "HittableList.h"
+#include "aabb.h"
+#include "Ray.h"
+#include "Hittable.h"
+#include "Parallel.h"
+#include "Stats.h"
+#include "Trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+A BVH that is built in parallel => for scenes with millions of primitives that have to be rebuilt every frame
+
+BVH.h sorts the objects at every level of the tree so its build is O(n log^2 n) and on a single core.
+This builder (Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees")
+does not look at the geometry at all while building the tree, it only sorts the primitives along a space filling curve:
+
+    1. take the center of the box of every primitive and quantize it to 10 bits per axis inside the box of all the centers
+    2. interleave the bits of x, y, z => 30 bit Morton code
+       primitives that are close in space get close codes => sorting by code puts them next to each other
+    3. radix sort the codes (4 passes of 8 bits, every pass is a parallel histogram + prefix sum + parallel scatter)
+    4. the tree is the binary radix tree of the sorted codes: internal node i can find its own range of primitives
+       and where that range splits by looking at the common prefix bits of its neighbours
+       => every internal node is independent of the others and they are all emitted in parallel
+    5. the boxes go bottom-up: one task per leaf walks up to the root, the first task to reach a node stops
+       and the second one (both children are now done) merges the two boxes and keeps going
+       => an atomic counter per node, no locks
+
+Every step is O(n) work spread over all the cores => the build time goes down almost linearly with the number of cores.
+
+The Morton order splits in the middle of space and not where it is best for the rays so the tree is a bit worse than a SAH tree.
+sah_levels > 0 rebuilds the top of the tree (the subtrees found sah_levels levels down) with a full sweep SAH.
+That part is tiny (at most 2^sah_levels subtrees, keep sah_levels <= 10) but it is where most rays start => most of the quality for free.
+
+The nodes live in one flat array and hit() walks them with a small stack instead of recursing through shared_ptrs.
+The radix tree is at most 64 levels deep (30 bits of code + the bits of the index) but the SAH top can be as deep as
+the number of subtrees it sorts => the height of the tree is measured while building and sizes the stack.
+Call build() again with the moved primitives to rebuild the tree in place, the arrays are reused between frames.
+
+    auto world = make_shared<LBVH>(list);                      // plain LBVH on all the cores
+    auto world = make_shared<LBVH>(list, LBVHSettings{6, 0});  // top 6 levels refined with SAH
+*/
+
+struct LBVHSettings {
+    int sah_levels = 0;  // 0 => no SAH refinement of the top of the tree
+    int num_threads = 0; // 0 => all the cores
+
+    LBVHSettings() {}
+    LBVHSettings(int _sah_levels, int _num_threads) : sah_levels(_sah_levels), num_threads(_num_threads) {}
+};
+
+// spreads the 10 low bits of v so that there are two 0 bits between each of them
+inline uint32_t expand_bits(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v <<  8)) & 0x0300f00f;
+    v = (v | (v <<  4)) & 0x030c30c3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+// x, y, z in [0, 1]
+inline uint32_t morton_code(double x, double y, double z) {
+    auto quantize = [](double a) { return static_cast<uint32_t>(std::min(std::max(a * 1024.0, 0.0), 1023.0)); };
+    return (expand_bits(quantize(x)) << 2) | (expand_bits(quantize(y)) << 1) | expand_bits(quantize(z));
+}
+
+inline int count_leading_zeros(uint32_t v) {
+    if (v == 0) return 32;
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clz(v);
+#else
+    int n = 0;
+    while (!(v & 0x80000000u)) { v <<= 1; n++; }
+    return n;
+#endif
+}
+
+class LBVH : public Hittable {
+    public:
+        // child references => internal nodes are >= 0, leaves are stored as ~(index in the sorted primitives)
+        struct Node {
+            aabb box;
+            int left, right;
+            int parent;
+            int first, last; // range of sorted primitives under the node, only used while building
+            int axis;        // axis along which the children are the most apart
+            bool left_below; // the left child is on the low side of that axis
+        };
+
+        LBVH(const HittableList& list, const LBVHSettings& _settings = LBVHSettings()) : settings(_settings) {
+            build(list.objects);
+        }
+
+        LBVH(const std::vector<shared_ptr<Hittable>>& objects, const LBVHSettings& _settings = LBVHSettings()) : settings(_settings) {
+            build(objects);
+        }
+
+        void build(const std::vector<shared_ptr<Hittable>>& objects) {
+            TRACE_SCOPE("lbvh build");
+            const int n = static_cast<int>(objects.size());
+            const int threads = settings.num_threads;
+            primitives.resize(n);
+            leaf_boxes.resize(n);
+            nodes.resize(std::max(n - 1, 0));
+            root = 0;
+            height = 0;
+            if (n == 0) return;
+
+            // boxes and centers of all the primitives
+            std::vector<aabb> boxes(n);
+            std::vector<Point3> centers(n);
+            parallel_for_blocks(n, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    if (!objects[i]->bounding_box(boxes[i]))
+                        std::cerr << "No bounding box in LBVH constructor.\n";
+                    centers[i] = 0.5 * (boxes[i].min() + boxes[i].max());
+                }
+            }, threads);
+
+            // box of the centers => parallel reduction, one partial box per block
+            const int block_size = 4096;
+            const int num_blocks = (n + block_size - 1) / block_size;
+            std::vector<aabb> partial(num_blocks);
+            parallel_for(num_blocks, [&](int block) {
+                int begin = block * block_size;
+                int end = std::min(begin + block_size, n);
+                aabb box(centers[begin], centers[begin]);
+                for (int i = begin + 1; i < end; i++) box = surrounding_box(box, aabb(centers[i], centers[i]));
+                partial[block] = box;
+            }, threads);
+            aabb bounds = partial[0];
+            for (int b = 1; b < num_blocks; b++) bounds = surrounding_box(bounds, partial[b]);
+
+            // Morton codes of the centers
+            Vec3 extent = bounds.max() - bounds.min();
+            Vec3 scale(extent.x() > 0 ? 1 / extent.x() : 0, extent.y() > 0 ? 1 / extent.y() : 0, extent.z() > 0 ? 1 / extent.z() : 0);
+            std::vector<uint32_t> codes(n);
+            std::vector<int> order(n);
+            parallel_for_blocks(n, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    Vec3 p = (centers[i] - bounds.min()).cwiseProduct(scale);
+                    codes[i] = morton_code(p.x(), p.y(), p.z());
+                    order[i] = i;
+                }
+            }, threads);
+
+            radix_sort(codes, order, threads);
+
+            parallel_for_blocks(n, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    primitives[i] = objects[order[i]];
+                    leaf_boxes[i] = boxes[order[i]];
+                }
+            }, threads);
+
+            if (n == 1) {
+                root = ~0;
+                return;
+            }
+
+            // the hierarchy => one independent task per internal node
+            leaf_parents.assign(n, -1);
+            nodes[0].parent = -1;
+            parallel_for_blocks(n - 1, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) emit_node(codes, i);
+            }, threads);
+
+            std::vector<int> heights(n - 1, 0);
+            compute_boxes(threads, heights);
+
+            if (settings.sah_levels > 0) refine_top(settings.sah_levels, heights);
+            height = heights[root];
+        }
+
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            if (primitives.empty()) return false;
+            if (root < 0) {
+                STAT_INC(stat_bvh_nodes);
+                return primitives[0]->hit(r, t_min, t_max, rec);
+            }
+
+            // a node k levels down leaves at most k siblings on the stack => height + 1 entries
+            int local_stack[128];
+            std::vector<int> deep_stack; // only when the SAH top made the tree deeper than that
+            int* stack = local_stack;
+            if (height >= 128) {
+                deep_stack.resize(height + 1);
+                stack = deep_stack.data();
+            }
+            int stack_size = 0;
+            stack[stack_size++] = root;
+            bool hit_anything = false;
+
+            while (stack_size > 0) {
+                int ref = stack[--stack_size];
+                STAT_INC(stat_bvh_nodes);
+
+                if (ref < 0) {
+                    int leaf = ~ref;
+                    if (leaf_boxes[leaf].hit(r, t_min, t_max) && primitives[leaf]->hit(r, t_min, t_max, rec)) {
+                        hit_anything = true;
+                        t_max = rec.t;
+                    }
+                    continue;
+                }
+
+                const Node& node = nodes[ref];
+                if (!node.box.hit(r, t_min, t_max)) continue;
+                // visit first the child on the side the ray comes from so that t_max shrinks early
+                bool left_first = (r.direction()[node.axis] >= 0) == node.left_below;
+                stack[stack_size++] = left_first ? node.right : node.left;
+                stack[stack_size++] = left_first ? node.left : node.right;
+            }
+            return hit_anything;
+        }
+
+        virtual bool bounding_box(aabb& output_box) const override {
+            if (primitives.empty()) return false;
+            output_box = root < 0 ? leaf_boxes[0] : nodes[root].box;
+            return true;
+        }
+
+        virtual std::string name() const override {
+            return "LBVH";
+        }
+
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            for (const auto& primitive : primitives) {
+                if (!primitive->rasterize(out, owner, to_world)) return false;
+            }
+            return true;
+        }
+
+        virtual void list_primitives(std::vector<const Hittable*>& out) const override {
+            for (const auto& primitive : primitives) primitive->list_primitives(out);
+        }
+
+        virtual Vec3 random_surface_point() const override {
+            return primitives[random_int(0, static_cast<int>(primitives.size()) - 1)]->random_surface_point();
+        }
+
+        int num_primitives() const { return static_cast<int>(primitives.size()); }
+        int num_nodes() const { return static_cast<int>(nodes.size()); }
+
+    private:
+        // LSD radix sort of (code, index) pairs, 8 bits per pass
+        // every block counts its digits, a prefix sum over (digit, block) gives where each block writes => stable scatter
+        static void radix_sort(std::vector<uint32_t>& codes, std::vector<int>& order, int threads) {
+            const int n = static_cast<int>(codes.size());
+            const int block_size = 16384;
+            const int num_blocks = (n + block_size - 1) / block_size;
+            std::vector<uint32_t> codes_tmp(n);
+            std::vector<int> order_tmp(n);
+            std::vector<int> offsets(256 * num_blocks);
+
+            for (int shift = 0; shift < 32; shift += 8) {
+                parallel_for(num_blocks, [&](int block) {
+                    int* count = &offsets[256 * block];
+                    std::fill(count, count + 256, 0);
+                    int end = std::min((block + 1) * block_size, n);
+                    for (int i = block * block_size; i < end; i++) count[(codes[i] >> shift) & 255]++;
+                }, threads);
+
+                int sum = 0;
+                for (int digit = 0; digit < 256; digit++) {
+                    for (int block = 0; block < num_blocks; block++) {
+                        int count = offsets[256 * block + digit];
+                        offsets[256 * block + digit] = sum;
+                        sum += count;
+                    }
+                }
+
+                parallel_for(num_blocks, [&](int block) {
+                    int* offset = &offsets[256 * block];
+                    int end = std::min((block + 1) * block_size, n);
+                    for (int i = block * block_size; i < end; i++) {
+                        int dst = offset[(codes[i] >> shift) & 255]++;
+                        codes_tmp[dst] = codes[i];
+                        order_tmp[dst] = order[i];
+                    }
+                }, threads);
+
+                codes.swap(codes_tmp);
+                order.swap(order_tmp);
+            }
+        }
+
+        // length of the common prefix of keys i and j, -1 outside of the array
+        // equal codes are told apart with their index => every key is unique
+        static int common_prefix(const std::vector<uint32_t>& codes, int i, int j) {
+            if (j < 0 || j >= static_cast<int>(codes.size())) return -1;
+            if (codes[i] == codes[j]) return 32 + count_leading_zeros(static_cast<uint32_t>(i ^ j));
+            return count_leading_zeros(codes[i] ^ codes[j]);
+        }
+
+        // Karras 2012 => finds the range covered by internal node i and where it splits
+        void emit_node(const std::vector<uint32_t>& codes, int i) {
+            // direction of the range => towards the neighbour that shares more bits
+            int d = common_prefix(codes, i, i + 1) - common_prefix(codes, i, i - 1) >= 0 ? 1 : -1;
+
+            // upper bound of the length of the range then binary search of the other end
+            int min_prefix = common_prefix(codes, i, i - d);
+            int max_length = 2;
+            while (common_prefix(codes, i, i + max_length * d) > min_prefix) max_length *= 2;
+            int length = 0;
+            for (int t = max_length / 2; t >= 1; t /= 2) {
+                if (common_prefix(codes, i, i + (length + t) * d) > min_prefix) length += t;
+            }
+            int j = i + length * d;
+
+            // binary search of the split => last key that shares more than node_prefix bits with i
+            int node_prefix = common_prefix(codes, i, j);
+            int split = 0;
+            for (int divisor = 2, t = 0; t != 1; divisor *= 2) {
+                t = (length + divisor - 1) / divisor;
+                if (common_prefix(codes, i, i + (split + t) * d) > node_prefix) split += t;
+            }
+            int gamma = i + split * d + std::min(d, 0);
+
+            Node& node = nodes[i];
+            node.first = std::min(i, j);
+            node.last = std::max(i, j);
+            node.left = node.first == gamma ? ~gamma : gamma;
+            node.right = node.last == gamma + 1 ? ~(gamma + 1) : gamma + 1;
+
+            // every node has exactly one parent => no two tasks write the same slot
+            set_parent(node.left, i);
+            set_parent(node.right, i);
+        }
+
+        void set_parent(int ref, int parent) {
+            if (ref < 0) leaf_parents[~ref] = parent;
+            else nodes[ref].parent = parent;
+        }
+
+        const aabb& box_of(int ref) const {
+            return ref < 0 ? leaf_boxes[~ref] : nodes[ref].box;
+        }
+
+        int height_of(int ref, const std::vector<int>& heights) const {
+            return ref < 0 ? 0 : heights[ref];
+        }
+
+        // bottom-up boxes => the second child to arrive at a node merges both boxes and goes up
+        // heights => levels of nodes below every node (1 for a node over two leaves)
+        void compute_boxes(int threads, std::vector<int>& heights) {
+            const int n = static_cast<int>(leaf_boxes.size());
+            std::unique_ptr<std::atomic<int>[]> arrivals(new std::atomic<int>[n - 1]);
+            for (int i = 0; i < n - 1; i++) arrivals[i].store(0, std::memory_order_relaxed);
+
+            parallel_for_blocks(n, [&](int begin, int end) {
+                for (int leaf = begin; leaf < end; leaf++) {
+                    int node = leaf_parents[leaf];
+                    // acq_rel => the box written by the other child is visible to the one that goes on
+                    while (node >= 0 && arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                        nodes[node].box = surrounding_box(box_of(nodes[node].left), box_of(nodes[node].right));
+                        heights[node] = 1 + std::max(height_of(nodes[node].left, heights), height_of(nodes[node].right, heights));
+                        set_traversal_order(nodes[node]);
+                        node = nodes[node].parent;
+                    }
+                }
+            }, threads);
+        }
+
+        void set_traversal_order(Node& node) const {
+            Vec3 d = (box_of(node.right).min() + box_of(node.right).max()) - (box_of(node.left).min() + box_of(node.left).max());
+            Vec3 a = d.cwiseAbs();
+            node.axis = (a.x() >= a.y() && a.x() >= a.z()) ? 0 : (a.y() >= a.z() ? 1 : 2);
+            node.left_below = d[node.axis] >= 0;
+        }
+
+        // ---- SAH refinement of the top of the tree ----
+
+        struct Subtree {
+            int ref;
+            int size; // number of primitives => SAH cost of the subtree
+            Point3 center;
+        };
+
+        void refine_top(int levels, std::vector<int>& heights) {
+            // cut the tree 'levels' levels down => the subtrees below the cut are kept, the nodes above are reused
+            std::vector<Subtree> subtrees;
+            std::vector<int> free_nodes;
+            std::vector<int> frontier(1, root);
+            for (int level = 0; level < levels && !frontier.empty(); level++) {
+                std::vector<int> next;
+                for (int ref : frontier) {
+                    if (ref < 0) {
+                        add_subtree(ref, subtrees);
+                        continue;
+                    }
+                    free_nodes.push_back(ref);
+                    next.push_back(nodes[ref].left);
+                    next.push_back(nodes[ref].right);
+                }
+                frontier.swap(next);
+            }
+            for (int ref : frontier) add_subtree(ref, subtrees);
+
+            // a binary tree over k subtrees has k - 1 internal nodes => exactly the nodes that were freed
+            size_t next_free = 0;
+            root = build_sah(subtrees, 0, static_cast<int>(subtrees.size()), free_nodes, next_free, heights);
+            nodes[root].parent = -1;
+        }
+
+        void add_subtree(int ref, std::vector<Subtree>& subtrees) const {
+            const aabb& box = box_of(ref);
+            int size = ref < 0 ? 1 : nodes[ref].last - nodes[ref].first + 1;
+            subtrees.push_back(Subtree{ref, size, 0.5 * (box.min() + box.max())});
+        }
+
+        // full sweep SAH over the centers of the subtrees, cost = area(left) * size(left) + area(right) * size(right)
+        int build_sah(std::vector<Subtree>& subtrees, int begin, int end, const std::vector<int>& free_nodes, size_t& next_free,
+                      std::vector<int>& heights) {
+            if (end - begin == 1) return subtrees[begin].ref;
+
+            int best_axis = 0, best_split = begin + (end - begin) / 2;
+            double best_cost = infinity;
+            std::vector<double> right_cost(end - begin);
+            for (int axis = 0; axis < 3; axis++) {
+                std::sort(subtrees.begin() + begin, subtrees.begin() + end,
+                          [axis](const Subtree& a, const Subtree& b) { return a.center[axis] < b.center[axis]; });
+
+                // right to left sweep => cost of subtrees[k, end), then left to right
+                aabb box = box_of(subtrees[end - 1].ref);
+                int size = 0;
+                for (int k = end - 1; k > begin; k--) {
+                    box = surrounding_box(box, box_of(subtrees[k].ref));
+                    size += subtrees[k].size;
+                    right_cost[k - begin] = box.surface_area() * size;
+                }
+                box = box_of(subtrees[begin].ref);
+                size = 0;
+                for (int k = begin + 1; k < end; k++) {
+                    box = surrounding_box(box, box_of(subtrees[k - 1].ref));
+                    size += subtrees[k - 1].size;
+                    double cost = box.surface_area() * size + right_cost[k - begin];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = k;
+                    }
+                }
+            }
+
+            if (best_axis != 2) {
+                std::sort(subtrees.begin() + begin, subtrees.begin() + end,
+                          [best_axis](const Subtree& a, const Subtree& b) { return a.center[best_axis] < b.center[best_axis]; });
+            }
+
+            int index = free_nodes[next_free++];
+            int left = build_sah(subtrees, begin, best_split, free_nodes, next_free, heights);
+            int right = build_sah(subtrees, best_split, end, free_nodes, next_free, heights);
+
+            Node& node = nodes[index];
+            node.left = left;
+            node.right = right;
+            node.box = surrounding_box(box_of(left), box_of(right));
+            set_traversal_order(node);
+            set_parent(left, index);
+            set_parent(right, index);
+            heights[index] = 1 + std::max(height_of(left, heights), height_of(right, heights));
+            return index;
+        }
+
+    public:
+        LBVHSettings settings;
+        std::vector<shared_ptr<Hittable>> primitives; // in Morton order
+        std::vector<aabb> leaf_boxes;
+        std::vector<Node> nodes;
+        std::vector<int> leaf_parents;
+        int root;   // ~0 when there is a single primitive
+        int height; // levels of nodes from the root to the deepest leaf, 0 for a single primitive
+};
+
+#endif
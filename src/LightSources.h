@@ -8,7 +8,7 @@
 #include "utility.h"
 #include <vector>
 #include <iostream>
-#include "aabb.h"
+#include <unordered_map>
 
 /*
 My light sources are an area of hittable objects with Diffuse Light materials
@@ -18,54 +18,50 @@ they additionally have a way to generate random surface points
 the lightsources object generate a user-defined amount number of points from each light source and we use
 this to have an area light
 
-It is also a hittable object so that we can compute shadow ray intersections
+The lights are ALSO in the scene like any other object (see add_light() in Scenes.h) => they are in the BVH
+and one traversal gives the closest surface or light, there is no second pass over the lights for every ray.
+This list only keeps what is needed to sample them:
+    the shader samples every light from the point it shades (light(i).random_direction(p))
+    index_of() tells if what a ray hit is one of the lights (and which one)
 */
 
-class LightSources : Hittable {
+class LightSources {
 public:
     
     LightSources() {}
     
     LightSources(shared_ptr<Hittable> object) { add(object); }
 
-    void clear() { lights.clear(); }
+    void clear() {
+        lights.clear();
+        indices.clear();
+    }
 
-    void add(shared_ptr<Hittable> object) { lights.push_back(object); }
+    // the object also has to be added to the scene, otherwise rays never find it
+    void add(shared_ptr<Hittable> object) {
+        indices[object.get()] = size();
+        lights.push_back(object);
+    }
 
-    virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override {
-        HitRecord temp_rec;
-        bool hit_anything = false;
-        auto closest_so_far = t_max;
+    int size() const { return static_cast<int>(lights.size()); }
 
-        // instead oh infinity for tmax, we use the closest poiny so far, this is why hit starts with tmax
-        for (const auto& light : lights) {
-            if (light->hit(r, t_min, closest_so_far, temp_rec)) {
-                hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
-            }
-        }
+    const Hittable& light(int i) const { return *lights[i]; }
 
-        return hit_anything;
+    // -1 if object is not one of the lights
+    int index_of(const Hittable* object) const {
+        auto it = indices.find(object);
+        return it == indices.end() ? -1 : it->second;
     }
-        
-    virtual bool bounding_box(aabb& output_box) const override {
-        if (lights.empty()) return false;
-
-        aabb temp_box;
-        bool first_box = true;
 
+    // false if no light can be reached from p along v => the shader does not trace that ray at all
+    // with a handful of lights asking each one is much cheaper than a traversal of the scene,
+    // with many lights it would not be => always true and the traversal finds out
+    bool may_reach_light(const Point3& p, const Vec3& v) const {
+        if (size() > max_lights_to_check) return true;
         for (const auto& light : lights) {
-            if (!light->bounding_box(temp_box)) return false;
-            output_box = first_box ? temp_box : surrounding_box(output_box, temp_box);
-            first_box = false;
+            if (light->pdf_value(p, v) > 0) return true;
         }
-
-        return true;
-    }
-
-    virtual std::string name() const override {
-        return "lights";
+        return false;
     }
 
     std::vector<Point3> generate_random_positions(int num_light_samples) const {
@@ -80,12 +76,14 @@ public:
         return res;
     }
 
-    virtual Vec3 random_surface_point() const override {
-        int which = random_int(0, lights.size());
+    Vec3 random_surface_point() const {
+        int which = random_int(0, size() - 1);
         return lights[which]->random_surface_point();
     }
 private:
+    static const int max_lights_to_check = 8;
     std::vector<shared_ptr<Hittable>> lights;
+    std::unordered_map<const Hittable*, int> indices;
 };
 
 #endif
@@ -62,6 +62,51 @@ class Material {
 
         // used for the swtich statement => I added a way for reflection, for refraction and for emission
         virtual MatTypes type() const = 0;
+
+        // base color of the surface without any lighting => the denoiser uses it to keep textures sharp
+        virtual Color albedo(const HitRecord& rec) const {
+            return Color(1, 1, 1);
+        }
+
+        // perfect mirrors and glass => what matters for the denoiser is what they reflect or refract
+        virtual bool specular() const {
+            return false;
+        }
+
+        // refractive index of glass, 1 for everything else => the ray differentials through glass need it
+        virtual Real index_of_refraction() const {
+            return 1;
+        }
+
+        // sharp highlights (big p) => the shader also samples the highlight lobe to find the lights
+        // instead of only sampling the lights (multiple importance sampling, see Shader::perform_blinn_phong)
+        virtual bool glossy() const {
+            return false;
+        }
+
+        // the scattered ray is cosine distributed around the normal => the light it brings back is smooth over the
+        // surface and can be interpolated from the irradiance cache (IrradianceCache.h) instead of being traced
+        virtual bool diffuse() const {
+            return false;
+        }
+
+        // direction l drawn from the highlight lobe pow(n.h, p), v points towards the viewer
+        // h is drawn with a density proportional to pow(n.h, p) then v is reflected about it
+        Vec3 sample_highlight(const Vec3& n, const Vec3& v) const {
+            Real cos_theta = std::pow(random_double(), 1.0 / (p + 1));
+            Vec3 h = direction_around(n, cos_theta, 2 * pi * random_double());
+            return 2 * v.dot(h) * h - v;
+        }
+
+        // density of sample_highlight() giving l, per unit of solid angle
+        // pdf of h is (p+1)/(2 pi) pow(n.h, p) and going from h to l divides by 4 (v.h)
+        Real highlight_pdf(const Vec3& n, const Vec3& v, const Vec3& l) const {
+            Vec3 h = v + l;
+            h.normalize();
+            Real cos_theta = n.dot(h), v_dot_h = v.dot(h);
+            if (cos_theta <= 0 || v_dot_h <= 0) return 0;
+            return (p + 1) / (2 * pi) * std::pow(cos_theta, p) / (4 * v_dot_h);
+        }
     public:
         float ka, // ambience
         km, // reflectivity
@@ -73,7 +118,7 @@ class Material {
 class Matte : public Material {
     public:
         Matte(const Color& a) 
-            : texture(make_shared<SolidColor>(a)) {
+            : texture(a) {
             ka = 0.1;
             kd = 0.6;
             km = 0.1;
@@ -90,26 +135,35 @@ class Matte : public Material {
         
         virtual ScatterRec scatter(const Ray& r_in, const HitRecord& rec) const override {
             // scatter randomly 
-            auto scatter_direction = rec.normal + random_unit_vector();
+            // a Vec3 and not auto => auto would keep the Eigen expression which refers to the temporary unit vector
+            Vec3 scatter_direction = rec.normal + random_unit_vector();
 
             ScatterRec res;
             res.ray_to_trace = Ray(rec.p, scatter_direction);
-            res.local_color = texture->value(rec.u, rec.v, rec.p); // called the texture.value() function to set a texture
+            res.local_color = texture->filtered_value(rec.u, rec.v, rec.du, rec.dv, rec.p); // called the texture.value() function to set a texture
             return res;
         }
 
+        virtual bool diffuse() const override {
+            return true;
+        }
+
+        virtual Color albedo(const HitRecord& rec) const override {
+            return texture->filtered_value(rec.u, rec.v, rec.du, rec.dv, rec.p);
+        }
+
          virtual MatTypes type() const {
              return blinn_phong;
          } 
 
     public:
-        shared_ptr<Texture> texture;
+        TextureRef texture;
 };
 
 // this material reflects perfectly => mirror effect
 class Metal : public Material {
     public:
-        Metal(const Color& a) : texture(make_shared<SolidColor>(a))  {
+        Metal(const Color& a) : texture(a)  {
             ka = 0.01;
             kd = 0.01;
             km = 0.75;
@@ -117,7 +171,7 @@ class Metal : public Material {
             p = 10000;
         }
 
-        Metal(const Color& a, float _km) : texture(make_shared<SolidColor>(a))  {
+        Metal(const Color& a, float _km) : texture(a)  {
             ka = 0.01;
             kd = 0.01;
             km = _km;
@@ -132,7 +186,7 @@ class Metal : public Material {
             Vec3 reflected = reflect(r_in, rec.normal);
             
             res.ray_to_trace = Ray(rec.p, reflected);
-            res.local_color = texture->value(rec.u, rec.v, rec.p);
+            res.local_color = texture->filtered_value(rec.u, rec.v, rec.du, rec.dv, rec.p);
 
             /*
             if (res.ray_to_trace.direction().dot(rec.normal) <= 0) {
@@ -143,19 +197,31 @@ class Metal : public Material {
             return res;
         }
 
+        virtual Color albedo(const HitRecord& rec) const override {
+            return texture->filtered_value(rec.u, rec.v, rec.du, rec.dv, rec.p);
+        }
+
+        virtual bool specular() const override {
+            return true;
+        }
+
+        virtual bool glossy() const override {
+            return true;
+        }
+
         virtual MatTypes type() const {
             return blinn_phong;
         } 
 
     public:
-        shared_ptr<Texture> texture;
+        TextureRef texture;
 };
 
 // this material has a fuzzy reflection
 class FuzzyMetal : public Material {
     public:
         FuzzyMetal(const Color& a, double f) 
-        : texture(make_shared<SolidColor>(a)), fuzz(f < 1 ? f : 1) {
+        : texture(a), fuzz(f < 1 ? f : 1) {
             ka = 0.1;
             kd = 0.4;
             km = f;
@@ -170,7 +236,7 @@ class FuzzyMetal : public Material {
             Vec3 reflected = reflect(r_in, rec.normal);
             
             res.ray_to_trace = Ray(rec.p, reflected+ fuzz*random_in_unit_sphere());
-            res.local_color = texture->value(rec.u, rec.v, rec.p);
+            res.local_color = texture->filtered_value(rec.u, rec.v, rec.du, rec.dv, rec.p);
 
             /*
             if (res.ray_to_trace.direction().dot(rec.normal) <= 0) {
@@ -180,12 +246,20 @@ class FuzzyMetal : public Material {
             return res;
         }
 
+        virtual Color albedo(const HitRecord& rec) const override {
+            return texture->filtered_value(rec.u, rec.v, rec.du, rec.dv, rec.p);
+        }
+
+        virtual bool glossy() const override {
+            return true;
+        }
+
         virtual MatTypes type() const {
             return blinn_phong;
         } 
 
     public:
-        shared_ptr<Texture> texture;
+        TextureRef texture;
         double fuzz;
 };
 
@@ -226,6 +300,14 @@ class Dielectric : public Material {
             return glassy;
         } 
 
+        virtual bool specular() const override {
+            return true;
+        }
+
+        virtual Real index_of_refraction() const override {
+            return ir;
+        }
+
     public:
         double ir; // Index of Refraction
 
@@ -246,7 +328,7 @@ class DiffuseLight : public Material  {
             ks = 0.9;
             p = 0.1;
         }
-        DiffuseLight(Color c) : emit(make_shared<SolidColor>(c)) {
+        DiffuseLight(Color c) : emit(c) {
             kd = 0.95; // add some shape
             ks = 0.9;
             p = 0.1;
@@ -261,11 +343,15 @@ class DiffuseLight : public Material  {
             return emit->value(u, v, p);
         }
 
+        virtual Color albedo(const HitRecord& rec) const override {
+            return emit->value(rec.u, rec.v, rec.p);
+        }
+
         virtual MatTypes type() const {
             return light_emitter;
         } 
 
     public:
-        shared_ptr<Texture> emit;
+        TextureRef emit;
 };
 #endif
\ No newline at end of file
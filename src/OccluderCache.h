@@ -0,0 +1,111 @@
+#ifndef OCCLUDER_CACHE_H
+#define OCCLUDER_CACHE_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "Hittable.h"
+
+/*
+Cache of the last object that blocked a shadow ray
+
+Two shading points next to each other nearly always have their light blocked by the same thing
+(the floor under a box is in the shadow of that box for every sample of the light).
+So before traversing the BVH for a shadow ray we test the object that blocked the last shadow ray
+towards the same light from the same region of space:
+    it still blocks the ray => occluded, one intersection test instead of a whole traversal
+    it does not (or nothing was stored) => normal traversal, and whatever blocks the ray is stored for next time
+The answer is always exact, the cache only changes how fast we get it.
+
+The key is (light, cell of the shading point) with cells of cell_size on a side,
+the table is direct mapped => a new key simply replaces the old one in its slot.
+The light samples are drawn again at every shading point (see Shader::sample_light) so sample number s of two points
+has nothing in common => the key is the light and not the sample, any sample of that light can try the occluder.
+
+Every thread has its own table (thread_local) => no locks and no sharing between the render threads.
+The tables remember which cache filled them => a table is emptied when another shader (another scene) uses it
+and a pointer to an object of a scene that is gone is never tested.
+
+    OccluderCache cache(16);
+    const Hittable* occluder = cache.lookup(p, light_index);
+    ... occluder->hit(shadow_ray, ...) or traverse and cache.store(p, light_index, what_was_hit)
+*/
+
+class OccluderCache {
+    public:
+        static const int table_size = 4096; // entries per thread, power of 2
+
+        explicit OccluderCache(Real _cell_size = 16) : cell_size(_cell_size), id(next_id()++) {}
+
+        // object that blocked the last shadow ray towards this light from the cell of p, nullptr if none
+        const Hittable* lookup(const Point3& p, int light) const {
+            Key key = make_key(p, light);
+            const Entry& entry = table()[slot(key)];
+            return entry.key == key ? entry.occluder : nullptr;
+        }
+
+        // nullptr => the ray reached the light, forget the occluder of that slot
+        void store(const Point3& p, int light, const Hittable* occluder) const {
+            Key key = make_key(p, light);
+            Entry& entry = table()[slot(key)];
+            entry.key = key;
+            entry.occluder = occluder;
+        }
+
+    private:
+        struct Key {
+            int32_t x, y, z, light;
+            bool operator==(const Key& other) const {
+                return x == other.x && y == other.y && z == other.z && light == other.light;
+            }
+        };
+
+        struct Entry {
+            Key key = Key{0, 0, 0, -1};
+            const Hittable* occluder = nullptr;
+        };
+
+        struct Table {
+            uint64_t owner = 0;
+            std::vector<Entry> entries;
+        };
+
+        Key make_key(const Point3& p, int light) const {
+            return Key{
+                static_cast<int32_t>(std::floor(p.x() / cell_size)),
+                static_cast<int32_t>(std::floor(p.y() / cell_size)),
+                static_cast<int32_t>(std::floor(p.z() / cell_size)),
+                light
+            };
+        }
+
+        static int slot(const Key& key) {
+            uint32_t h = static_cast<uint32_t>(key.x) * 73856093u
+                       ^ static_cast<uint32_t>(key.y) * 19349663u
+                       ^ static_cast<uint32_t>(key.z) * 83492791u
+                       ^ static_cast<uint32_t>(key.light) * 2654435761u;
+            return static_cast<int>(h & (table_size - 1));
+        }
+
+        // the table of the calling thread, emptied if another cache used it last
+        std::vector<Entry>& table() const {
+            static thread_local Table local;
+            if (local.owner != id) {
+                local.entries.assign(table_size, Entry());
+                local.owner = id;
+            }
+            return local.entries;
+        }
+
+        // ids start at 1 => 0 is the owner of a table nobody used yet
+        static std::atomic<uint64_t>& next_id() {
+            static std::atomic<uint64_t> counter(1);
+            return counter;
+        }
+
+        Real cell_size;
+        uint64_t id;
+};
+
+#endif
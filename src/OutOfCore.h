@@ -0,0 +1,1022 @@
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+#include "utility.h"
+#include "Hittable.h"
+#include "Parallel.h"
+#include "PrimitiveSets.h"
+#include "Renderer.h"
+#include "Shader.h"
+#include "Stats.h"
+#include "Trace.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+Out-of-core geometry => scenes with more spheres and rects than fit in memory
+
+Everything in a HittableList or a BVH is in memory for the whole render. Here the geometry is cut into chunks
+with a grid over the scene and every chunk is a SphereSet + RectSet (with their SetBVH) stored in its own file.
+What stays in memory all the time is small:
+    one ChunkHandle per chunk => its box, its file and how many bytes it takes once loaded
+    a SetBVH over the boxes of the chunks => the top level, finds the chunks a ray goes through
+    the materials (shared by all the chunks, a chunk file only stores indices into them)
+The chunks themselves are paged in by a ChunkCache that keeps at most budget bytes of them,
+the least recently used ones are dropped when a new one comes in (they are loaded again if a ray needs them later).
+
+Building, one primitive at a time => the primitives never all need to be in memory:
+    OutOfCoreScene scene(settings);             // settings.directory must exist
+    OutOfCoreWriter writer(scene, bounds);      // bounds of the whole scene, for the grid
+    for (...) writer.add_sphere(center, radius, material);
+    writer.finish();                            // one chunk at a time => chunk files
+    render_out_of_core(camera, shader, scene, &resident, settings, frame); // the shader's world is resident
+The writer appends the primitives of every cell to a staging file, finish() reads them back one cell at a time,
+builds the sets and writes the chunk file.
+
+Two ways to intersect:
+    hit()        => like any Hittable, the chunks along the ray are paged in as the traversal reaches them
+                    => one ray after the other, rays going different ways page the same chunks in and out again
+                    as soon as the chunks they need are over the budget, only meant for a few rays
+    intersect()  => many rays at once through a ChunkScheduler: every ray waits on the queue of the next chunk it enters
+                    (front to back, the chunks its box test says it goes through) and each page-in serves the whole queue.
+                    Then the rays of the queue move on to their next chunk, unless they hit something before they enter it
+                    => a ray visits the chunks hit() would visit.
+render_out_of_core() puts the camera rays of a group of tiles, their bounces and their shadow rays through the same
+ChunkScheduler (see below) => it never calls hit() and a chunk is read for all of them at once.
+
+A hit in a chunk is reported as a hit on its ChunkHandle (rec.object) => the object stays valid after the chunk
+is dropped (the occluder cache of the shader keeps pointers to what blocked a shadow ray).
+The chunk files are raw copies of the arrays => they are only meant to be read back by the same build.
+*/
+
+struct OutOfCoreSettings {
+    std::string directory = ".";          // where the chunk files go, must exist
+    int cells_per_axis = 8;               // grid of chunks over the bounds of the scene
+    size_t memory_budget = 256ull << 20;  // bytes of chunks kept in memory
+    size_t staging_bytes = 64 << 10;      // per cell, the writer appends to the staging file when this is full
+    int wave_paths = 1 << 18;             // render_out_of_core() takes as many tiles at a time as make about this many camera rays
+};
+
+// the geometry of one chunk once it is in memory
+struct GeometryChunk {
+    SphereSet spheres;
+    RectSet rects;
+    size_t bytes = 0;
+
+    bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const {
+        bool hit_anything = spheres.hit(r, t_min, t_max, rec);
+        if (hit_anything) t_max = rec.t;
+        if (rects.hit(r, t_min, t_max, rec)) hit_anything = true;
+        return hit_anything;
+    }
+
+    // what the arrays of the sets take
+    size_t memory_bytes() const {
+        const SphereSet& s = spheres;
+        const RectSet& q = rects;
+        return sizeof(GeometryChunk)
+            + s.centers.size() * sizeof(Point3) + s.radii.size() * sizeof(double) + s.material_ids.size() * sizeof(int)
+            + 4 * s.x.size() * sizeof(float) + s.slots.size() * sizeof(int) + s.bvh.nodes.size() * sizeof(SetBVH::Node)
+            + q.rects.size() * sizeof(RectSet::Rect) + 6 * q.axis.size() * sizeof(float) + q.slots.size() * sizeof(int)
+            + q.bvh.nodes.size() * sizeof(SetBVH::Node);
+    }
+};
+
+/*
+The chunk files
+    header, then every array as (count, raw bytes) => SphereSet then RectSet, each followed by
+    the global index of each of its materials in the order of its MaterialTable
+Loading gives back the same sets as the build, with the same BVH.
+*/
+class ChunkFile {
+    public:
+        // materials => global index of every material of the chunk, per set, in the order of the MaterialTable
+        static bool write(const std::string& filename, const GeometryChunk& chunk,
+                          const std::vector<int>& sphere_materials, const std::vector<int>& rect_materials) {
+            std::FILE* file = std::fopen(filename.c_str(), "wb");
+            if (!file) {
+                std::cerr << "cannot write " << filename << "\n";
+                return false;
+            }
+            uint32_t header[2] = {magic, static_cast<uint32_t>(sizeof(Real))};
+            std::fwrite(header, sizeof(header), 1, file);
+
+            const SphereSet& s = chunk.spheres;
+            write_vector(file, s.centers); write_vector(file, s.radii); write_vector(file, s.material_ids);
+            write_vector(file, s.x); write_vector(file, s.y); write_vector(file, s.z); write_vector(file, s.r2);
+            write_vector(file, s.slots); write_vector(file, s.bvh.nodes); write_vector(file, sphere_materials);
+
+            const RectSet& q = chunk.rects;
+            write_vector(file, q.rects);
+            write_vector(file, q.axis); write_vector(file, q.k); write_vector(file, q.a0); write_vector(file, q.a1);
+            write_vector(file, q.b0); write_vector(file, q.b1);
+            write_vector(file, q.slots); write_vector(file, q.bvh.nodes); write_vector(file, rect_materials);
+
+            bool ok = !std::ferror(file);
+            std::fclose(file);
+            return ok;
+        }
+
+        // global => shared_ptr of the material with each global index
+        static bool read(const std::string& filename, const std::function<shared_ptr<Material>(int)>& global, GeometryChunk& chunk) {
+            std::FILE* file = std::fopen(filename.c_str(), "rb");
+            if (!file) return false;
+            uint32_t header[2] = {0, 0};
+            bool ok = std::fread(header, sizeof(header), 1, file) == 1 && header[0] == magic && header[1] == sizeof(Real);
+
+            SphereSet& s = chunk.spheres;
+            std::vector<int> sphere_materials, rect_materials;
+            ok = ok && read_vector(file, s.centers) && read_vector(file, s.radii) && read_vector(file, s.material_ids)
+                    && read_vector(file, s.x) && read_vector(file, s.y) && read_vector(file, s.z) && read_vector(file, s.r2)
+                    && read_vector(file, s.slots) && read_vector(file, s.bvh.nodes) && read_vector(file, sphere_materials);
+
+            RectSet& q = chunk.rects;
+            ok = ok && read_vector(file, q.rects)
+                    && read_vector(file, q.axis) && read_vector(file, q.k) && read_vector(file, q.a0) && read_vector(file, q.a1)
+                    && read_vector(file, q.b0) && read_vector(file, q.b1)
+                    && read_vector(file, q.slots) && read_vector(file, q.bvh.nodes) && read_vector(file, rect_materials);
+            std::fclose(file);
+            if (!ok) return false;
+
+            s.bvh.measure_height();
+            q.bvh.measure_height();
+
+            // same order as when the chunk was built => the same local indices
+            for (int m : sphere_materials) s.materials.index_of(global(m));
+            for (int m : rect_materials) q.materials.index_of(global(m));
+
+            chunk.bytes = chunk.memory_bytes();
+            return true;
+        }
+
+    private:
+        static const uint32_t magic = 0x4b4e4843; // "CHNK"
+
+        template <class T>
+        static void write_vector(std::FILE* file, const std::vector<T>& v) {
+            uint64_t count = v.size();
+            std::fwrite(&count, sizeof(count), 1, file);
+            if (count) std::fwrite(v.data(), sizeof(T), v.size(), file);
+        }
+
+        template <class T>
+        static bool read_vector(std::FILE* file, std::vector<T>& v) {
+            uint64_t count = 0;
+            if (std::fread(&count, sizeof(count), 1, file) != 1) return false;
+            v.resize(static_cast<size_t>(count));
+            return count == 0 || std::fread(v.data(), sizeof(T), v.size(), file) == v.size();
+        }
+};
+
+struct ChunkCacheStats {
+    long long page_ins = 0;   // chunks read from disk
+    long long hits = 0;       // requests for a chunk that was already in memory
+    long long evictions = 0;  // chunks dropped to stay under the budget
+    long long bytes_read = 0;
+};
+
+/*
+LRU cache of the chunks in memory, shared by all the render threads
+A chunk is read outside of the lock => the other threads keep working, the ones that want the same chunk wait for it.
+The chunks are handed out as shared_ptr => a dropped chunk stays alive until the rays working on it are done,
+so the memory can go over the budget by about one chunk per thread.
+The last chunk read is never dropped, even when it is bigger than the budget on its own.
+*/
+class ChunkCache {
+    public:
+        typedef std::function<shared_ptr<const GeometryChunk>(int)> Loader;
+
+        ChunkCache(size_t _budget = 0) : budget(_budget) {}
+
+        void reset(int num_chunks, size_t _budget, const Loader& _load) {
+            std::lock_guard<std::mutex> lock(mutex);
+            slots.assign(num_chunks, Slot());
+            lru.clear();
+            resident_bytes = 0;
+            budget = _budget;
+            load = _load;
+            counters = ChunkCacheStats();
+        }
+
+        // the chunk, read from its file first if it is not in memory
+        shared_ptr<const GeometryChunk> get(int id) {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                if (slots[id].chunk) {
+                    counters.hits++;
+                    lru.splice(lru.begin(), lru, slots[id].position);
+                    return slots[id].chunk;
+                }
+                if (!slots[id].loading) break;
+                loaded.wait(lock);
+            }
+            slots[id].loading = true;
+            lock.unlock();
+
+            shared_ptr<const GeometryChunk> chunk;
+            {
+                TRACE_SCOPE_ARG("page in", id);
+                chunk = load(id);
+            }
+
+            lock.lock();
+            Slot& slot = slots[id];
+            slot.loading = false;
+            slot.chunk = chunk;
+            lru.push_front(id);
+            slot.position = lru.begin();
+            resident_bytes += chunk->bytes;
+            counters.page_ins++;
+            counters.bytes_read += chunk->bytes;
+
+            while (resident_bytes > budget && lru.size() > 1) {
+                int victim = lru.back();
+                lru.pop_back();
+                resident_bytes -= slots[victim].chunk->bytes;
+                slots[victim].chunk.reset();
+                counters.evictions++;
+            }
+            loaded.notify_all();
+            return chunk;
+        }
+
+        // the caller is done with the chunk for now => it goes to the end of the LRU, the first one dropped when room is needed
+        void retire(int id) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (slots[id].chunk) lru.splice(lru.end(), lru, slots[id].position);
+        }
+
+        bool resident(int id) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return slots[id].chunk != nullptr;
+        }
+
+        ChunkCacheStats stats() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return counters;
+        }
+
+        size_t memory_bytes() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return resident_bytes;
+        }
+
+    private:
+        struct Slot {
+            shared_ptr<const GeometryChunk> chunk;
+            std::list<int>::iterator position; // in lru, when chunk is set
+            bool loading = false;
+        };
+
+        mutable std::mutex mutex;
+        std::condition_variable loaded;
+        std::vector<Slot> slots;
+        std::list<int> lru; // most recently used first
+        size_t resident_bytes = 0;
+        size_t budget;
+        Loader load;
+        ChunkCacheStats counters;
+};
+
+class OutOfCoreScene;
+
+// what stays in memory for a chunk => the object the hits in the chunk report
+class ChunkHandle : public Hittable {
+    public:
+        ChunkHandle(const OutOfCoreScene* _scene, int _id, const aabb& _box, const std::string& _file)
+            : scene(_scene), id(_id), box(_box), file(_file) {}
+
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override;
+
+        virtual bool bounding_box(aabb& output_box) const override {
+            output_box = box;
+            return true;
+        }
+
+        virtual std::string name() const override {
+            return "chunk " + std::to_string(id);
+        }
+
+        virtual Vec3 random_surface_point() const override;
+
+    public:
+        const OutOfCoreScene* scene;
+        int id;
+        aabb box;
+        std::string file;
+        int num_spheres = 0, num_rects = 0;
+        size_t bytes = 0; // once loaded
+};
+
+class OutOfCoreScene : public Hittable {
+    public:
+        OutOfCoreScene(const OutOfCoreSettings& _settings = OutOfCoreSettings()) : settings(_settings) {}
+
+        OutOfCoreScene(const OutOfCoreScene&) = delete;
+        OutOfCoreScene& operator=(const OutOfCoreScene&) = delete;
+
+        // index of a material in the table shared by all the chunks
+        int material_index(const shared_ptr<Material>& material) { return materials.index_of(material); }
+
+        // called by OutOfCoreWriter::finish() with the chunks it wrote => builds the top level
+        void set_chunks(std::vector<ChunkHandle>&& _chunks) {
+            chunks = std::move(_chunks);
+            std::vector<aabb> boxes;
+            for (const ChunkHandle& chunk : chunks) boxes.push_back(chunk.box);
+            top.build(boxes, top_slots);
+            cache.reset(static_cast<int>(chunks.size()), settings.memory_budget, [this](int id) { return load(id); });
+        }
+
+        shared_ptr<const GeometryChunk> chunk(int id) const { return cache.get(id); }
+
+        // drops the chunks in memory and starts the counters of the cache again
+        void set_memory_budget(size_t budget) {
+            settings.memory_budget = budget;
+            cache.reset(static_cast<int>(chunks.size()), budget, [this](int id) { return load(id); });
+        }
+
+        // for a scene made for one render => the chunk files go away, the scene cannot be used after that
+        void remove_files() {
+            for (const ChunkHandle& chunk : chunks) std::remove(chunk.file.c_str());
+        }
+
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            return top.traverse(r, t_min, t_max, [&](int first, int count, Real& t_far) {
+                bool found = false;
+                for (int s = first; s < first + count; s++) {
+                    int c = top_slots[s];
+                    if (c >= 0 && chunks[c].box.hit(r, t_min, t_far) && chunks[c].hit(r, t_min, t_far, rec)) {
+                        t_far = rec.t;
+                        found = true;
+                    }
+                }
+                return found;
+            });
+        }
+
+        /*
+        Closest hits of all the rays, hits[i] says if rays[i] hit something in [t_min, t_max[i]] and recs[i] is the hit
+        t_max => how far each ray may go (a closer hit found in other geometry), nullptr => no limit
+        any_hit => shadow rays, a ray is done with its first hit (recs[i] is then any hit, not the closest)
+        */
+        void intersect(const std::vector<Ray>& rays, Real t_min, const std::vector<Real>* t_max,
+                       std::vector<HitRecord>& recs, std::vector<char>& hits, bool any_hit = false, int num_threads = 0) const;
+
+        virtual bool bounding_box(aabb& output_box) const override {
+            if (top.empty()) return false;
+            output_box = top.bounds();
+            return true;
+        }
+
+        virtual std::string name() const override {
+            return "out of core scene";
+        }
+
+        virtual Vec3 random_surface_point() const override {
+            return chunks[random_int(0, static_cast<int>(chunks.size()) - 1)].random_surface_point();
+        }
+
+        int num_chunks() const { return static_cast<int>(chunks.size()); }
+        ChunkCacheStats cache_stats() const { return cache.stats(); }
+        size_t resident_bytes() const { return cache.memory_bytes(); }
+
+        // all the chunks once loaded => what the budget is compared to
+        size_t total_bytes() const {
+            size_t bytes = 0;
+            for (const ChunkHandle& chunk : chunks) bytes += chunk.bytes;
+            return bytes;
+        }
+
+    private:
+        shared_ptr<const GeometryChunk> load(int id) const {
+            auto chunk = make_shared<GeometryChunk>();
+            if (!ChunkFile::read(chunks[id].file, [this](int m) { return materials.shared(m); }, *chunk)) {
+                std::cerr << "cannot read " << chunks[id].file << " => chunk " << id << " is left empty\n";
+                *chunk = GeometryChunk();
+            }
+            return chunk;
+        }
+
+    public:
+        OutOfCoreSettings settings;
+        MaterialTable materials;
+
+    private:
+        friend class ChunkScheduler;
+
+        std::vector<ChunkHandle> chunks;
+        SetBVH top;
+        std::vector<int> top_slots;
+        mutable ChunkCache cache;
+};
+
+inline bool ChunkHandle::hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const {
+    if (!scene->chunk(id)->hit(r, t_min, t_max, rec)) return false;
+    rec.object = this;
+    return true;
+}
+
+inline Vec3 ChunkHandle::random_surface_point() const {
+    shared_ptr<const GeometryChunk> chunk = scene->chunk(id);
+    if (chunk->rects.size() == 0 || (chunk->spheres.size() > 0 && random_double() < 0.5)) return chunk->spheres.random_surface_point();
+    return chunk->rects.random_surface_point();
+}
+
+/*
+The rays in flight through the chunks of an OutOfCoreScene => what intersect() and render_out_of_core() go through
+add() a ray => it waits on the queue of the next chunk it enters (front to back, the chunks its box test says it goes through).
+run() visits the chunks one after the other, a visit serves the whole queue of the chunk (by blocks on all the threads),
+then the rays move on to their next chunk unless they hit something in front of it => a ray visits the chunks hit() would visit.
+done() gets the rays whose hit is known (the closest one, any one for a shadow ray, or none) and may add() new rays
+(the next bounce, the shadow rays), they join the queues at once => the chunks in memory serve them before anything
+else is read, whatever bounce they are at. The slots of the rays handed to done() are given out again after it returns.
+The chunks in memory are visited first (free) until no ray waits on one of them, then the rays they finished go to done()
+together. A chunk is read only when the rays done() added are stuck as well:
+    the one the fewest rays will come to after it      => none at all => it is read once for all the rays that need it
+    the longest queue when they are equal
+A chunk that no ray waits on or will come to any more goes to the end of the LRU of the cache => it is dropped first.
+*/
+class ChunkScheduler {
+    public:
+        typedef std::function<void(const std::vector<int>&)> Done;
+
+        ChunkScheduler(const OutOfCoreScene& _scene, int _num_threads = 0)
+            : scene(_scene), num_threads(_num_threads), queues(_scene.chunks.size()), later(_scene.chunks.size(), 0) {}
+
+        // the slot of the ray => hit(slot) and record(slot) in done()
+        int add(const Ray& r, Real t_min, Real t_max, bool any_hit = false) {
+            int slot;
+            if (free_slots.empty()) {
+                slot = static_cast<int>(rays.size());
+                rays.push_back(r);
+                t_mins.push_back(t_min);
+                best.push_back(t_max);
+                any_hits.push_back(any_hit);
+                hits.push_back(0);
+                recs.resize(slot + 1);
+                next.push_back(0);
+                end.push_back(0);
+            } else {
+                slot = free_slots.back();
+                free_slots.pop_back();
+                rays[slot] = r;
+                t_mins[slot] = t_min;
+                best[slot] = t_max;
+                any_hits[slot] = any_hit;
+                hits[slot] = 0;
+            }
+            added.push_back(slot);
+            return slot;
+        }
+
+        void run(const Done& done) {
+            std::vector<int> batch;
+            while (true) {
+                enqueue_added();
+                // the chunks in memory first (free) until no ray waits on one of them => the rays they finish go to done() together
+                for (bool visited = true; visited; ) {
+                    visited = false;
+                    for (int k = 0; k < static_cast<int>(queues.size()); k++) {
+                        if (queues[k].empty() || !scene.cache.resident(k)) continue;
+                        visit(k);
+                        visited = true;
+                    }
+                }
+                if (!finished.empty()) {
+                    batch.swap(finished);
+                    done(batch);
+                    free_slots.insert(free_slots.end(), batch.begin(), batch.end());
+                    batch.clear();
+                    continue;
+                }
+                // a chunk is read only when no ray waits on one in memory and every ray that is done was handed out
+                int c = next_chunk();
+                if (c < 0) break;
+                visit(c);
+            }
+        }
+
+        bool hit(int slot) const { return hits[slot] != 0; }
+        const HitRecord& record(int slot) const { return recs[slot]; }
+
+    private:
+        struct Entry { int chunk; Real t; };
+
+        // the chunks along the rays added since the last time (by blocks on all the threads) then the rays go to their first queue
+        void enqueue_added() {
+            if (added.empty()) return;
+            if (entries.size() > 2 * compacted_size + (1 << 16)) compact_entries();
+            const int block_size = 1024;
+            block_entries.resize((added.size() + block_size - 1) / block_size);
+            for_blocks(static_cast<int>(added.size()), block_size, [&](int begin, int block_end) {
+                std::vector<Entry>& along = block_entries[begin / block_size];
+                along.clear();
+                for (int k = begin; k < block_end; k++) {
+                    const int slot = added[k];
+                    const Ray& r = rays[slot];
+                    const size_t first = along.size();
+                    Real t_far = best[slot];
+                    scene.top.traverse(r, t_mins[slot], t_far, [&](int slot_begin, int count, Real&) {
+                        for (int s = slot_begin; s < slot_begin + count; s++) {
+                            int c = scene.top_slots[s];
+                            Real t_enter;
+                            if (c >= 0 && scene.chunks[c].box.hit(r, t_mins[slot], best[slot], t_enter)) {
+                                along.push_back(Entry{c, t_enter});
+                            }
+                        }
+                        return false;
+                    });
+                    // a few chunks per ray => insertion sort
+                    for (size_t e = first + 1; e < along.size(); e++) {
+                        Entry entry = along[e];
+                        size_t j = e;
+                        for (; j > first && along[j - 1].t > entry.t; j--) along[j] = along[j - 1];
+                        along[j] = entry;
+                    }
+                    next[slot] = first; // in the block for now
+                    end[slot] = along.size();
+                }
+            });
+
+            size_t offset = 0;
+            for (size_t k = 0; k < added.size(); k++) {
+                const int slot = added[k];
+                if (k % block_size == 0) {
+                    const std::vector<Entry>& along = block_entries[k / block_size];
+                    offset = entries.size();
+                    entries.insert(entries.end(), along.begin(), along.end());
+                }
+                next[slot] += offset;
+                end[slot] += offset;
+                if (next[slot] == end[slot]) {
+                    finished.push_back(slot);
+                    continue;
+                }
+                queues[entries[next[slot]].chunk].push_back(slot);
+                for (size_t e = next[slot] + 1; e < end[slot]; e++) later[entries[e].chunk]++;
+            }
+            added.clear();
+        }
+
+        // the entries of the rays that wait on a queue, from the one they wait on => the others are dropped
+        void compact_entries() {
+            std::vector<Entry> kept;
+            for (const std::vector<int>& queue : queues) {
+                for (int slot : queue) {
+                    size_t first = kept.size();
+                    kept.insert(kept.end(), entries.begin() + next[slot], entries.begin() + end[slot]);
+                    next[slot] = first;
+                    end[slot] = kept.size();
+                }
+            }
+            entries.swap(kept);
+            compacted_size = entries.size();
+        }
+
+        // most of the calls have a few rays => no thread and no std::function for them
+        template <class Fn>
+        void for_blocks(int count, int block_size, const Fn& fn) const {
+            if (count <= block_size) fn(0, count);
+            else parallel_for_blocks(count, fn, num_threads, block_size);
+        }
+
+        // the chunk to read next, -1 => no ray waits any more
+        int next_chunk() const {
+            int c = -1;
+            for (int k = 0; k < static_cast<int>(queues.size()); k++) {
+                if (queues[k].empty()) continue;
+                if (c < 0 || later[k] < later[c] || (later[k] == later[c] && queues[k].size() > queues[c].size())) c = k;
+            }
+            return c;
+        }
+
+        void visit(int c) {
+            std::vector<int>& queue = visiting;
+            queue.clear();
+            queue.swap(queues[c]); // the queue of the chunk gets the memory of the last one visited
+            shared_ptr<const GeometryChunk> chunk = scene.cache.get(c);
+            for_blocks(static_cast<int>(queue.size()), 1024, [&](int begin, int block_end) {
+                for (int q = begin; q < block_end; q++) {
+                    const int slot = queue[q];
+                    HitRecord rec;
+                    if (chunk->hit(rays[slot], t_mins[slot], best[slot], rec)) {
+                        rec.object = &scene.chunks[c];
+                        recs[slot] = rec;
+                        best[slot] = any_hits[slot] ? -infinity : rec.t; // -infinity => done
+                        hits[slot] = 1;
+                    }
+                }
+            });
+
+            // on to the next chunk, unless the ray already hit something in front of it => it will not come to the others
+            for (int slot : queue) {
+                size_t e = ++next[slot];
+                if (e < end[slot] && entries[e].t <= best[slot]) {
+                    queues[entries[e].chunk].push_back(slot);
+                    leave(entries[e].chunk);
+                } else {
+                    for (; e < end[slot]; e++) leave(entries[e].chunk);
+                    finished.push_back(slot);
+                }
+            }
+            if (queues[c].empty() && later[c] == 0) scene.cache.retire(c);
+        }
+
+        // a ray that was going to come to the chunk is on its queue now or will not come at all
+        void leave(int c) {
+            if (--later[c] == 0 && queues[c].empty()) scene.cache.retire(c);
+        }
+
+        const OutOfCoreScene& scene;
+        int num_threads;
+        // per slot
+        std::vector<Ray> rays;
+        std::vector<Real> t_mins, best;          // best => the closest hit so far, -infinity => done (any hit)
+        std::vector<char> any_hits, hits;
+        std::vector<HitRecord> recs;
+        std::vector<size_t> next, end;       // entries[next] => the chunk the ray waits on, entries[end - 1] => the last one along it
+        std::vector<int> free_slots, added, finished;
+        // the chunks along every ray in the order it enters them, one ray after the other
+        // => the entries of the rays that are done stay until there are as many as the ones in use (compact_entries)
+        std::vector<Entry> entries;
+        size_t compacted_size = 0;
+        std::vector<std::vector<Entry>> block_entries; // what the threads find for the rays just added
+        std::vector<std::vector<int>> queues;          // per chunk
+        std::vector<int> visiting;
+        std::vector<int> later;                        // per chunk, the rays that will come to it after the chunk they wait on
+};
+
+/*
+Closest hits of all the rays, hits[i] says if rays[i] hit something in [t_min, t_max[i]] and recs[i] is the hit
+t_max => how far each ray may go (a closer hit found in other geometry), nullptr => no limit
+any_hit => shadow rays, a ray is done with its first hit (recs[i] is then any hit, not the closest)
+*/
+inline void OutOfCoreScene::intersect(const std::vector<Ray>& rays, Real t_min, const std::vector<Real>* t_max,
+                                      std::vector<HitRecord>& recs, std::vector<char>& hits, bool any_hit, int num_threads) const {
+    TRACE_SCOPE("intersect batch");
+    recs.resize(rays.size());
+    hits.assign(rays.size(), 0);
+    ChunkScheduler scheduler(*this, num_threads);
+    for (size_t i = 0; i < rays.size(); i++) scheduler.add(rays[i], t_min, t_max ? (*t_max)[i] : infinity, any_hit); // slot i
+    scheduler.run([&](const std::vector<int>& finished) {
+        for (int i : finished) {
+            if (!scheduler.hit(i)) continue;
+            recs[i] = scheduler.record(i);
+            hits[i] = 1;
+        }
+    });
+}
+
+/*
+Cuts the primitives into the cells of the grid
+Each cell keeps staging_bytes of primitives in memory and appends them to <directory>/cell_<i>.stage when that is full,
+finish() then turns the cells into chunk files one at a time and removes the staging files.
+A primitive goes to the cell of the center of its box => the chunk boxes overlap a bit where primitives stick out.
+*/
+class OutOfCoreWriter {
+    public:
+        OutOfCoreWriter(OutOfCoreScene& _scene, const aabb& _bounds)
+            : scene(_scene), bounds(_bounds), cells(_scene.settings.cells_per_axis),
+              staged(cells * cells * cells), written(cells * cells * cells, 0) {}
+
+        void add_sphere(const Point3& center, double radius, const shared_ptr<Material>& material) {
+            add(Primitive{-1, scene.material_index(material), {center.x(), center.y(), center.z(), radius, 0, 0}}, center);
+        }
+
+        // same arguments as RectSet::add_xy/add_xz/add_yz
+        void add_xy(double x0, double x1, double y0, double y1, double k, const shared_ptr<Material>& mat) { add_rect(2, x0, x1, y0, y1, k, mat); }
+        void add_xz(double x0, double x1, double z0, double z1, double k, const shared_ptr<Material>& mat) { add_rect(1, x0, x1, z0, z1, k, mat); }
+        void add_yz(double y0, double y1, double z0, double z1, double k, const shared_ptr<Material>& mat) { add_rect(0, y0, y1, z0, z1, k, mat); }
+
+        // writes the chunks and hands them to the scene, false if a file could not be written
+        bool finish() {
+            std::vector<ChunkHandle> chunks;
+            bool ok = true;
+            for (int cell = 0; cell < static_cast<int>(staged.size()); cell++) {
+                std::vector<Primitive> primitives;
+                if (!read_staged(cell, primitives)) ok = false;
+                if (primitives.empty()) continue;
+
+                GeometryChunk chunk;
+                std::vector<int> sphere_materials, rect_materials;
+                for (const Primitive& p : primitives) {
+                    const shared_ptr<Material>& material = scene.materials.shared(p.material);
+                    if (p.axis < 0) {
+                        if (chunk.spheres.materials.index_of(material) == static_cast<int>(sphere_materials.size())) sphere_materials.push_back(p.material);
+                        chunk.spheres.add(Point3(p.v[0], p.v[1], p.v[2]), p.v[3], material);
+                    } else {
+                        if (chunk.rects.materials.index_of(material) == static_cast<int>(rect_materials.size())) rect_materials.push_back(p.material);
+                        const double* v = p.v;
+                        if (p.axis == 0) chunk.rects.add_yz(v[0], v[1], v[2], v[3], v[4], material);
+                        else if (p.axis == 1) chunk.rects.add_xz(v[0], v[1], v[2], v[3], v[4], material);
+                        else chunk.rects.add_xy(v[0], v[1], v[2], v[3], v[4], material);
+                    }
+                }
+                std::vector<Primitive>().swap(primitives);
+                chunk.spheres.build();
+                chunk.rects.build();
+
+                std::string file = scene.settings.directory + "/chunk_" + std::to_string(chunks.size()) + ".bin";
+                if (!ChunkFile::write(file, chunk, sphere_materials, rect_materials)) {
+                    ok = false;
+                    continue;
+                }
+                aabb box;
+                bool has_spheres = chunk.spheres.bounding_box(box);
+                aabb rect_box;
+                if (chunk.rects.bounding_box(rect_box)) box = has_spheres ? surrounding_box(box, rect_box) : rect_box;
+                chunks.push_back(ChunkHandle(&scene, static_cast<int>(chunks.size()), box, file));
+                chunks.back().num_spheres = chunk.spheres.size();
+                chunks.back().num_rects = chunk.rects.size();
+                chunks.back().bytes = chunk.memory_bytes();
+            }
+            scene.set_chunks(std::move(chunks));
+            return ok;
+        }
+
+    private:
+        // a sphere (axis -1, v = center, radius) or a rect (axis of the normal, v = a0, a1, b0, b1, k)
+        struct Primitive {
+            int axis;
+            int material;
+            double v[6];
+        };
+
+        void add_rect(int axis, double a0, double a1, double b0, double b1, double k, const shared_ptr<Material>& mat) {
+            Point3 center;
+            center[axis] = k;
+            center[axis == 0 ? 1 : 0] = 0.5 * (a0 + a1);
+            center[axis == 2 ? 1 : 2] = 0.5 * (b0 + b1);
+            add(Primitive{axis, scene.material_index(mat), {a0, a1, b0, b1, k, 0}}, center);
+        }
+
+        void add(const Primitive& p, const Point3& center) {
+            int cell = 0;
+            for (int a = 2; a >= 0; a--) {
+                Real extent = bounds.max()[a] - bounds.min()[a];
+                int i = extent > 0 ? static_cast<int>((center[a] - bounds.min()[a]) / extent * cells) : 0;
+                cell = cell * cells + std::max(0, std::min(cells - 1, i));
+            }
+            staged[cell].push_back(p);
+            if (staged[cell].size() * sizeof(Primitive) >= scene.settings.staging_bytes) flush(cell);
+        }
+
+        std::string staging_file(int cell) const {
+            return scene.settings.directory + "/cell_" + std::to_string(cell) + ".stage";
+        }
+
+        void flush(int cell) {
+            std::FILE* file = std::fopen(staging_file(cell).c_str(), written[cell] ? "ab" : "wb");
+            if (!file) {
+                std::cerr << "cannot write " << staging_file(cell) << "\n";
+                return; // kept in memory => still in the chunk
+            }
+            written[cell] += std::fwrite(staged[cell].data(), sizeof(Primitive), staged[cell].size(), file);
+            std::fclose(file);
+            std::vector<Primitive>().swap(staged[cell]);
+        }
+
+        // what was appended to the staging file then what is still in memory
+        bool read_staged(int cell, std::vector<Primitive>& primitives) {
+            bool ok = true;
+            if (written[cell]) {
+                primitives.resize(written[cell]);
+                std::FILE* file = std::fopen(staging_file(cell).c_str(), "rb");
+                ok = file && std::fread(primitives.data(), sizeof(Primitive), primitives.size(), file) == primitives.size();
+                if (file) std::fclose(file);
+                std::remove(staging_file(cell).c_str());
+                if (!ok) {
+                    std::cerr << "cannot read " << staging_file(cell) << "\n";
+                    primitives.clear();
+                }
+            }
+            primitives.insert(primitives.end(), staged[cell].begin(), staged[cell].end());
+            std::vector<Primitive>().swap(staged[cell]);
+            return ok;
+        }
+
+        OutOfCoreScene& scene;
+        aabb bounds;
+        int cells;
+        std::vector<std::vector<Primitive>> staged;
+        std::vector<size_t> written; // primitives already in the staging file of each cell
+};
+
+// a path of render_out_of_core() between two bounces
+struct OutOfCorePath {
+    int pixel;              // in the image, row * width + col
+    int i, j, sample;       // what the sampler is started with
+    int dimension;          // of the sampler, where the path stopped
+    int depth;
+    Ray ray;
+    Color throughput;       // product of the weights of the bounces before
+};
+
+// what render_out_of_core() keeps for a ray in the ChunkScheduler
+struct OutOfCoreRay {
+    bool shadow;
+    OutOfCorePath path;     // a path ray
+    HitRecord resident;     // its closest resident hit, when path.ray was added with its t as t_max
+    bool resident_hit;
+    Color color;            // a shadow ray => what it brings to path.pixel if it gets through
+};
+
+// what the shading of a block of finished rays leaves => put together in the order of the blocks
+struct OutOfCoreShading {
+    std::vector<std::pair<int, Color>> colors; // pixel, what goes to it
+    std::vector<OutOfCorePath> next_paths;
+    std::vector<DeferredRay> shadows;
+    std::vector<int> shadow_pixels;
+};
+
+/*
+Same image as render() with all the rays that may reach the chunks going through a ChunkScheduler
+=> a chunk is read for all the rays waiting on it at once instead of once per ray that needs it.
+resident => the rest of the world that is in memory (lights, ...), nullptr if the scene is everything.
+The shader's world is the resident part alone => shade_deferred() hands back the rays that may be blocked by the scene.
+
+The tiles are taken a group at a time (as many as make scene.settings.wave_paths camera rays, the whole image if it is small),
+the camera rays of all the tiles of the group go in at once, then every ray whose hit is known is handled right away:
+    a path ray    => shade_deferred() of its hit (or the closest resident one), what is known goes to the pixel,
+                     the path goes on with its next ray (if it has depth left, after its closest resident hit that bounds it
+                     in the chunks) and the shadow rays go in as well
+    a shadow ray  => any hit is a block, the ones that get through add their color
+=> the rays of all the tiles of the group and of all the bounces wait on the same queues, a chunk that is read serves all of them
+(a wave of rays per bounce and per tile read most of the chunks again for every wave => more page-ins than hit()).
+The finished rays are shaded by blocks on all the threads, every block with its own sampler, and the blocks are put together in order
+=> the colors go to a pixel in the same order whatever the number of threads (not the order of render() => rounding).
+Every path keeps the dimension its sampler stopped at and goes on from it (Sampler::resume_sample)
+=> the same random numbers as render() for the first max_dimensions dimensions, the deeper ones are plain random numbers.
+The irradiance cache of the shader is not used (see Shader::shade_deferred).
+*/
+inline void render_out_of_core(const Camera& cam, const Shader& shader, const OutOfCoreScene& scene, const Hittable* resident,
+                               const RenderSettings& settings, Framebuffer& frame) {
+    TRACE_SCOPE("render out of core");
+    const int width = settings.image_width;
+    const int height = settings.image_height;
+    const int tile_size = settings.tile_size;
+    const int count = settings.sample_count();
+    const int num_threads = settings.num_threads;
+    const int block_size = 1024; // rays per block of work for a thread
+    const double footprint = 1 / std::sqrt(double(count));
+    if (frame.width != width || frame.height != height) frame = Framebuffer(width, height);
+
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+    const int num_tiles = tiles_x * tiles_y;
+    const int group_size = std::max(1, scene.settings.wave_paths / std::max(1, tile_size * tile_size * count));
+    std::vector<Color> pixels(width * height, Color(0, 0, 0));
+
+    std::vector<std::vector<OutOfCorePath>> tile_paths;
+    std::vector<OutOfCorePath> paths;
+    std::vector<OutOfCoreRay> owners; // per slot of the scheduler
+    std::vector<HitRecord> resident_recs;
+    std::vector<char> resident_hits;
+    std::vector<OutOfCoreShading> blocks;
+    std::vector<std::unique_ptr<Sampler>> samplers; // per block
+
+    for (int group = 0; group < num_tiles; group += group_size) {
+        const int group_end = std::min(group + group_size, num_tiles);
+        TRACE_SCOPE_ARG("tile group", group);
+        ChunkScheduler scheduler(scene, num_threads);
+
+        auto add_ray = [&](const Ray& r, Real t_max, bool any_hit) -> OutOfCoreRay& {
+            int slot = scheduler.add(r, epsilon, t_max, any_hit);
+            if (slot >= static_cast<int>(owners.size())) owners.resize(slot + 1);
+            return owners[slot];
+        };
+
+        // a path with no depth left gets what trace() gives at depth 0 without being cast,
+        // the others go in after their closest resident hit => it bounds their ray in the chunks
+        auto start_paths = [&](std::vector<OutOfCorePath>& started) {
+            resident_recs.resize(started.size());
+            resident_hits.assign(started.size(), 0);
+            if (resident) {
+                parallel_for_blocks(static_cast<int>(started.size()), [&](int begin, int end) {
+                    for (int k = begin; k < end; k++) {
+                        if (started[k].depth > 0) resident_hits[k] = resident->hit(started[k].ray, epsilon, infinity, resident_recs[k]);
+                    }
+                }, num_threads, block_size);
+            }
+            for (size_t k = 0; k < started.size(); k++) {
+                const OutOfCorePath& path = started[k];
+                if (path.depth <= 0) {
+                    pixels[path.pixel] += path.throughput.cwiseProduct(shader.shade(path.ray, nullptr, path.depth));
+                    continue;
+                }
+                OutOfCoreRay& owner = add_ray(path.ray, resident_hits[k] ? resident_recs[k].t : infinity, false);
+                owner.shadow = false;
+                owner.path = path;
+                owner.resident_hit = resident_hits[k] != 0;
+                if (owner.resident_hit) owner.resident = resident_recs[k];
+            }
+        };
+
+        // the camera rays of all the samples of every tile, pixel after pixel, then the tiles one after the other
+        tile_paths.assign(group_end - group, std::vector<OutOfCorePath>());
+        parallel_for(group_end - group, [&](int k) {
+            int tile = group + k;
+            int row0 = (tile / tiles_x) * tile_size;
+            int col0 = (tile % tiles_x) * tile_size;
+            int row1 = std::min(row0 + tile_size, height);
+            int col1 = std::min(col0 + tile_size, width);
+            std::unique_ptr<Sampler> sampler = make_sampler(settings.sampler, count);
+            ScopedRandomSource source(sampler.get());
+            std::vector<OutOfCorePath>& out = tile_paths[k];
+            out.reserve((row1 - row0) * (col1 - col0) * count);
+            for (int row = row0; row < row1; row++) {
+                for (int col = col0; col < col1; col++) {
+                    int i = width - 1 - col;
+                    int j = height - 1 - row;
+                    for (int s = 0; s < count; s++) {
+                        sampler->start_sample(i, j, s);
+                        auto u = (i + random_double()) / (width - 1);
+                        auto v = (j + random_double()) / (height - 1);
+                        Ray r = cam.get_ray(u, v, footprint / (width - 1), footprint / (height - 1));
+                        out.push_back(OutOfCorePath{row * width + col, i, j, s, sampler->current_dimension(),
+                                                    settings.max_depth, r, Color(1, 1, 1)});
+                        STAT_INC(stat_primary_rays);
+                    }
+                }
+            }
+        }, num_threads);
+        paths.clear();
+        for (const std::vector<OutOfCorePath>& out : tile_paths) paths.insert(paths.end(), out.begin(), out.end());
+        tile_paths.clear();
+        start_paths(paths);
+
+        scheduler.run([&](const std::vector<int>& finished) {
+            const int n = static_cast<int>(finished.size());
+            const int num_blocks = (n + block_size - 1) / block_size;
+            blocks.assign(num_blocks, OutOfCoreShading());
+            if (static_cast<int>(samplers.size()) < num_blocks) samplers.resize(num_blocks);
+            parallel_for_blocks(n, [&](int begin, int end) {
+                OutOfCoreShading& out = blocks[begin / block_size];
+                std::unique_ptr<Sampler>& sampler = samplers[begin / block_size];
+                if (!sampler) sampler = make_sampler(settings.sampler, count);
+                ScopedRandomSource source(sampler.get());
+                DeferredShading deferred;
+                for (int k = begin; k < end; k++) {
+                    int slot = finished[k];
+                    const OutOfCoreRay& owner = owners[slot];
+                    const OutOfCorePath& path = owner.path;
+                    if (owner.shadow) {
+                        if (scheduler.hit(slot)) STAT_INC(stat_shadow_occluded);
+                        else out.colors.push_back(std::make_pair(path.pixel, owner.color));
+                        continue;
+                    }
+                    const HitRecord* rec = scheduler.hit(slot) ? &scheduler.record(slot) : (owner.resident_hit ? &owner.resident : nullptr);
+                    if (!rec) {
+                        out.colors.push_back(std::make_pair(path.pixel, Color(path.throughput.cwiseProduct(shader.shade(path.ray, nullptr, path.depth)))));
+                        continue;
+                    }
+
+                    sampler->resume_sample(path.i, path.j, path.sample, path.dimension);
+                    shader.shade_deferred(path.ray, *rec, path.depth, deferred);
+                    out.colors.push_back(std::make_pair(path.pixel, Color(path.throughput.cwiseProduct(deferred.color))));
+                    for (const DeferredRay& shadow : deferred.shadows) {
+                        out.shadows.push_back(DeferredRay{shadow.ray, shadow.t_max, path.throughput.cwiseProduct(shadow.color)});
+                        out.shadow_pixels.push_back(path.pixel);
+                    }
+                    if (deferred.next) {
+                        out.next_paths.push_back(OutOfCorePath{path.pixel, path.i, path.j, path.sample, sampler->current_dimension(),
+                                                               path.depth - 1, deferred.next_ray, path.throughput.cwiseProduct(deferred.weight)});
+                    }
+                }
+            }, num_threads, block_size);
+
+            // the shadow rays already got past the resident objects => what is left is the scene
+            paths.clear();
+            for (const OutOfCoreShading& out : blocks) {
+                for (const std::pair<int, Color>& c : out.colors) pixels[c.first] += c.second;
+                for (size_t k = 0; k < out.shadows.size(); k++) {
+                    OutOfCoreRay& owner = add_ray(out.shadows[k].ray, out.shadows[k].t_max, true);
+                    owner.shadow = true;
+                    owner.path.pixel = out.shadow_pixels[k];
+                    owner.color = out.shadows[k].color;
+                }
+                paths.insert(paths.end(), out.next_paths.begin(), out.next_paths.end());
+            }
+            blocks.clear();
+            start_paths(paths);
+        });
+
+        if (settings.show_progress) std::cerr << "\rTiles remaining: " << num_tiles - group_end << "    " << std::flush;
+    }
+
+    for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) frame(row, col) = pixels[row * width + col] / count;
+    }
+    if (settings.show_progress) std::cerr << "\n";
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include "Trace.h"
+#include <vector>
+
+/*
+Tiny helpers to run work on all the cores with std::thread
+
+parallel_for(count, fn) calls fn(0), ..., fn(count-1) from a few threads.
+The threads grab the next index from an atomic counter so that a slow item (a tile full of glass)
+does not hold back the others => this is the load balancing of the tile renderer.
+
+The calling thread works as well so parallel_for(..., 1) runs everything on the calling thread.
+
+parallel_for_blocks(count, fn) does the same with blocks of indices for loops where each item is tiny.
+*/
+
+// 0 means use all the cores
+inline int num_worker_threads(int requested = 0) {
+    if (requested > 0) return requested;
+    int hardware = static_cast<int>(std::thread::hardware_concurrency());
+    return hardware > 0 ? hardware : 1;
+}
+
+inline void parallel_for(int count, const std::function<void(int)>& fn, int num_threads = 0) {
+    if (count <= 0) return;
+    num_threads = std::min(num_worker_threads(num_threads), count);
+
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < num_threads; t++) {
+        threads.push_back(std::thread([&worker, t]() {
+            set_trace_worker_slot(t); // => the same trace row for the worker t of every call
+            worker();
+        }));
+    }
+    worker();
+    TRACE_SCOPE("wait"); // the calling thread is out of items, the others are still on theirs
+    for (auto& thread : threads) thread.join();
+}
+
+// same as parallel_for but hands out contiguous blocks of items => fn(begin, end)
+// for loops over millions of small items where one call per item would cost more than the item itself
+inline void parallel_for_blocks(int count, const std::function<void(int, int)>& fn, int num_threads = 0, int block_size = 4096) {
+    if (count <= 0) return;
+    int num_blocks = (count + block_size - 1) / block_size;
+    parallel_for(num_blocks, [&](int block) {
+        int begin = block * block_size;
+        fn(begin, std::min(begin + block_size, count));
+    }, num_threads);
+}
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "Hittable.h"
+#include "Material.h"
+#include "LightSources.h"
+#include "Parallel.h"
+#include "Trace.h"
+#include "utility.h"
+
+/*
+Caustics with a photon map (Jensen)
+
+The light focused by the glass sphere onto the floor is only found by the shader if a matte scatter ray
+goes through the glass AND lands on a light after it => almost never, the caustic stays noise forever.
+This pass goes the other way round before the render:
+    photons leave the lights (a random point of a light, a cosine weighted direction around its normal)
+    they go through the Dielectric objects (refract or reflect exactly like the camera rays do)
+    the ones that went through glass at least once are stored where they land on a diffuse surface
+Shading a matte point then adds the density of the photons around it (photons per area => irradiance).
+
+Units are the ones of Shader::sample_light(): light i adds (1 / solid_angle_i) * integral of kd * n.l over what is seen of it.
+The glass only changes where the light comes from, so the caustic of light i at p is kd * E_i(p) / solid_angle_i(p)
+where E_i is the irradiance of its photons with the light radiance set to 1 (the direct light ignores the light color too).
+A light of area A sends pi * A in total => lights get photons in proportion to their area and all photons carry the same power.
+
+The photons are stored in a grid of cells of twice the lookup radius, sorted by cell => a lookup reads at most 8 short
+contiguous runs of photons. Photons are traced on all the cores, the map is read-only afterwards.
+*/
+
+struct PhotonMapSettings {
+    int num_photons = 1 << 20; // shot from the lights, most of them miss the glass and are not stored
+    Real radius = 5;           // of the density estimate, in scene units
+    int max_bounces = 8;       // inside the glass
+    int num_threads = 0;       // 0 => all the cores
+};
+
+class CausticMap {
+    public:
+        CausticMap(const LightSources& _lights, const PhotonMapSettings& _settings = PhotonMapSettings())
+            : lights(_lights), settings(_settings), cell_size(2 * _settings.radius) {}
+
+        // shoots the photons through world (which has the lights in it as well) and builds the grid
+        void build(const Hittable& world) {
+            TRACE_SCOPE("photon pass");
+            photons.clear();
+            std::vector<Real> cumulative_area;
+            Real total_area = 0;
+            for (int i = 0; i < lights.size(); i++) {
+                Point3 point;
+                Vec3 normal;
+                total_area += lights.light(i).random_emission_point(point, normal);
+                cumulative_area.push_back(total_area);
+            }
+            if (total_area <= 0 || settings.num_photons <= 0) return;
+            photon_power = pi * total_area / settings.num_photons;
+
+            const int block_size = 16384;
+            int num_blocks = (settings.num_photons + block_size - 1) / block_size;
+            std::vector<std::vector<Photon>> stored(num_blocks);
+            parallel_for(num_blocks, [&](int block) {
+                int count = std::min(block_size, settings.num_photons - block * block_size);
+                for (int n = 0; n < count; n++) {
+                    int i = std::upper_bound(cumulative_area.begin(), cumulative_area.end(), random_double() * total_area)
+                          - cumulative_area.begin();
+                    trace_photon(world, std::min(i, lights.size() - 1), stored[block]);
+                }
+            }, settings.num_threads);
+
+            for (const auto& block : stored) photons.insert(photons.end(), block.begin(), block.end());
+            build_grid();
+        }
+
+        size_t size() const { return photons.size(); }
+
+        // what the caustics add to the direct light at p (normal n) once multiplied by kd, in the units of sample_light()
+        Color irradiance(const Point3& p, const Vec3& n) const {
+            if (photons.empty()) return Color(0, 0, 0);
+
+            // the sphere of radius r touches at most 2 cells along each axis
+            Real r = settings.radius;
+            CellKey lo = cell_of(p - Vec3(r, r, r)), hi = cell_of(p + Vec3(r, r, r));
+            Real sum = 0;
+            uint32_t visited[8];
+            int num_visited = 0;
+            for (int32_t x = lo.x; x <= hi.x; x++) {
+                for (int32_t y = lo.y; y <= hi.y; y++) {
+                    for (int32_t z = lo.z; z <= hi.z; z++) {
+                        uint32_t bucket = bucket_of(CellKey{x, y, z});
+                        // two cells can share a bucket => read it once
+                        if (std::find(visited, visited + num_visited, bucket) != visited + num_visited) continue;
+                        visited[num_visited++] = bucket;
+
+                        for (uint32_t k = bucket_start[bucket]; k < bucket_start[bucket + 1]; k++) {
+                            const Photon& photon = photons[k];
+                            if ((photon.position - p).squaredNorm() > r * r) continue;
+                            if (photon.direction.dot(n) >= 0) continue; // arrived on the other side of the surface
+                            Real omega = lights.light(photon.light).solid_angle(p);
+                            if (omega > 0) sum += 1 / omega;
+                        }
+                    }
+                }
+            }
+            Real e = sum * photon_power / (pi * r * r);
+            return Color(e, e, e);
+        }
+
+    private:
+        struct Photon {
+            Point3 position;
+            Vec3 direction; // of travel when it landed
+            int light;      // all photons carry the same power and the Dielectric is white => nothing else to store
+        };
+
+        struct CellKey {
+            int32_t x, y, z;
+        };
+
+        void trace_photon(const Hittable& world, int light_index, std::vector<Photon>& out) const {
+            Point3 origin;
+            Vec3 normal;
+            if (lights.light(light_index).random_emission_point(origin, normal) <= 0) return;
+            // cosine weighted around the normal => cos(theta) = sqrt(1 - u)
+            Ray ray(origin, direction_around(normal, std::sqrt(1 - random_double()), 2 * pi * random_double()));
+
+            bool through_glass = false;
+            for (int bounce = 0; bounce <= settings.max_bounces; bounce++) {
+                HitRecord rec;
+                if (!world.hit(ray, epsilon, infinity, rec)) return;
+                if (rec.mat_ptr->type() == glassy) {
+                    // the Dielectric picks reflection or refraction with the Fresnel odds => the power does not change
+                    ScatterRec srec = rec.mat_ptr->scatter(ray, rec);
+                    ray = srec.ray_to_trace;
+                    through_glass = true;
+                    continue;
+                }
+                if (through_glass && rec.mat_ptr->diffuse()) {
+                    Vec3 direction = ray.direction();
+                    direction.normalize();
+                    out.push_back(Photon{rec.p, direction, light_index});
+                }
+                return;
+            }
+        }
+
+        // counting sort of the photons by bucket => bucket b is photons[bucket_start[b] .. bucket_start[b + 1])
+        void build_grid() {
+            uint32_t num_buckets = 1;
+            while (num_buckets < photons.size()) num_buckets <<= 1;
+            bucket_mask = num_buckets - 1;
+
+            std::vector<uint32_t> buckets(photons.size());
+            bucket_start.assign(num_buckets + 1, 0);
+            for (size_t k = 0; k < photons.size(); k++) {
+                buckets[k] = bucket_of(cell_of(photons[k].position));
+                bucket_start[buckets[k] + 1]++;
+            }
+            for (uint32_t b = 0; b < num_buckets; b++) bucket_start[b + 1] += bucket_start[b];
+
+            std::vector<uint32_t> next(bucket_start.begin(), bucket_start.end() - 1);
+            std::vector<Photon> sorted(photons.size());
+            for (size_t k = 0; k < photons.size(); k++) sorted[next[buckets[k]]++] = photons[k];
+            photons.swap(sorted);
+        }
+
+        CellKey cell_of(const Point3& p) const {
+            return CellKey{
+                static_cast<int32_t>(std::floor(p.x() / cell_size)),
+                static_cast<int32_t>(std::floor(p.y() / cell_size)),
+                static_cast<int32_t>(std::floor(p.z() / cell_size))
+            };
+        }
+
+        uint32_t bucket_of(const CellKey& key) const {
+            uint32_t h = static_cast<uint32_t>(key.x) * 73856093u
+                       ^ static_cast<uint32_t>(key.y) * 19349663u
+                       ^ static_cast<uint32_t>(key.z) * 83492791u;
+            return h & bucket_mask;
+        }
+
+        const LightSources& lights;
+        PhotonMapSettings settings;
+        Real cell_size;
+        Real photon_power = 0;
+        std::vector<Photon> photons;
+        std::vector<uint32_t> bucket_start;
+        uint32_t bucket_mask = 0;
+};
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "utility.h"
+#include "Batch.h"
+#include "Image.h"
+#include "Renderer.h"
+#include "Shader.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+/*
+Interactive preview => move the camera around and see the image refine, instead of waiting for the whole frame
+
+The render runs on a background thread in passes:
+    coarse passes => one sample for each block of 16x16, then 8x8, 4x4, 2x2 pixels, painted over the whole block
+                     with a short max_depth => something is on screen a few milliseconds after a move
+    refine passes => one jittered sample per pixel at full depth, added to the previous ones => the noise goes down
+                     pass after pass until max_samples, then the thread sleeps
+The window shows whatever is in the frame every few milliseconds (the tiles are copied into it under a lock).
+
+Every move bumps a generation counter, the render threads check it at every row of a tile
+=> the work in flight for the old camera is dropped right away and the passes start again from the coarse one.
+
+Keys (in the window):
+    w s   forward / back       a d   left / right       r f   up / down
+    j l   turn left / right    i k   look up / down     + -   zoom in / out
+    Esc   quit
+Dragging with the left mouse button turns the camera as well.
+*/
+
+struct PreviewSettings {
+    int first_block = 16;   // size of the blocks of the first coarse pass, halved at every pass
+    int coarse_depth = 2;   // max_depth of the coarse passes => direct light and one bounce
+    int max_samples = 1024; // refine passes before the thread stops working on a view
+    Real move_step = 20;    // scene units per key press
+    Real turn_step = 5;     // degrees per key press
+    Real mouse_turn = 0.3;  // degrees per pixel dragged
+};
+
+class InteractivePreview {
+    public:
+        // view.settings gives the image size, max_depth and the threads
+        InteractivePreview(const Shader& _shader, const FrameSpec& _view, const PreviewSettings& _settings = PreviewSettings())
+            : shader(_shader), view(_view), settings(_settings),
+              width(_view.settings.image_width), height(_view.settings.image_height),
+              frame(width, height), sum(width, height), image(width, height) {}
+
+        // opens the window and returns when it is closed with Esc
+        void run() {
+            std::thread worker(&InteractivePreview::refine_loop, this);
+            cv::namedWindow(window_name);
+            cv::setMouseCallback(window_name, &InteractivePreview::on_mouse, this);
+
+            bool quit = false;
+            while (!quit) {
+                if (dirty.exchange(false)) {
+                    std::lock_guard<std::mutex> lock(frame_mutex);
+                    to_image(frame, image);
+                }
+                cv::imshow(window_name, image.image);
+                int key = cv::waitKey(15);
+                if (key >= 0) quit = !handle_key(key & 0xff);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(view_mutex);
+                stopping = true;
+                generation++;
+            }
+            wake.notify_all();
+            worker.join();
+            cv::destroyWindow(window_name);
+        }
+
+    private:
+        // background thread => renders the passes of the current view, starts over when the view changes
+        void refine_loop() {
+            while (true) {
+                FrameSpec current;
+                unsigned current_generation;
+                {
+                    std::lock_guard<std::mutex> lock(view_mutex);
+                    if (stopping) return;
+                    current = view;
+                    current_generation = generation;
+                }
+                Camera camera = current.camera();
+                auto start = std::chrono::steady_clock::now();
+
+                bool completed = true;
+                for (int block = settings.first_block; block > 1 && completed; block /= 2) {
+                    completed = render_pass(camera, current, block, current_generation);
+                }
+                for (int pass = 1; pass <= settings.max_samples && completed; pass++) {
+                    completed = render_pass(camera, current, 1, current_generation, pass);
+                    if (completed && pass == 1) {
+                        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+                        std::cerr << "\rfirst full pass in " << seconds.count() << "s    " << std::flush;
+                    }
+                }
+
+                // done (or cancelled) => wait for the next move
+                std::unique_lock<std::mutex> lock(view_mutex);
+                wake.wait(lock, [&]() { return stopping || generation != current_generation; });
+            }
+        }
+
+        // block > 1 => one sample per block painted over it, block == 1 => sample number 'pass' of every pixel
+        // false if the view changed in the middle => the frame keeps what was done so far
+        bool render_pass(const Camera& camera, const FrameSpec& spec, int block, unsigned pass_generation, int pass = 0) {
+            const int tile_size = std::max(spec.settings.tile_size, block);
+            const int tiles_x = (width + tile_size - 1) / tile_size;
+            const int tiles_y = (height + tile_size - 1) / tile_size;
+            const int depth = block > 1 ? std::min(settings.coarse_depth, spec.settings.max_depth) : spec.settings.max_depth;
+            std::atomic<bool> cancelled(false);
+
+            parallel_for(tiles_x * tiles_y, [&](int tile) {
+                int row0 = (tile / tiles_x) * tile_size;
+                int col0 = (tile % tiles_x) * tile_size;
+                int row1 = std::min(row0 + tile_size, height);
+                int col1 = std::min(col0 + tile_size, width);
+                std::vector<Color> colors;
+                colors.reserve((row1 - row0) * (col1 - col0) / (block * block) + 1);
+
+                for (int row = row0; row < row1; row += block) {
+                    if (cancelled || generation != pass_generation) {
+                        cancelled = true;
+                        return;
+                    }
+                    for (int col = col0; col < col1; col += block) {
+                        // random point of the block (of the pixel when block == 1), same (u, v) as render_pixel()
+                        // => the image is flipped on both axes compared to the camera
+                        double x = col + std::min(block, col1 - col) * random_double();
+                        double y = row + std::min(block, row1 - row) * random_double();
+                        auto u = (width - x) / (width - 1);
+                        auto v = (height - y) / (height - 1);
+                        colors.push_back(shader.trace(camera.get_ray(u, v, double(block) / (width - 1), double(block) / (height - 1)), depth));
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(frame_mutex);
+                size_t k = 0;
+                for (int row = row0; row < row1; row += block) {
+                    for (int col = col0; col < col1; col += block) {
+                        const Color& c = colors[k++];
+                        if (block == 1) {
+                            sum(row, col) = pass == 1 ? c : Color(sum(row, col) + c);
+                            frame(row, col) = sum(row, col) / pass;
+                            continue;
+                        }
+                        for (int r = row; r < std::min(row + block, row1); r++) {
+                            for (int q = col; q < std::min(col + block, col1); q++) frame(r, q) = c;
+                        }
+                    }
+                }
+                dirty = true;
+            }, spec.settings.num_threads);
+
+            return !cancelled && generation == pass_generation;
+        }
+
+        // false => quit
+        bool handle_key(int key) {
+            if (key == 27) return false;
+            std::lock_guard<std::mutex> lock(view_mutex);
+            Vec3 forward = (view.lookat - view.lookfrom).normalized();
+            Vec3 right = forward.cross(view.vup).normalized();
+            Vec3 up = view.vup.normalized();
+            Real step = settings.move_step;
+            switch (key) {
+                case 'w': move(forward * step); break;
+                case 's': move(-forward * step); break;
+                case 'd': move(right * step); break;
+                case 'a': move(-right * step); break;
+                case 'r': move(up * step); break;
+                case 'f': move(-up * step); break;
+                case 'j': turn(settings.turn_step, 0); break;
+                case 'l': turn(-settings.turn_step, 0); break;
+                case 'i': turn(0, settings.turn_step); break;
+                case 'k': turn(0, -settings.turn_step); break;
+                case '+': case '=': view.field_of_view = std::max(5.0, view.field_of_view - 5); break;
+                case '-': view.field_of_view = std::min(150.0, view.field_of_view + 5); break;
+                default: return true; // not a camera key => no restart
+            }
+            restart();
+            return true;
+        }
+
+        static void on_mouse(int event, int x, int y, int flags, void* data) {
+            InteractivePreview* self = static_cast<InteractivePreview*>(data);
+            if (event == cv::EVENT_LBUTTONDOWN) {
+                self->drag_x = x;
+                self->drag_y = y;
+            } else if (event == cv::EVENT_MOUSEMOVE && (flags & cv::EVENT_FLAG_LBUTTON)) {
+                std::lock_guard<std::mutex> lock(self->view_mutex);
+                self->turn(-(x - self->drag_x) * self->settings.mouse_turn, -(y - self->drag_y) * self->settings.mouse_turn);
+                self->drag_x = x;
+                self->drag_y = y;
+                self->restart();
+            }
+        }
+
+        // called with view_mutex held
+        void move(const Vec3& offset) {
+            view.lookfrom += offset;
+            view.lookat += offset;
+        }
+
+        // yaw around vup, pitch around the right axis, in degrees, called with view_mutex held
+        void turn(Real yaw, Real pitch) {
+            Vec3 forward = view.lookat - view.lookfrom;
+            Vec3 up = view.vup.normalized();
+            forward = rotate(forward, up, degrees_to_radians(yaw));
+            Vec3 right = forward.cross(up).normalized();
+            Vec3 pitched = rotate(forward, right, degrees_to_radians(pitch));
+            if (std::fabs(pitched.normalized().dot(up)) < 0.99) forward = pitched; // never look straight up or down
+            view.lookat = view.lookfrom + forward;
+        }
+
+        // Rodrigues => v turned by angle around the unit vector axis
+        static Vec3 rotate(const Vec3& v, const Vec3& axis, Real angle) {
+            Real c = std::cos(angle), s = std::sin(angle);
+            return v * c + axis.cross(v) * s + axis * axis.dot(v) * (1 - c);
+        }
+
+        // called with view_mutex held
+        void restart() {
+            generation++;
+            wake.notify_all();
+        }
+
+        const char* const window_name = "preview";
+        const Shader& shader;
+        FrameSpec view;
+        PreviewSettings settings;
+        const int width, height;
+
+        std::mutex view_mutex;
+        std::condition_variable wake;
+        std::atomic<unsigned> generation{0};
+        bool stopping = false;
+
+        std::mutex frame_mutex;
+        Framebuffer frame; // what the window shows
+        Framebuffer sum;   // of the refine passes
+        std::atomic<bool> dirty{false};
+        Image image;
+
+        int drag_x = 0, drag_y = 0;
+};
+
+#endif
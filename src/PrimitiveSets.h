@@ -0,0 +1,504 @@
+#ifndef PRIMITIVE_SETS_H
+#define PRIMITIVE_SETS_H
+
+#include "utility.h"
+#include "Hittable.h"
+#include "Sphere.h"
+#include "aarect.h"
+#include "aabb.h"
+#include "Ray.h"
+#include "Simd.h"
+#include "Stats.h"
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+/*
+Sets of many spheres or many axis aligned rects that are ONE Hittable => particles, big tiled floors, ...
+
+Putting 100k Sphere objects in the BVH means one virtual hit() and one HitRecord per candidate sphere.
+A set stores its primitives as structure of arrays (all the x of the centers, then all the y, ...)
+and has its own small BVH whose leaves hold up to 8 primitives.
+A leaf is tested with the 4-wide vfloat4 of Simd.h => 2 packets of 4 primitives, no virtual call, no HitRecord.
+
+closest(r, t_min, t_max, t) only gives back the index of the closest primitive (the index from add()) and its t,
+the HitRecord is filled once for that primitive at the end (normal, uv, material) => deferred shading.
+
+    SphereSet particles;
+    for (...) particles.add(center, radius, material);
+    particles.build(); // once, after the last add()
+    objects.add(make_shared<SphereSet>(std::move(particles)));
+
+The packets run in float => they only select the candidates, which are then hit with the test of Sphere::hit
+or of the aarects (sphere_root, rect_root) so that a set gives the same hits as a list of the same objects
+and secondary rays start from the same point.
+*/
+
+// BVH over the boxes of the primitives of a set, leaves are runs of slots in the SoA arrays
+// every leaf starts on a multiple of 4 and is padded to a multiple of 4 => a packet never mixes two leaves
+class SetBVH {
+    public:
+        static const int leaf_size = 8;
+
+        struct Node {
+            aabb box;
+            int first; // leaf => first slot, internal => index of the right child (the left one is the next node)
+            int count; // number of slots of a leaf, 0 for an internal node
+            int axis;  // split axis of an internal node => the child on the side the ray comes from is visited first
+        };
+
+        // fills slots with the primitive in every slot, -1 for padding
+        void build(const std::vector<aabb>& boxes, std::vector<int>& slots) {
+            nodes.clear();
+            slots.clear();
+            height = 0;
+            std::vector<int> items(boxes.size());
+            for (size_t i = 0; i < items.size(); i++) items[i] = static_cast<int>(i);
+            if (!items.empty()) build_node(boxes, items, 0, static_cast<int>(items.size()), slots, 0);
+        }
+
+        bool empty() const { return nodes.empty(); }
+        const aabb& bounds() const { return nodes[0].box; }
+
+        // height of nodes that were read back instead of built (chunks of OutOfCore.h)
+        // both children of a node come after it => one pass in order
+        void measure_height() {
+            height = 0;
+            std::vector<int> depth(nodes.size(), 0);
+            for (size_t i = 0; i < nodes.size(); i++) {
+                if (nodes[i].count > 0) height = std::max(height, depth[i]);
+                else depth[i + 1] = depth[nodes[i].first] = depth[i] + 1;
+            }
+        }
+
+        // calls test_leaf(first_slot, num_slots, t_max) for every leaf the ray reaches, in near to far order
+        // test_leaf returns true if it found a closer hit (and lowered t_max)
+        template <class LeafTest>
+        bool traverse(const Ray& r, Real t_min, Real& t_max, const LeafTest& test_leaf) const {
+            if (nodes.empty()) return false;
+            // a leaf k levels down leaves at most k siblings on the stack => height + 1 entries
+            // the median split keeps the tree balanced (32 levels for 2^32 leaves) but nothing is assumed
+            int local_stack[64];
+            std::vector<int> deep_stack;
+            int* stack = local_stack;
+            if (height >= 64) {
+                deep_stack.resize(height + 1);
+                stack = deep_stack.data();
+            }
+            int stack_size = 0;
+            stack[stack_size++] = 0;
+            bool hit_anything = false;
+
+            while (stack_size > 0) {
+                const int index = stack[--stack_size];
+                const Node& node = nodes[index];
+                STAT_INC(stat_bvh_nodes);
+                if (!node.box.hit(r, t_min, t_max)) continue;
+
+                if (node.count > 0) {
+                    if (test_leaf(node.first, node.count, t_max)) hit_anything = true;
+                    continue;
+                }
+
+                // left holds the lower half along axis
+                if (r.direction()[node.axis] >= 0) {
+                    stack[stack_size++] = node.first;
+                    stack[stack_size++] = index + 1;
+                } else {
+                    stack[stack_size++] = index + 1;
+                    stack[stack_size++] = node.first;
+                }
+            }
+            return hit_anything;
+        }
+
+    private:
+        // depth => internal nodes above this one
+        int build_node(const std::vector<aabb>& boxes, std::vector<int>& items, int begin, int end, std::vector<int>& slots, int depth) {
+            int index = static_cast<int>(nodes.size());
+            nodes.push_back(Node{aabb(Point3(0, 0, 0), Point3(0, 0, 0)), 0, 0, 0});
+
+            aabb box = boxes[items[begin]];
+            aabb centers(center(box), center(box));
+            for (int i = begin + 1; i < end; i++) {
+                box = surrounding_box(box, boxes[items[i]]);
+                centers = surrounding_box(centers, aabb(center(boxes[items[i]]), center(boxes[items[i]])));
+            }
+            nodes[index].box = box;
+
+            if (end - begin <= leaf_size) {
+                nodes[index].first = static_cast<int>(slots.size());
+                for (int i = begin; i < end; i++) slots.push_back(items[i]);
+                while (slots.size() % 4 != 0) slots.push_back(-1);
+                nodes[index].count = static_cast<int>(slots.size()) - nodes[index].first;
+                nodes[index].axis = 0;
+                height = std::max(height, depth);
+                return index;
+            }
+
+            // median split along the widest axis of the centers
+            Vec3 extent = centers.max() - centers.min();
+            int axis = extent.x() >= extent.y() && extent.x() >= extent.z() ? 0 : (extent.y() >= extent.z() ? 1 : 2);
+            int mid = begin + (end - begin) / 2;
+            std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, [&](int a, int b) {
+                return center(boxes[a])[axis] < center(boxes[b])[axis];
+            });
+
+            build_node(boxes, items, begin, mid, slots, depth + 1);
+            int right = build_node(boxes, items, mid, end, slots, depth + 1);
+            nodes[index].first = right;
+            nodes[index].count = 0;
+            nodes[index].axis = axis;
+            return index;
+        }
+
+        static Point3 center(const aabb& box) { return 0.5 * (box.min() + box.max()); }
+
+    public:
+        std::vector<Node> nodes;
+        int height = 0; // internal nodes from the root to the deepest leaf
+};
+
+// keeps one copy of each material of a set, primitives store an index into it
+class MaterialTable {
+    public:
+        int index_of(const shared_ptr<Material>& material) {
+            auto found = indices.find(material.get());
+            if (found != indices.end()) return found->second;
+            int index = static_cast<int>(materials.size());
+            materials.push_back(material);
+            indices[material.get()] = index;
+            return index;
+        }
+
+        const Material* operator[](int index) const { return materials[index].get(); }
+        const shared_ptr<Material>& shared(int index) const { return materials[index]; }
+        int size() const { return static_cast<int>(materials.size()); }
+
+    private:
+        std::vector<shared_ptr<Material>> materials;
+        std::unordered_map<const Material*, int> indices;
+};
+
+class SphereSet : public Hittable {
+    public:
+        SphereSet() {}
+
+        void add(const Point3& center, double radius, shared_ptr<Material> material) {
+            centers.push_back(center);
+            radii.push_back(radius);
+            material_ids.push_back(materials.index_of(material));
+        }
+
+        // (re)builds the BVH and the SoA arrays => call it after the last add()
+        void build() {
+            std::vector<aabb> boxes(centers.size());
+            for (size_t i = 0; i < centers.size(); i++) boxes[i] = sphere_box(static_cast<int>(i));
+            bvh.build(boxes, slots);
+
+            const float nan = std::numeric_limits<float>::quiet_NaN(); // padding never hits, every comparison with NaN is false
+            x.resize(slots.size()); y.resize(slots.size()); z.resize(slots.size()); r2.resize(slots.size());
+            for (size_t s = 0; s < slots.size(); s++) {
+                int i = slots[s];
+                x[s] = i < 0 ? nan : centers[i].x();
+                y[s] = i < 0 ? nan : centers[i].y();
+                z[s] = i < 0 ? nan : centers[i].z();
+                r2[s] = i < 0 ? nan : static_cast<float>(radii[i] * radii[i]);
+            }
+        }
+
+        int size() const { return static_cast<int>(centers.size()); }
+
+        // index of the closest sphere hit in [t_min, t_max] and its t, -1 if none
+        // the packets only pick the candidates, every candidate is then tested again by sphere_root() (the test of Sphere::hit)
+        // => the result is the one of a list of the same Sphere objects, a candidate it misses is dropped and the search goes on
+        int closest(const Ray& r, Real t_min, Real t_max, Real& t) const {
+            const Point3 o = r.origin();
+            const Vec3 d = r.direction();
+            const Real length = d.norm();
+            const Vec3 unit = d / length;
+            const vfloat4 ox(o.x()), oy(o.y()), oz(o.z());
+            const vfloat4 ux(unit.x()), uy(unit.y()), uz(unit.z());
+            const vfloat4 inv_length(static_cast<float>(1 / length));
+            const vfloat4 tmin(static_cast<float>(t_min));
+            const vfloat4 zero(0.0f), slack(1e-4f), margin(1e-5f);
+            int best = -1;
+
+            bvh.traverse(r, t_min, t_max, [&](int first, int count, Real& t_far) {
+                bool found = false;
+                for (int s = first; s < first + count; s += 4) {
+                    STAT_ADD(stat_sphere_tests, 4);
+                    vfloat4 ocx = ox - vfloat4::load(&x[s]);
+                    vfloat4 ocy = oy - vfloat4::load(&y[s]);
+                    vfloat4 ocz = oz - vfloat4::load(&z[s]);
+                    // r^2 - |oc - (oc.u)u|^2 with u the unit direction => no cancellation of half_b^2 - a c for far grazing rays
+                    vfloat4 half_b = ocx * ux + ocy * uy + ocz * uz;
+                    vfloat4 px = ocx - half_b * ux, py = ocy - half_b * uy, pz = ocz - half_b * uz;
+                    vfloat4 oc2 = ocx * ocx + ocy * ocy + ocz * ocz;
+                    vfloat4 discriminant = vfloat4::load(&r2[s]) - (px * px + py * py + pz * pz);
+                    // the float test must not lose a sphere that sphere_root() hits => a margin on the discriminant and the roots
+                    vfloat4 error = margin * oc2;
+                    vmask4 hit = discriminant >= zero - error;
+                    if (!bits(hit)) continue;
+
+                    vfloat4 sqrtd = vsqrt(vmax(discriminant, zero) + error);
+                    vfloat4 tolerance = slack * (vmax(half_b, zero - half_b) + sqrtd);
+                    vfloat4 near_root = (zero - half_b - sqrtd - tolerance) * inv_length;
+                    vfloat4 far_root = (sqrtd - half_b + tolerance) * inv_length;
+                    hit = hit & (far_root >= tmin) & (near_root <= vfloat4(static_cast<float>(t_far)));
+
+                    int lanes = bits(hit);
+                    for (int lane = 0; lane < 4; lane++) {
+                        if (!(lanes & (1 << lane))) continue;
+                        int i = slots[s + lane];
+                        Real root;
+                        if (sphere_root(centers[i], radii[i], r, t_min, t_far, root)) {
+                            t_far = root;
+                            best = i;
+                            found = true;
+                        }
+                    }
+                }
+                return found;
+            });
+
+            t = t_max;
+            return best;
+        }
+
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            Real t;
+            int i = closest(r, t_min, t_max, t);
+            if (i < 0) return false;
+
+            rec.t = t;
+            rec.p = r.at(t);
+            Vec3 outward_normal = (rec.p - centers[i]) / radii[i];
+            rec.set_face_normal(r, outward_normal);
+            rec.mat_ptr = materials[material_ids[i]];
+            rec.object = this;
+            rec.u = (atan2(-outward_normal.z(), outward_normal.x()) + pi) / (2 * pi);
+            rec.v = acos(std::max(Real(-1), std::min(Real(1), -outward_normal.y()))) / pi;
+            sphere_derivatives(outward_normal, radii[i], rec.dpdu, rec.dpdv);
+            rec.curvature = 1 / radii[i];
+            return true;
+        }
+
+        virtual bool bounding_box(aabb& output_box) const override {
+            if (bvh.empty()) return false;
+            output_box = bvh.bounds();
+            return true;
+        }
+
+        virtual std::string name() const override {
+            return "sphere set";
+        }
+
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            for (int i = 0; i < size(); i++) out.add_sphere(to_world * centers[i], radii[i], owner ? owner : this);
+            return true;
+        }
+
+        virtual Vec3 random_surface_point() const override {
+            int i = random_int(0, size() - 1);
+            return centers[i] + radii[i] * random_unit_vector();
+        }
+
+    private:
+        aabb sphere_box(int i) const {
+            Vec3 r(radii[i], radii[i], radii[i]);
+            return aabb(centers[i] - r, centers[i] + r);
+        }
+
+    public:
+        // one entry per sphere in the order of add()
+        std::vector<Point3> centers;
+        std::vector<double> radii;
+        std::vector<int> material_ids;
+        MaterialTable materials;
+
+        // SoA copy in BVH leaf order, padded with NaN
+        std::vector<float> x, y, z, r2;
+        std::vector<int> slots;
+        SetBVH bvh;
+};
+
+// axis aligned rects of the 3 orientations, same conventions as xy_rect, xz_rect and yz_rect
+// axis is the axis of the normal (0 => yz_rect, 1 => xz_rect, 2 => xy_rect) and (a, b) the two other coordinates in order
+class RectSet : public Hittable {
+    public:
+        struct Rect {
+            int axis;
+            double k, a0, a1, b0, b1;
+            int material_id;
+        };
+
+        RectSet() {}
+
+        void add_xy(double x0, double x1, double y0, double y1, double k, shared_ptr<Material> mat) { add(2, x0, x1, y0, y1, k, mat); }
+        void add_xz(double x0, double x1, double z0, double z1, double k, shared_ptr<Material> mat) { add(1, x0, x1, z0, z1, k, mat); }
+        void add_yz(double y0, double y1, double z0, double z1, double k, shared_ptr<Material> mat) { add(0, y0, y1, z0, z1, k, mat); }
+
+        void build() {
+            std::vector<aabb> boxes(rects.size());
+            for (size_t i = 0; i < rects.size(); i++) boxes[i] = rect_box(rects[i]);
+            bvh.build(boxes, slots);
+
+            const float nan = std::numeric_limits<float>::quiet_NaN();
+            size_t n = slots.size();
+            axis.resize(n); k.resize(n); a0.resize(n); a1.resize(n); b0.resize(n); b1.resize(n);
+            for (size_t s = 0; s < n; s++) {
+                int i = slots[s];
+                axis[s] = i < 0 ? 0.0f : static_cast<float>(rects[i].axis);
+                k[s] = i < 0 ? nan : rects[i].k;
+                a0[s] = i < 0 ? nan : rects[i].a0;
+                a1[s] = i < 0 ? nan : rects[i].a1;
+                b0[s] = i < 0 ? nan : rects[i].b0;
+                b1[s] = i < 0 ? nan : rects[i].b1;
+            }
+        }
+
+        int size() const { return static_cast<int>(rects.size()); }
+
+        // index of the closest rect hit in [t_min, t_max] and its t, -1 if none
+        // like SphereSet the packets only pick the candidates with a margin, rect_root() (the test of the aarects) decides
+        int closest(const Ray& r, Real t_min, Real t_max, Real& t) const {
+            const Point3 o = r.origin();
+            const Vec3 d = r.direction();
+            const vfloat4 ox(o.x()), oy(o.y()), oz(o.z());
+            const vfloat4 dx(d.x()), dy(d.y()), dz(d.z());
+            const vfloat4 tmin(static_cast<float>(t_min));
+            const vfloat4 zero(0.0f), margin(1e-5f);
+            int best = -1;
+
+            bvh.traverse(r, t_min, t_max, [&](int first, int count, Real& t_far) {
+                bool found = false;
+                for (int s = first; s < first + count; s += 4) {
+                    STAT_ADD(stat_rect_tests, 4);
+                    // pick per lane the coordinates that go with the orientation of the rect
+                    vfloat4 lane_axis = vfloat4::load(&axis[s]);
+                    vmask4 is_x = lane_axis == vfloat4(0.0f);
+                    vmask4 is_z = lane_axis == vfloat4(2.0f);
+                    vfloat4 o_n = select(is_x, ox, select(is_z, oz, oy));
+                    vfloat4 d_n = select(is_x, dx, select(is_z, dz, dy));
+                    vfloat4 o_a = select(is_x, oy, ox), d_a = select(is_x, dy, dx);
+                    vfloat4 o_b = select(is_z, oy, oz), d_b = select(is_z, dy, dz);
+
+                    vfloat4 lane_k = vfloat4::load(&k[s]);
+                    vfloat4 lane_t = (lane_k - o_n) / d_n;
+                    vfloat4 a = o_a + lane_t * d_a;
+                    vfloat4 b = o_b + lane_t * d_b;
+
+                    // rounding of k and o to float and of the divide moves t by about eps (|k| + |o_n|) / |d_n|
+                    // and a, b by that times the slope => widen every test by a margin over these
+                    vfloat4 t_error = margin * (vmax(lane_k, zero - lane_k) + vmax(o_n, zero - o_n)) / vmax(d_n, zero - d_n);
+                    vfloat4 a_error = margin * (vmax(a, zero - a) + vmax(o_a, zero - o_a)) + t_error * vmax(d_a, zero - d_a);
+                    vfloat4 b_error = margin * (vmax(b, zero - b) + vmax(o_b, zero - o_b)) + t_error * vmax(d_b, zero - d_b);
+                    vmask4 hit = (lane_t + t_error >= tmin) & (lane_t - t_error <= vfloat4(static_cast<float>(t_far)))
+                               & (a + a_error >= vfloat4::load(&a0[s])) & (a - a_error <= vfloat4::load(&a1[s]))
+                               & (b + b_error >= vfloat4::load(&b0[s])) & (b - b_error <= vfloat4::load(&b1[s]));
+
+                    int lanes = bits(hit);
+                    for (int lane = 0; lane < 4; lane++) {
+                        if (!(lanes & (1 << lane))) continue;
+                        int i = slots[s + lane];
+                        const Rect& rect = rects[i];
+                        Real root;
+                        if (rect_root(rect.axis, rect.a0, rect.a1, rect.b0, rect.b1, rect.k, r, t_min, t_far, root)) {
+                            t_far = root;
+                            best = i;
+                            found = true;
+                        }
+                    }
+                }
+                return found;
+            });
+
+            t = t_max;
+            return best;
+        }
+
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            Real t;
+            int i = closest(r, t_min, t_max, t);
+            if (i < 0) return false;
+
+            const Rect& rect = rects[i];
+            int a_axis = rect.axis == 0 ? 1 : 0;
+            int b_axis = rect.axis == 2 ? 1 : 2;
+
+            rec.t = t;
+            rec.p = r.at(t);
+            rec.u = (r.origin()[a_axis] + t * r.direction()[a_axis] - rect.a0) / (rect.a1 - rect.a0);
+            rec.v = (r.origin()[b_axis] + t * r.direction()[b_axis] - rect.b0) / (rect.b1 - rect.b0);
+            Vec3 outward_normal(0, 0, 0);
+            outward_normal[rect.axis] = 1;
+            rec.set_face_normal(r, outward_normal);
+            rec.dpdu = Vec3(0, 0, 0);
+            rec.dpdu[a_axis] = rect.a1 - rect.a0;
+            rec.dpdv = Vec3(0, 0, 0);
+            rec.dpdv[b_axis] = rect.b1 - rect.b0;
+            rec.curvature = 0;
+            rec.mat_ptr = materials[rect.material_id];
+            rec.object = this;
+            return true;
+        }
+
+        virtual bool bounding_box(aabb& output_box) const override {
+            if (bvh.empty()) return false;
+            output_box = bvh.bounds();
+            return true;
+        }
+
+        virtual std::string name() const override {
+            return "rect set";
+        }
+
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            for (const Rect& rect : rects) {
+                out.add_rect(to_world, rect.axis, rect.a0, rect.a1, rect.b0, rect.b1, rect.k, owner ? owner : this);
+            }
+            return true;
+        }
+
+        virtual Vec3 random_surface_point() const override {
+            const Rect& rect = rects[random_int(0, size() - 1)];
+            Vec3 p(0, 0, 0);
+            p[rect.axis] = rect.k;
+            p[rect.axis == 0 ? 1 : 0] = random_double(rect.a0, rect.a1);
+            p[rect.axis == 2 ? 1 : 2] = random_double(rect.b0, rect.b1);
+            return p;
+        }
+
+    private:
+        void add(int normal_axis, double _a0, double _a1, double _b0, double _b1, double _k, const shared_ptr<Material>& mat) {
+            rects.push_back(Rect{normal_axis, _k, _a0, _a1, _b0, _b1, materials.index_of(mat)});
+        }
+
+        // padded around k like the aarects, and a little around the edges => the rounding of the box test
+        // (float in the float build) must not cull a ray that rect_root() hits on the edge
+        static aabb rect_box(const Rect& rect) {
+            Point3 lo, hi;
+            lo[rect.axis] = rect.k - epsilon;
+            hi[rect.axis] = rect.k + epsilon;
+            lo[rect.axis == 0 ? 1 : 0] = rect.a0 - edge_padding(rect.a0);
+            hi[rect.axis == 0 ? 1 : 0] = rect.a1 + edge_padding(rect.a1);
+            lo[rect.axis == 2 ? 1 : 2] = rect.b0 - edge_padding(rect.b0);
+            hi[rect.axis == 2 ? 1 : 2] = rect.b1 + edge_padding(rect.b1);
+            return aabb(lo, hi);
+        }
+
+        static double edge_padding(double x) { return epsilon * (1 + std::fabs(x)); }
+
+    public:
+        std::vector<Rect> rects; // in the order of add()
+        MaterialTable materials;
+
+        // SoA copy in BVH leaf order
+        std::vector<float> axis, k, a0, a1, b0, b1;
+        std::vector<int> slots;
+        SetBVH bvh;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef RASTER_PRIMITIVES_H
+#define RASTER_PRIMITIVES_H
+
+#include "Vec3.h"
+#include <vector>
+
+/*
+What the rasterizer of the hybrid renderer draws (see Rasterizer.h)
+
+Every object that can be drawn adds its surfaces in world space with Hittable::rasterize():
+    sphere => center and radius
+    quad   => a corner and the two edges from it (the aarects, the sides of the boxes, turned by the instances)
+The instances pass down the rotation from the frame of their object to the world.
+
+owner is the object the BVH stores (the rotate_y around the box, the box itself, the SphereSet...)
+=> once a sample knows which surface it sees, owner->hit() around that t gives the exact same HitRecord as a traced ray.
+*/
+
+class Hittable;
+
+typedef Eigen::Matrix<Real, 3, 3> Mat3;
+
+struct RasterPrimitive {
+    enum Kind { sphere, quad };
+    Kind kind;
+    Point3 p;        // center of the sphere, corner of the quad
+    Vec3 edge1, edge2; // of the quad
+    Real radius;
+    const Hittable* owner;
+};
+
+class RasterPrimitives {
+    public:
+        void add_sphere(const Point3& center, Real radius, const Hittable* owner) {
+            primitives.push_back(RasterPrimitive{RasterPrimitive::sphere, center, Vec3(0, 0, 0), Vec3(0, 0, 0), radius, owner});
+        }
+
+        void add_quad(const Point3& corner, const Vec3& edge1, const Vec3& edge2, const Hittable* owner) {
+            primitives.push_back(RasterPrimitive{RasterPrimitive::quad, corner, edge1, edge2, 0, owner});
+        }
+
+        // the axis aligned rect of aarect.h: a and b are the two axes other than the normal axis, in order
+        void add_rect(const Mat3& to_world, int normal_axis, Real a0, Real a1, Real b0, Real b1, Real k, const Hittable* owner) {
+            int a_axis = normal_axis == 0 ? 1 : 0;
+            int b_axis = normal_axis == 2 ? 1 : 2;
+            Vec3 corner, edge1(0, 0, 0), edge2(0, 0, 0);
+            corner[normal_axis] = k;
+            corner[a_axis] = a0;
+            corner[b_axis] = b0;
+            edge1[a_axis] = a1 - a0;
+            edge2[b_axis] = b1 - b0;
+            add_quad(to_world * corner, to_world * edge1, to_world * edge2, owner);
+        }
+
+    public:
+        std::vector<RasterPrimitive> primitives;
+};
+
+#endif
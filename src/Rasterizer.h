@@ -0,0 +1,271 @@
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+
+#include "utility.h"
+#include "Camera.h"
+#include "Hittable.h"
+#include "RasterPrimitives.h"
+#include "Renderer.h"
+#include "Parallel.h"
+#include "Sampler.h"
+#include "Shader.h"
+#include "Stats.h"
+#include "Trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+/*
+Hybrid renderer => the camera rays are not traced, what they see first is drawn like a z-buffer would
+
+Every camera ray starts at the same point (pinhole camera) => the closest surface along each sample is
+what a rasterizer computes, without walking the BVH from the root for each of the samples.
+    1. the world hands its spheres and quads in world space (Hittable::rasterize, the rotations are applied)
+    2. each one is projected on the screen (corners of the quad, of the cube around the sphere) => a box of pixels,
+       and is put in the list of every tile its box touches
+    3. per tile and per sample index: the sample positions come from the sampler exactly like in render_pixel(),
+       every primitive of the tile is tested against the samples of its box and the closest t wins
+       (the visibility buffer => primitive and t for one sample of every pixel of the tile)
+    4. the sample is resolved by owner->hit() in a thin interval around the t
+       => the HitRecord (normal, uv, material, derivatives) is the one a traced ray gets
+       then it is shaded from there (Shader::shade), the reflections, refractions and shadows are traced as before
+
+The coverage test is the exact ray/sphere and ray/quad test with everything that only depends on the camera
+done once per primitive (not edge functions) => the silhouettes are the ones of the traced image.
+The sampler is restarted for the shading and skips the 2 dimensions of the position => same numbers as render()
+(the independent sampler gives different noise but the same image on average).
+
+If the world holds something that cannot be drawn, render_hybrid() returns false and the caller traces the frame.
+A sample the owner does not confirm (an edge lost to rounding) is traced like before.
+*/
+
+// a primitive ready for the samples of one camera => the ray origin is always the camera position
+struct RasterSetup {
+    RasterPrimitive::Kind kind;
+    Vec3 oc;        // origin - center of the sphere, origin - corner of the quad
+    Real c;         // sphere => |oc|^2 - radius^2
+    Vec3 normal;    // quad => edge1 x edge2 (not normalized)
+    Vec3 w;         // quad => normal / |normal|^2, gives the position along the edges
+    Vec3 edge1, edge2;
+    Real numerator; // quad => normal . (corner - origin), the t of the plane is numerator / (normal . direction)
+    int col0, col1, row0, row1; // pixels that can see it
+    const Hittable* owner;
+};
+
+// t of the closest hit past epsilon, false if none or not before t_max
+inline bool raster_test(const RasterSetup& prim, const Vec3& d, Real t_max, Real& t) {
+    if (prim.kind == RasterPrimitive::sphere) {
+        Real a = d.squaredNorm();
+        Real half_b = prim.oc.dot(d);
+        Real discriminant = half_b * half_b - a * prim.c;
+        if (discriminant < 0) return false;
+        Real sqrtd = std::sqrt(discriminant);
+        Real root = (-half_b - sqrtd) / a;
+        if (root < epsilon) root = (-half_b + sqrtd) / a;
+        if (root < epsilon || root >= t_max) return false;
+        t = root;
+        return true;
+    }
+
+    Real denominator = prim.normal.dot(d);
+    if (std::abs(denominator) < 1e-12) return false; // edge on
+    Real root = prim.numerator / denominator;
+    if (root < epsilon || root >= t_max) return false;
+    Vec3 q = prim.oc + root * d; // from the corner to the hit point
+    Real alpha = prim.w.dot(q.cross(prim.edge2));
+    Real beta = prim.w.dot(prim.edge1.cross(q));
+    if (alpha < 0 || alpha > 1 || beta < 0 || beta > 1) return false;
+    t = root;
+    return true;
+}
+
+// constants of the primitive for the camera and the pixels it covers
+inline RasterSetup raster_setup(const RasterPrimitive& prim, const Camera& cam, int width, int height) {
+    RasterSetup res;
+    res.kind = prim.kind;
+    res.owner = prim.owner;
+    res.oc = cam.position() - prim.p;
+    res.edge1 = prim.edge1;
+    res.edge2 = prim.edge2;
+    res.c = 0;
+    res.numerator = 0;
+    res.normal = Vec3(0, 0, 0);
+    res.w = Vec3(0, 0, 0);
+
+    Point3 corners[8];
+    int num_corners = 0;
+    if (prim.kind == RasterPrimitive::sphere) {
+        res.c = res.oc.squaredNorm() - prim.radius * prim.radius;
+        for (int k = 0; k < 8; k++) {
+            Vec3 offset((k & 1) ? prim.radius : -prim.radius, (k & 2) ? prim.radius : -prim.radius, (k & 4) ? prim.radius : -prim.radius);
+            corners[num_corners++] = prim.p + offset;
+        }
+    } else {
+        res.normal = prim.edge1.cross(prim.edge2);
+        res.w = res.normal / res.normal.squaredNorm();
+        res.numerator = -res.normal.dot(res.oc);
+        corners[num_corners++] = prim.p;
+        corners[num_corners++] = prim.p + prim.edge1;
+        corners[num_corners++] = prim.p + prim.edge2;
+        corners[num_corners++] = prim.p + prim.edge1 + prim.edge2;
+    }
+
+    // projection of a convex shape in front of the camera => inside the box of its projected corners
+    double s_min = infinity, s_max = -infinity, t_min = infinity, t_max = -infinity;
+    bool in_front = true;
+    for (int k = 0; k < num_corners && in_front; k++) {
+        double s, t;
+        in_front = cam.project(corners[k], s, t);
+        s_min = std::min(s_min, s);
+        s_max = std::max(s_max, s);
+        t_min = std::min(t_min, t);
+        t_max = std::max(t_max, t);
+    }
+
+    res.col0 = 0; res.col1 = width - 1;
+    res.row0 = 0; res.row1 = height - 1;
+    if (!in_front) return res; // crosses the plane of the camera => every pixel
+
+    // a sample at s belongs to pixel i = floor(s (width - 1)), one more pixel around for the rounding
+    // the image is flipped on both axes compared to the camera, like in render()
+    double i0 = std::floor(s_min * (width - 1)) - 1, i1 = std::floor(s_max * (width - 1)) + 1;
+    double j0 = std::floor(t_min * (height - 1)) - 1, j1 = std::floor(t_max * (height - 1)) + 1;
+    res.col0 = static_cast<int>(std::max(0.0, width - 1 - i1));
+    res.col1 = static_cast<int>(std::min(width - 1.0, width - 1 - i0));
+    res.row0 = static_cast<int>(std::max(0.0, height - 1 - j1));
+    res.row1 = static_cast<int>(std::min(height - 1.0, height - 1 - j0));
+    return res;
+}
+
+// same frame as render() with the camera rays rasterized, false (and nothing rendered) if the world cannot be drawn
+inline bool render_hybrid(const Camera& cam, const Shader& shader, const Hittable& world, const RenderSettings& settings, Framebuffer& frame) {
+    TRACE_SCOPE("render hybrid");
+    RasterPrimitives primitives;
+    Mat3 identity = Mat3::Identity();
+    if (!world.rasterize(primitives, nullptr, identity)) return false;
+
+    const int width = settings.image_width;
+    const int height = settings.image_height;
+    const int tile_size = settings.tile_size;
+    const int count = settings.sample_count();
+    const double footprint = 1 / std::sqrt(double(count));
+    if (frame.width != width || frame.height != height) frame = Framebuffer(width, height);
+
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+    const int num_tiles = tiles_x * tiles_y;
+
+    // setup and binning
+    std::vector<RasterSetup> setups;
+    std::vector<std::vector<int>> bins(num_tiles);
+    {
+        TRACE_SCOPE("raster setup");
+        setups.reserve(primitives.primitives.size());
+        for (const RasterPrimitive& prim : primitives.primitives) {
+            RasterSetup setup = raster_setup(prim, cam, width, height);
+            if (setup.col0 > setup.col1 || setup.row0 > setup.row1) continue; // off screen
+            int index = static_cast<int>(setups.size());
+            setups.push_back(setup);
+            for (int ty = setup.row0 / tile_size; ty <= setup.row1 / tile_size; ty++) {
+                for (int tx = setup.col0 / tile_size; tx <= setup.col1 / tile_size; tx++) bins[ty * tiles_x + tx].push_back(index);
+            }
+        }
+    }
+
+    std::atomic<int> tiles_done(0);
+    std::mutex progress_mutex;
+
+    parallel_for(num_tiles, [&](int tile) {
+        TRACE_SCOPE_ARG("tile", tile);
+        const int row0 = (tile / tiles_x) * tile_size;
+        const int col0 = (tile % tiles_x) * tile_size;
+        const int row1 = std::min(row0 + tile_size, height);
+        const int col1 = std::min(col0 + tile_size, width);
+        const int tile_width = col1 - col0;
+        const int pixels = tile_width * (row1 - row0);
+
+        std::unique_ptr<Sampler> sampler = make_sampler(settings.sampler, count);
+        ScopedRandomSource source(sampler.get());
+
+        // the visibility buffer of one sample index
+        std::vector<Ray> rays(pixels);
+        std::vector<int> visible(pixels);
+        std::vector<Real> depth(pixels);
+        std::vector<Color> sum(pixels, Color(0, 0, 0));
+
+        for (int s = 0; s < count; s++) {
+            for (int row = row0; row < row1; row++) {
+                for (int col = col0; col < col1; col++) {
+                    int k = (row - row0) * tile_width + (col - col0);
+                    int i = width - 1 - col;
+                    int j = height - 1 - row;
+                    sampler->start_sample(i, j, s);
+                    auto u = (i + random_double()) / (width - 1);
+                    auto v = (j + random_double()) / (height - 1);
+                    rays[k] = cam.get_ray(u, v, footprint / (width - 1), footprint / (height - 1));
+                    visible[k] = -1;
+                    depth[k] = infinity;
+                }
+            }
+
+            for (int index : bins[tile]) {
+                const RasterSetup& prim = setups[index];
+                int r0 = std::max(row0, prim.row0), r1 = std::min(row1 - 1, prim.row1);
+                int c0 = std::max(col0, prim.col0), c1 = std::min(col1 - 1, prim.col1);
+                for (int row = r0; row <= r1; row++) {
+                    for (int col = c0; col <= c1; col++) {
+                        int k = (row - row0) * tile_width + (col - col0);
+                        Real t;
+                        if (raster_test(prim, rays[k].direction(), depth[k], t)) {
+                            depth[k] = t;
+                            visible[k] = index;
+                        }
+                    }
+                }
+            }
+
+            for (int row = row0; row < row1; row++) {
+                for (int col = col0; col < col1; col++) {
+                    int k = (row - row0) * tile_width + (col - col0);
+                    sampler->start_sample(width - 1 - col, height - 1 - row, s);
+                    sampler->next(); // the position in the pixel, already used
+                    sampler->next();
+                    if (visible[k] < 0) {
+                        STAT_INC(stat_raster_samples);
+                        sum[k] += shader.shade(rays[k], nullptr, settings.max_depth);
+                        continue;
+                    }
+
+                    // the owner gives the exact record, a thin interval => only the surface that was drawn
+                    HitRecord rec;
+                    Real tolerance = 1e-4 * depth[k] + epsilon;
+                    if (setups[visible[k]].owner->hit(rays[k], std::max(Real(epsilon), depth[k] - tolerance), depth[k] + tolerance, rec)) {
+                        STAT_INC(stat_raster_samples);
+                        sum[k] += shader.shade(rays[k], &rec, settings.max_depth);
+                    } else {
+                        STAT_INC(stat_primary_rays);
+                        sum[k] += shader.trace(rays[k], settings.max_depth);
+                    }
+                }
+            }
+        }
+
+        for (int row = row0; row < row1; row++) {
+            for (int col = col0; col < col1; col++) frame(row, col) = sum[(row - row0) * tile_width + (col - col0)] / count;
+        }
+
+        int done = ++tiles_done;
+        if (settings.show_progress) {
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            std::cerr << "\rTiles remaining: " << num_tiles - done << "    " << std::flush;
+        }
+    }, settings.num_threads);
+
+    if (settings.show_progress) std::cerr << "\n";
+    return true;
+}
+
+#endif
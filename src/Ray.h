@@ -2,28 +2,78 @@
 #define RAY_H
 
 #include "Vec3.h"
+#include "Simd.h"
 
 /*
 Defines a simple ray which is two vectors, an origin and direction
+
+The ray also keeps what the slab test of the bounding boxes needs (see aabb.h) so that it is computed once per ray
+and not once per box:
+    the reciprocal of the direction => a multiplication instead of a division per slab
+    the sign of each component of the direction => which side of a box the ray enters from
+    the origin and the reciprocal in 4-wide registers (float build) => the 3 slabs are done at once
+
+origin() and direction() return references => no copy of the vectors for every use.
+A ray cannot be changed after it is made, make a new one instead (otherwise the cached values would be wrong).
+
+Camera rays also carry ray differentials (Igehy 1999) => how their origin and unit direction change from one
+pixel sample to the next. The shader turns them into the footprint of the sample on the surface it hits
+so that the textures can average over it, and passes them on through mirrors and glass (see Shader::trace).
+The other rays (shadow rays, diffuse bounces) have none => the textures are point sampled there.
 */
 
+struct RayDifferentials {
+    Vec3 dpdx = Vec3(0, 0, 0), dpdy = Vec3(0, 0, 0); // of the origin
+    Vec3 dddx = Vec3(0, 0, 0), dddy = Vec3(0, 0, 0); // of the unit direction
+};
+
 class Ray {
     public:
         Ray() {}
         Ray(const Point3& origin, const Vec3& direction)
             : orig(origin), dir(direction)
-        {}
+        {
+            inv_dir = Vec3(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+            for (int a = 0; a < 3; a++) sign[a] = inv_dir[a] < 0;
+#ifndef RT_DOUBLE_PRECISION
+            // the 4th lane is 0 * 1 => it never limits the slab test, the boxes put -inf and +inf there
+            orig4 = vfloat4(orig.x(), orig.y(), orig.z(), 0.0f);
+            inv_dir4 = vfloat4(inv_dir.x(), inv_dir.y(), inv_dir.z(), 1.0f);
+#endif
+        }
+
+        const Point3& origin() const  { return orig; }
+        const Vec3& direction() const { return dir; }
+        const Vec3& inverse_direction() const { return inv_dir; }
+        int direction_sign(int axis) const { return sign[axis]; } // 1 if the direction is negative along axis
 
-        Point3 origin() const  { return orig; }
-        Vec3 direction() const { return dir; }
+#ifndef RT_DOUBLE_PRECISION
+        const vfloat4& origin4() const { return orig4; }
+        const vfloat4& inverse_direction4() const { return inv_dir4; }
+#endif
 
-        Point3 at(double t) const {
+        bool has_differentials() const { return has_diff; }
+        const RayDifferentials& differentials() const { return diff; }
+        void set_differentials(const RayDifferentials& _diff) {
+            diff = _diff;
+            has_diff = true;
+        }
+
+        Point3 at(Real t) const {
             return orig + t*dir;
         }
 
-    public:
+    private:
+#ifndef RT_DOUBLE_PRECISION
+        vfloat4 orig4;
+        vfloat4 inv_dir4;
+#endif
         Point3 orig;
         Vec3 dir;
+        Vec3 inv_dir;
+        int sign[3];
+        bool has_diff = false;
+        RayDifferentials diff;
 };
 
-#endif
\ No newline at end of file
+#endif
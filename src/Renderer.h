@@ -0,0 +1,226 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "utility.h"
+#include "Color.h"
+#include "Camera.h"
+#include "Shader.h"
+#include "Image.h"
+#include "Heatmap.h"
+#include "Parallel.h"
+#include "Sampler.h"
+#include "Stats.h"
+#include "Trace.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+/*
+The render loop that used to live in main()
+
+The image is cut into square tiles and the tiles are handed out to all the cores (see Parallel.h).
+Each pixel takes sample_count() samples from the Sampler of the settings (see Sampler.h),
+by default the jittered samples_per_pixel x samples_per_pixel grid from before.
+
+The result goes into a Framebuffer of linear colors (average of the samples, no gamma)
+so that the same frame can be post-processed or converted to an Image with to_image().
+
+The camera and the shader are only read => one scene can be rendered from many cameras without rebuilding anything.
+
+Optionally the render also fills FeatureBuffers with what the camera rays hit first
+(albedo, normal, depth and object id averaged over the samples of a pixel) => input of the denoiser.
+*/
+
+struct RenderSettings {
+    int image_width = 1000;
+    int image_height = 1000;
+    int samples_per_pixel = 7; // per side of the jitter grid => 7 gives 49 samples
+    int samples = 0;           // samples per pixel when > 0, any count => replaces samples_per_pixel^2
+    SamplerType sampler = stratified_sampler;
+    int max_depth = 5;
+    int num_threads = 0;       // 0 => all the cores
+    int tile_size = 32;
+    bool show_progress = true;
+
+    int sample_count() const { return samples > 0 ? samples : samples_per_pixel * samples_per_pixel; }
+};
+
+// linear colors of a frame, row 0 is the top of the image like in OpenCV
+class Framebuffer {
+    public:
+        Framebuffer() : width(0), height(0) {}
+        Framebuffer(int _width, int _height)
+            : width(_width), height(_height), pixels(_width * _height, Color(0, 0, 0)) {}
+
+        Color& operator()(int row, int col) { return pixels[row * width + col]; }
+        const Color& operator()(int row, int col) const { return pixels[row * width + col]; }
+
+    public:
+        int width, height;
+        std::vector<Color> pixels;
+};
+
+// first hits of the camera rays for every pixel
+class FeatureBuffers {
+    public:
+        FeatureBuffers() : width(0), height(0) {}
+        FeatureBuffers(int _width, int _height)
+            : width(_width), height(_height),
+              albedo(_width * _height, Color(0, 0, 0)), normal(_width * _height, Vec3(0, 0, 0)),
+              depth(_width * _height, 0), object_id(_width * _height, 0), variance(_width * _height, 0) {}
+
+        int index(int row, int col) const { return row * width + col; }
+
+        // 0 is kept for rays that hit nothing
+        static uint32_t id_of(const Hittable* object) {
+            if (!object) return 0;
+            uint32_t id = static_cast<uint32_t>(std::hash<const Hittable*>()(object));
+            return id == 0 ? 1 : id;
+        }
+
+        // writes <prefix>_albedo.png, <prefix>_normal.png, <prefix>_depth.png and <prefix>_id.png
+        void save(const std::string& prefix) const {
+            float max_depth = 0;
+            for (auto d : depth) max_depth = std::max(max_depth, d);
+
+            Image albedo_image(width, height), normal_image(width, height), depth_image(width, height), id_image(width, height);
+            for (int row = 0; row < height; row++) {
+                for (int col = 0; col < width; col++) {
+                    int k = index(row, col);
+                    albedo_image(row, col) = scale_color(albedo[k], 1);
+                    normal_image(row, col) = RGB(255 * (0.5 + 0.5 * normal[k].z()), 255 * (0.5 + 0.5 * normal[k].y()), 255 * (0.5 + 0.5 * normal[k].x()));
+                    unsigned char d = static_cast<unsigned char>(max_depth > 0 ? 255 * (1 - depth[k] / max_depth) : 0);
+                    depth_image(row, col) = RGB(d, d, d);
+                    uint32_t id = object_id[k] * 2654435761u; // spread the ids so that neighbours get different colors
+                    id_image(row, col) = RGB(id & 255, (id >> 8) & 255, (id >> 16) & 255);
+                }
+            }
+            albedo_image.save(prefix + "_albedo.png");
+            normal_image.save(prefix + "_normal.png");
+            depth_image.save(prefix + "_depth.png");
+            id_image.save(prefix + "_id.png");
+        }
+
+    public:
+        int width, height;
+        std::vector<Color> albedo;
+        std::vector<Vec3> normal;
+        std::vector<float> depth;
+        std::vector<uint32_t> object_id;
+        std::vector<float> variance; // of the mean luminance of the pixel => how noisy the pixel is
+};
+
+// samples of pixel (i, j) where (0, 0) is the lower left corner like for the camera
+// sampler => made once per tile by the caller (make_sampler with the settings), only restarted for each sample here
+// if features is given, it gets the average first hit of the samples (the object id is the one of the first sample)
+inline Color render_pixel(const Camera& cam, const Shader& shader, const RenderSettings& settings, Sampler& sampler, int i, int j,
+                          FeatureBuffers* features = nullptr, int feature_index = 0) {
+    const int count = settings.sample_count();
+    // the part of the pixel one sample stands for => 1/n x 1/n for the n x n grid
+    const double footprint = 1 / std::sqrt(double(count));
+    Color pixel_color(0, 0, 0);
+    SurfaceFeatures sample_features;
+    Color albedo(0, 0, 0);
+    Vec3 normal(0, 0, 0);
+    float depth = 0;
+    double luminance_sum = 0, luminance_squared_sum = 0;
+
+    // every random_double() of the samples (jitter, lights, bounces) comes from the sampler
+    ScopedRandomSource source(&sampler);
+
+    for (int s = 0; s < count; s++) {
+        sampler.start_sample(i, j, s);
+        // generate ray at (u, v), the first two dimensions are the position in the pixel
+        auto u = (i + random_double()) / (settings.image_width-1);
+        auto v = (j + random_double()) / (settings.image_height-1);
+        // with differentials => the texture is averaged over the part of the pixel the sample stands for
+        Ray r = cam.get_ray(u, v, footprint / (settings.image_width - 1), footprint / (settings.image_height - 1));
+        STAT_INC(stat_primary_rays);
+        if (!features) {
+            pixel_color += shader.trace(r, settings.max_depth);
+            continue;
+        }
+
+        sample_features = SurfaceFeatures();
+        Color sample_color = shader.trace(r, settings.max_depth, &sample_features);
+        pixel_color += sample_color;
+        double luminance = sample_color.mean();
+        luminance_sum += luminance;
+        luminance_squared_sum += luminance * luminance;
+        albedo += sample_features.albedo;
+        normal += sample_features.normal;
+        depth += sample_features.depth;
+        if (s == 0) features->object_id[feature_index] = FeatureBuffers::id_of(sample_features.object);
+    }
+
+    if (features) {
+        features->albedo[feature_index] = albedo / count;
+        features->normal[feature_index] = normal.squaredNorm() > 0 ? normal.normalized() : normal;
+        features->depth[feature_index] = depth / count;
+        double mean = luminance_sum / count;
+        features->variance[feature_index] = std::max(0.0, luminance_squared_sum / count - mean * mean) / count;
+    }
+    return pixel_color / count;
+}
+
+inline void render(const Camera& cam, const Shader& shader, const RenderSettings& settings, Framebuffer& frame,
+                   Heatmap* heatmap = nullptr, FeatureBuffers* features = nullptr) {
+    TRACE_SCOPE("render");
+    const int width = settings.image_width;
+    const int height = settings.image_height;
+    const int tile_size = settings.tile_size;
+    if (frame.width != width || frame.height != height) frame = Framebuffer(width, height);
+    if (features && (features->width != width || features->height != height)) *features = FeatureBuffers(width, height);
+
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+    const int num_tiles = tiles_x * tiles_y;
+
+    std::atomic<int> tiles_done(0);
+    std::mutex progress_mutex;
+
+    parallel_for(num_tiles, [&](int tile) {
+        TRACE_SCOPE_ARG("tile", tile);
+        int row0 = (tile / tiles_x) * tile_size;
+        int col0 = (tile % tiles_x) * tile_size;
+        int row1 = std::min(row0 + tile_size, height);
+        int col1 = std::min(col0 + tile_size, width);
+        std::unique_ptr<Sampler> sampler = make_sampler(settings.sampler, settings.sample_count());
+
+        for (int row = row0; row < row1; row++) {
+            for (int col = col0; col < col1; col++) {
+                PixelCost cost; // counters at the start of the pixel for the heatmap
+
+                // the image is flipped on both axes compared to the camera (u, v)
+                int i = width - 1 - col;
+                int j = height - 1 - row;
+                frame(row, col) = render_pixel(cam, shader, settings, *sampler, i, j, features, row * width + col);
+
+                if (heatmap) heatmap->add(row, col, cost);
+            }
+        }
+
+        int done = ++tiles_done;
+        if (settings.show_progress) {
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            std::cerr << "\rTiles remaining: " << num_tiles - done << "    " << std::flush;
+        }
+    }, settings.num_threads);
+
+    if (settings.show_progress) std::cerr << "\n";
+}
+
+// gamma correction and conversion to 8 bits
+inline void to_image(const Framebuffer& frame, Image& image) {
+    TRACE_SCOPE("to image");
+    for (int row = 0; row < frame.height; row++) {
+        for (int col = 0; col < frame.width; col++) {
+            image(row, col) = scale_color(frame(row, col), 1);
+        }
+    }
+}
+
+#endif
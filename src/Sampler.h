@@ -0,0 +1,442 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "utility.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+Samplers => where the random numbers of a pixel sample come from
+
+A path uses a fixed list of numbers: 2 for the position in the pixel, then the light samples, the scatter direction...
+Each of these is a dimension of the sample. With plain random numbers every dimension clumps a bit,
+a sampler spreads the N samples of a pixel evenly in every dimension (and in every pair of consecutive dimensions)
+=> less noise for the same number of samples, and N does not have to be a square like the old n x n jitter grid.
+
+    sampler->start_sample(i, j, s)  => sample s of pixel (i, j), dimension 0 again
+    sampler->next()                 => the next dimension
+    sampler->resume_sample(i, j, s, d) => sample s of pixel (i, j) again, from dimension d
+
+The render sets the sampler as the RandomSource of its thread (utility.h) for the time of a pixel,
+so everything the shader draws with random_double() takes the next dimension without passing the sampler around.
+The first max_dimensions dimensions are spread out, the ones after that (deep bounces) are plain random numbers.
+
+    independent => the mt19937 numbers of before
+    stratified  => every pair of dimensions is a jittered grid of the N samples (a latin hypercube when N is not
+                   a square), the pairs are shuffled against each other (Kensler's hashed permutation)
+                   so that they do not line up
+    halton      => dimension d is the radical inverse in base prime(d), moved by a random offset per pixel
+                   (Cranley-Patterson rotation)
+    sobol       => every pair of dimensions is the 2D Sobol sequence with hashed Owen scrambling and shuffling
+                   (Burley 2020, "Practical Hash-based Owen Scrambling")
+    blue-noise  => the same Sobol points in every pixel, moved by the values of a blue noise mask
+                   => the error left is spread like blue noise over the image instead of white noise (Georgiev and Fajardo)
+                   which looks much smoother at low sample counts
+
+With the stratified, halton, sobol and blue noise samplers a number below max_dimensions only depends on the pixel,
+the sample index and the dimension. The deeper dimensions and the independent sampler take the mt19937 engine of the
+thread => a path that gets that far (or any path of the independent sampler) changes with the tiles a thread did
+before, so the image is the same on every run only with a single thread.
+*/
+
+enum SamplerType {
+    independent_sampler,
+    stratified_sampler,
+    halton_sampler,
+    sobol_sampler,
+    blue_noise_sampler
+};
+
+// hash of 32 bits (the finalizer of murmur3), used everywhere a seed is needed
+inline uint32_t mix_bits(uint32_t v) {
+    v ^= v >> 16;
+    v *= 0x85ebca6bu;
+    v ^= v >> 13;
+    v *= 0xc2b2ae35u;
+    v ^= v >> 16;
+    return v;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return mix_bits(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+// 32 bits => [0, 1), never returns 1 even in float
+inline double bits_to_unit(uint32_t bits) {
+    return std::min(bits / 4294967296.0, 0.99999994);
+}
+
+// fractional part, kept below 1 like bits_to_unit
+inline double wrap_unit(double v) {
+    return std::min(v - std::floor(v), 0.99999994);
+}
+
+// i-th element of a random permutation of 0..count-1 picked by seed, without storing it (Kensler 2013)
+inline uint32_t permute_index(uint32_t i, uint32_t count, uint32_t seed) {
+    uint32_t w = count - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893d;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3f;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= count);
+    return (i + seed) % count;
+}
+
+class Sampler : public RandomSource {
+    public:
+        static const int max_dimensions = 64;
+
+        explicit Sampler(int _samples_per_pixel) : samples_per_pixel(std::max(1, _samples_per_pixel)) {}
+
+        void start_sample(int x, int y, int index) {
+            pixel_seed = hash_combine(mix_bits(static_cast<uint32_t>(x) * 0x8da6b343u), static_cast<uint32_t>(y) * 0xd8163841u);
+            pixel_x = x;
+            pixel_y = y;
+            sample_index = index;
+            dimension = 0;
+        }
+
+        double next() override {
+            int d = dimension++;
+            if (d >= max_dimensions) return random_engine()() / 4294967296.0;
+            return sample(d);
+        }
+
+        // the dimension the next call to next() takes
+        int current_dimension() const { return dimension; }
+
+        // the numbers past max_dimensions are plain random numbers => the ones drawn so far only come back below it
+        int position() const override { return dimension <= max_dimensions ? dimension : -1; }
+
+        // sample index of pixel (x, y) again from dimension d on => a path that was put aside goes on with the numbers
+        // it would have had without the break (render_out_of_core() shades the bounces of many paths in turns)
+        // the pair samplers make the odd dimensions with the even one before => that one is made again first
+        void resume_sample(int x, int y, int index, int d) {
+            start_sample(x, y, index);
+            if ((d & 1) && d <= max_dimensions) {
+                dimension = d - 1;
+                sample(d - 1);
+            }
+            dimension = d;
+        }
+
+    protected:
+        // dimension d < max_dimensions of the current sample
+        virtual double sample(int d) = 0;
+
+        int samples_per_pixel;
+        uint32_t pixel_seed = 0;
+        int pixel_x = 0, pixel_y = 0;
+        int sample_index = 0;
+        int dimension = 0;
+};
+
+class IndependentSampler : public Sampler {
+    public:
+        using Sampler::Sampler;
+
+        int position() const override { return -1; }
+
+    protected:
+        double sample(int) override { return random_engine()() / 4294967296.0; }
+};
+
+// for the samplers that make the dimensions two at a time => the second one is kept for the next call
+class PairSampler : public Sampler {
+    public:
+        using Sampler::Sampler;
+
+    protected:
+        double sample(int d) override {
+            if (d & 1) return second;
+            double first;
+            sample_pair(d / 2, first, second);
+            return first;
+        }
+
+        virtual void sample_pair(int pair, double& first, double& second) = 0;
+
+        double second = 0;
+};
+
+class StratifiedSampler : public PairSampler {
+    public:
+        explicit StratifiedSampler(int samples)
+            : PairSampler(samples), side(static_cast<uint32_t>(std::sqrt(double(samples_per_pixel)) + 0.5)) {
+            if (side * side != static_cast<uint32_t>(samples_per_pixel)) side = 0;
+        }
+
+    protected:
+        void sample_pair(int pair, double& first, double& second) override {
+            uint32_t seed = hash_combine(pixel_seed, pair);
+            // pair 0 is the position in the pixel => sample s is cell s like the old jitter grid
+            uint32_t cell = pair == 0 ? sample_index : permute_index(sample_index, samples_per_pixel, seed);
+            uint32_t jitter = hash_combine(seed, sample_index);
+            if (side > 0) {
+                first = (cell / side + bits_to_unit(jitter)) / side;
+                second = (cell % side + bits_to_unit(mix_bits(jitter))) / side;
+                return;
+            }
+            // not a square => latin hypercube, N strata along each axis and the second axis shuffled
+            // (a partly filled grid would leave holes and bias the pixel)
+            uint32_t row = permute_index(cell, samples_per_pixel, mix_bits(seed));
+            first = (cell + bits_to_unit(jitter)) / samples_per_pixel;
+            second = (row + bits_to_unit(mix_bits(jitter))) / samples_per_pixel;
+        }
+
+    private:
+        uint32_t side; // of the grid when the sample count is a square, 0 otherwise
+};
+
+class HaltonSampler : public Sampler {
+    public:
+        using Sampler::Sampler;
+
+    protected:
+        double sample(int d) override {
+            static const uint32_t primes[max_dimensions] = {
+                2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+                59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+                137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+                227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+            };
+            double offset = bits_to_unit(hash_combine(pixel_seed, d));
+            return wrap_unit(radical_inverse(primes[d], sample_index) + offset);
+        }
+
+    private:
+        // digits of index in base b mirrored around the decimal point
+        static double radical_inverse(uint32_t base, uint32_t index) {
+            double inverse_base = 1.0 / base, factor = inverse_base, res = 0;
+            while (index > 0) {
+                res += (index % base) * factor;
+                index /= base;
+                factor *= inverse_base;
+            }
+            return res;
+        }
+};
+
+// 2D Sobol points, Owen scrambled and shuffled by a hash => shared by the Sobol and the blue noise samplers
+inline uint32_t reverse_bits(uint32_t v) {
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+    v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+// hashed Owen scrambling => flipping a bit only depends on the bits above it (Laine and Karras, improved by Burley)
+inline uint32_t owen_scramble(uint32_t v, uint32_t seed) {
+    v = reverse_bits(v);
+    v += seed;
+    v ^= v * 0x6c50b47cu;
+    v ^= v * 0xb82f1e52u;
+    v ^= v * 0xc7afe638u;
+    v ^= v * 0x8d22f6e6u;
+    return reverse_bits(v);
+}
+
+inline void sobol_2d(uint32_t index, uint32_t seed, double& first, double& second) {
+    // shuffling the order with the same scrambling keeps every power of two prefix well spread
+    index = owen_scramble(index, hash_combine(seed, 0xa511e9b3u));
+
+    // dimension 0 => van der Corput, dimension 1 => direction numbers v_k = v_(k-1) ^ (v_(k-1) >> 1)
+    uint32_t x = reverse_bits(index), y = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) y ^= v;
+    }
+    first = bits_to_unit(owen_scramble(x, hash_combine(seed, 0x63d83595u)));
+    second = bits_to_unit(owen_scramble(y, hash_combine(seed, 0x3c6ef372u)));
+}
+
+class SobolSampler : public PairSampler {
+    public:
+        using PairSampler::PairSampler;
+
+    protected:
+        void sample_pair(int pair, double& first, double& second) override {
+            sobol_2d(sample_index, hash_combine(pixel_seed, pair), first, second);
+        }
+};
+
+/*
+64 x 64 blue noise mask made once with void and cluster (Ulichney 1993):
+points are added one by one where the "energy" (sum of gaussians of the points already there) is the lowest
+=> the rank at which a pixel got its point is its value, any threshold of the mask is an evenly spread set of points.
+*/
+class BlueNoiseMask {
+    public:
+        static const int size = 64;
+
+        static const BlueNoiseMask& instance() {
+            static BlueNoiseMask mask;
+            return mask;
+        }
+
+        // in (0, 1), wraps around on both axes
+        double operator()(int x, int y) const { return values[(y & (size - 1)) * size + (x & (size - 1))]; }
+
+    private:
+        BlueNoiseMask() : values(size * size) {
+            const int n = size * size;
+            const double sigma = 1.5;
+
+            // energy of a point at (0, 0) over the torus
+            std::vector<double> kernel(n);
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    int dx = std::min(x, size - x), dy = std::min(y, size - y);
+                    kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+                }
+            }
+
+            // initial pattern => 10% random points, then the point in the tightest cluster is moved
+            // to the largest void until that does not change anything
+            std::mt19937 engine(1);
+            std::vector<char> point(n, 0);
+            std::vector<double> energy(n, 0);
+            int initial = n / 10;
+            for (int placed = 0; placed < initial;) {
+                int k = engine() % n;
+                if (point[k]) continue;
+                toggle(point, energy, kernel, k);
+                placed++;
+            }
+            while (true) {
+                int cluster = extreme(point, energy, true);
+                toggle(point, energy, kernel, cluster);
+                int void_ = extreme(point, energy, false);
+                toggle(point, energy, kernel, void_);
+                if (void_ == cluster) break;
+            }
+
+            std::vector<int> rank(n, 0);
+            // the initial points get the ranks below 'initial', removing the tightest cluster first
+            std::vector<char> removed = point;
+            std::vector<double> removed_energy = energy;
+            for (int r = initial - 1; r >= 0; r--) {
+                int cluster = extreme(removed, removed_energy, true);
+                toggle(removed, removed_energy, kernel, cluster);
+                rank[cluster] = r;
+            }
+            // then the largest void gets the next rank until the mask is full
+            for (int r = initial; r < n; r++) {
+                int void_ = extreme(point, energy, false);
+                toggle(point, energy, kernel, void_);
+                rank[void_] = r;
+            }
+            for (int k = 0; k < n; k++) values[k] = (rank[k] + 0.5) / n;
+        }
+
+        static void toggle(std::vector<char>& point, std::vector<double>& energy, const std::vector<double>& kernel, int k) {
+            double sign = point[k] ? -1 : 1;
+            point[k] = !point[k];
+            int kx = k % size, ky = k / size;
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    energy[y * size + x] += sign * kernel[((y - ky) & (size - 1)) * size + ((x - kx) & (size - 1))];
+                }
+            }
+        }
+
+        // tightest cluster => point with the highest energy, largest void => empty pixel with the lowest energy
+        static int extreme(const std::vector<char>& point, const std::vector<double>& energy, bool cluster) {
+            int best = -1;
+            for (int k = 0; k < size * size; k++) {
+                if (point[k] != cluster) continue;
+                if (best < 0 || (cluster ? energy[k] > energy[best] : energy[k] < energy[best])) best = k;
+            }
+            return best;
+        }
+
+        std::vector<double> values;
+};
+
+class BlueNoiseSampler : public PairSampler {
+    public:
+        explicit BlueNoiseSampler(int samples) : PairSampler(samples), mask(BlueNoiseMask::instance()) {}
+
+    protected:
+        void sample_pair(int pair, double& first, double& second) override {
+            // the seed does not depend on the pixel => every pixel gets the same points...
+            sobol_2d(sample_index, hash_combine(0x2545f491u, pair), first, second);
+            // ...moved by the mask, read at another place for each dimension so the dimensions stay independent
+            first = wrap_unit(first + mask(pixel_x + 17 * pair, pixel_y + 41 * pair));
+            second = wrap_unit(second + mask(pixel_x + 17 * pair + 32, pixel_y + 41 * pair + 7));
+        }
+
+    private:
+        const BlueNoiseMask& mask;
+};
+
+inline std::unique_ptr<Sampler> make_sampler(SamplerType type, int samples_per_pixel) {
+    switch (type) {
+        case independent_sampler: return std::unique_ptr<Sampler>(new IndependentSampler(samples_per_pixel));
+        case halton_sampler: return std::unique_ptr<Sampler>(new HaltonSampler(samples_per_pixel));
+        case sobol_sampler: return std::unique_ptr<Sampler>(new SobolSampler(samples_per_pixel));
+        case blue_noise_sampler: return std::unique_ptr<Sampler>(new BlueNoiseSampler(samples_per_pixel));
+        default: return std::unique_ptr<Sampler>(new StratifiedSampler(samples_per_pixel));
+    }
+}
+
+// "independent", "stratified", "halton", "sobol" or "blue-noise", false for anything else
+inline bool parse_sampler_type(const std::string& name, SamplerType& type) {
+    if (name == "independent") type = independent_sampler;
+    else if (name == "stratified") type = stratified_sampler;
+    else if (name == "halton") type = halton_sampler;
+    else if (name == "sobol") type = sobol_sampler;
+    else if (name == "blue-noise") type = blue_noise_sampler;
+    else return false;
+    return true;
+}
+
+// the name parse_sampler_type() takes for type
+inline std::string sampler_name(SamplerType type) {
+    switch (type) {
+        case independent_sampler: return "independent";
+        case halton_sampler: return "halton";
+        case sobol_sampler: return "sobol";
+        case blue_noise_sampler: return "blue-noise";
+        default: return "stratified";
+    }
+}
+
+// makes sampler the RandomSource of the thread until the end of the scope
+class ScopedRandomSource {
+    public:
+        explicit ScopedRandomSource(RandomSource* source) : previous(thread_random_source()) { thread_random_source() = source; }
+        ~ScopedRandomSource() { thread_random_source() = previous; }
+
+        ScopedRandomSource(const ScopedRandomSource&) = delete;
+        ScopedRandomSource& operator=(const ScopedRandomSource&) = delete;
+
+    private:
+        RandomSource* previous;
+};
+
+#endif
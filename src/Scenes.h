@@ -0,0 +1,251 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "utility.h"
+#include "Color.h"
+#include "HittableList.h"
+#include "Sphere.h"
+#include "Material.h"
+#include "aarect.h"
+#include "Box.h"
+#include "BVH.h"
+#include "rotation.h"
+#include "LightSources.h"
+#include "Arena.h"
+#include "PrimitiveSets.h"
+#include "Trace.h"
+
+/*
+All the scenes live here so that the renderer and the benchmark build the exact same geometry
+
+Every scene comes in two parts:
+    a *_objects() function that fills a flat list of primitives and the light sources
+    a wrapper that puts the flat list into a BVH and adds it to the world
+
+The split lets the benchmark time the BVH build on its own.
+
+Lights are added with add_light() => they go in the flat list (so in the BVH with everything else) and in the light sources to be sampled.
+
+Every object of a scene (materials, textures, primitives, instances and BVH nodes) is made in the SceneArena that is passed in
+=> the arena owns the scene and has to live as long as it is rendered.
+
+The generated scenes (random spheres and random boxes) have no artistic value,
+they are only there to get a lot of primitives in the room so that traversal costs show up.
+*/
+
+// a light is an object of the scene like any other + it is sampled by the shader
+void add_light(HittableList& tmp, LightSources& lights, shared_ptr<Hittable> light) {
+    tmp.add(light);
+    lights.add(light);
+}
+
+void cornell_box_objects(SceneArena& arena, HittableList& tmp, LightSources& lights) {
+    auto cube_side = 555; // can change the size of the box right here
+    
+    // light sources
+    auto light = arena.make<DiffuseLight>(create_color(255, 255, 255));    
+    
+    // far away light => required to add  reflections if other lights are behind the reflective sphere
+    Point3 light_position(80, 200, -800);
+    shared_ptr<Hittable> light_object = arena.make<Sphere>(light_position, 20, light);
+    add_light(tmp, lights, light_object);
+    
+    // light sphere inside the room
+    Point3 third_light_position(80, 370, 150);
+    shared_ptr<Hittable> third_light_object = arena.make<Sphere>(third_light_position, 50, light);
+    add_light(tmp, lights, third_light_object);
+    
+    /*
+    // light rectangle
+    double size_light = cube_side/3;
+    shared_ptr<Hittable> light_rect = arena.make<xz_rect>(
+            cube_side/2 - size_light/2, 
+            cube_side/2 + size_light/2,  // x points from right to left, y points along vertical, z points deeper into the box..
+            cube_side/2 - size_light/2, 
+            cube_side/2 + size_light/2, 
+            cube_side - 10, light);
+    add_light(tmp, lights, light_rect);
+    */
+
+    // objects
+    auto ue_red = create_color(193, 2, 6);
+    auto carmine_red = create_color(165, 1, 19);
+    auto floral_white = create_color(255, 251, 242);
+    auto chinese_grey = create_color(223, 226, 219);
+    auto raisin_black = create_color(33, 29, 33);
+    auto rich_black = create_color(1, 10, 16);
+
+    // Materials --- I made all materials have default ka, kd, km, ks, p that I wanted    
+    auto glass = arena.make<Dielectric>(1.5); // refraction -> basically glass
+    auto fuzzy_red = arena.make<FuzzyMetal>(ue_red, 0.2);
+    auto metal_red = arena.make<FuzzyMetal>(carmine_red, 0.1);
+    auto matte_white = arena.make<Matte>(floral_white);
+    auto matte_black = arena.make<Matte>(rich_black);
+    auto metal_grey = arena.make<Metal>(chinese_grey); 
+
+    // the sides => give range and k example => the plane x = k  is [y0, z0] [y1, z1] and k creates the plane
+    tmp.add(arena.make<yz_rect>(0, cube_side, 0, cube_side, cube_side, matte_black));
+    tmp.add(arena.make<yz_rect>(0, cube_side, 0, cube_side, 0, matte_white));
+    // roof
+    tmp.add(arena.make<xz_rect>(0, cube_side, 0, cube_side, cube_side, metal_grey));
+    // back
+    tmp.add(arena.make<xy_rect>(0, cube_side, 0, cube_side, cube_side, metal_red));
+    
+    // make floor textured
+    auto num_squares_along_side = 20; // can change the grid pattern
+    auto checker = arena.make<RectCheckerTexture>(floral_white, raisin_black, cube_side, cube_side, num_squares_along_side, num_squares_along_side);
+    tmp.add(arena.make<xz_rect>(0, cube_side, 0, cube_side, 0, arena.make<Matte>(checker)));
+
+    // reflective metal sphere
+    tmp.add(arena.make<Sphere>(Point3(150, 100, 400), 120, metal_grey));    
+    // glass sphere
+    tmp.add(arena.make<Sphere>(Point3(385, 80, 195), 80, glass));
+    // small Matte sphere
+    tmp.add(arena.make<Sphere>(Point3(90, 40, 60), 40, fuzzy_red));
+
+    // two small rotated boxes
+    tmp.add(
+        arena.make<rotate_x> (
+            arena.make<rotate_y> (
+                //arena.make<Box>(Point3(100, 350, 400), Point3(150, 400, 450), metal_red, matte_black),
+                arena.make<Box>(Point3(200, 350, 350), Point3(250, 400, 400), metal_red, matte_black),
+                30
+            ),
+            300
+        )
+    );
+
+    tmp.add(
+        arena.make<rotate_y> (
+            arena.make<rotate_z> (
+                arena.make<Box>(Point3(250, 360, 350), Point3(300, 420, 400), metal_red, matte_white),
+                45
+            ), 
+            45
+        )
+    );
+
+    // big box inside the room with one side checkered
+    auto num_squares_along_box = 3; // can change the grid pattern
+    auto box_size = 120;
+    auto box_checker = arena.make<RectCheckerTexture>(floral_white, carmine_red, box_size, box_size, num_squares_along_box, num_squares_along_box);
+    //auto x = 200, y = 400, z = 150;
+    auto x = -20, y = 100, z = 350;
+    tmp.add(
+        arena.make<rotate_x>(
+            arena.make<rotate_y> (
+                arena.make<Box>(Point3(x, y, z), Point3(x + box_size, y+box_size, z+box_size), arena.make<Matte>(box_checker), fuzzy_red),
+                45
+            ),
+            315
+        )
+    );
+}
+
+void cornell_box(SceneArena& arena, HittableList& objects, LightSources& lights) {
+    TRACE_SCOPE("cornell_box");
+    HittableList tmp; // temporary list to build up BVH
+    {
+        TRACE_SCOPE("scene objects");
+        cornell_box_objects(arena, tmp, lights);
+    }
+    TRACE_SCOPE("bvh build");
+    objects.add(arena.make<BVH>(tmp, &arena));
+}
+
+// lights used by the generated scenes => one sphere inside the room and the far away one from the cornell box
+void add_default_lights(SceneArena& arena, HittableList& tmp, LightSources& lights) {
+    auto light = arena.make<DiffuseLight>(create_color(255, 255, 255));
+    add_light(tmp, lights, arena.make<Sphere>(Point3(80, 200, -800), 20, light));
+    add_light(tmp, lights, arena.make<Sphere>(Point3(278, 500, 278), 50, light));
+}
+
+// n spheres of random sizes and materials scattered in the cornell box volume
+// as_set => the spheres go into one SphereSet (see PrimitiveSets.h) instead of n Sphere objects, same spheres for the same seed
+void random_spheres_objects(SceneArena& arena, HittableList& tmp, LightSources& lights, int n, double max_radius = 15, bool as_set = false) {
+    add_default_lights(arena, tmp, lights);
+
+    auto glass = arena.make<Dielectric>(1.5);
+    auto matte = arena.make<Matte>(create_color(223, 226, 219));
+    auto metal = arena.make<Metal>(create_color(223, 226, 219));
+    auto fuzzy = arena.make<FuzzyMetal>(create_color(193, 2, 6), 0.2);
+    shared_ptr<Material> materials[] = { matte, metal, fuzzy, glass };
+
+    shared_ptr<SphereSet> set = as_set ? arena.make<SphereSet>() : nullptr;
+    for (int i = 0; i < n; i++) {
+        Point3 center(random_double(0, 555), random_double(0, 555), random_double(0, 555));
+        auto radius = random_double(0.1 * max_radius, max_radius);
+        auto material = materials[random_int(0, 3)];
+        if (set) set->add(center, radius, material);
+        else tmp.add(arena.make<Sphere>(center, radius, material));
+    }
+
+    if (set) {
+        set->build();
+        tmp.add(set);
+    }
+}
+
+void random_spheres(SceneArena& arena, HittableList& objects, LightSources& lights, int n, double max_radius = 15, bool as_set = false) {
+    HittableList tmp;
+    random_spheres_objects(arena, tmp, lights, n, max_radius, as_set);
+    TRACE_SCOPE("bvh build");
+    objects.add(arena.make<BVH>(tmp, &arena));
+}
+
+// n randomly rotated boxes => exercises Box and the rotate_* instances
+void random_boxes_objects(SceneArena& arena, HittableList& tmp, LightSources& lights, int n, double max_size = 20) {
+    add_default_lights(arena, tmp, lights);
+
+    auto matte = arena.make<Matte>(create_color(255, 251, 242));
+    auto metal = arena.make<FuzzyMetal>(create_color(165, 1, 19), 0.1);
+
+    for (int i = 0; i < n; i++) {
+        Point3 p0(random_double(0, 555), random_double(0, 555), random_double(0, 555));
+        auto size = random_double(0.2 * max_size, max_size);
+        shared_ptr<Hittable> box = arena.make<Box>(p0, p0 + Vec3(size, size, size), matte, metal);
+
+        switch (random_int(0, 2)) {
+            case 0: box = arena.make<rotate_x>(box, random_double(0, 360)); break;
+            case 1: box = arena.make<rotate_y>(box, random_double(0, 360)); break;
+            default: box = arena.make<rotate_z>(box, random_double(0, 360)); break;
+        }
+        tmp.add(box);
+    }
+}
+
+// n x n tiles of a floor at y = 0, each tile is a rect => a big floor of rects like a tiled bathroom
+// as_set => the tiles go into one RectSet
+void tiled_floor_objects(SceneArena& arena, HittableList& tmp, LightSources& lights, int n, bool as_set = false) {
+    add_default_lights(arena, tmp, lights);
+
+    auto white = arena.make<Matte>(create_color(255, 251, 242));
+    auto black = arena.make<Matte>(create_color(33, 29, 33));
+    double tile = 555.0 / n;
+    double gap = 0.05 * tile; // the grout between the tiles
+
+    shared_ptr<RectSet> set = as_set ? arena.make<RectSet>() : nullptr;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            double x0 = i * tile + gap, x1 = (i + 1) * tile - gap;
+            double z0 = j * tile + gap, z1 = (j + 1) * tile - gap;
+            auto material = (i + j) % 2 == 0 ? white : black;
+            if (set) set->add_xz(x0, x1, z0, z1, 0, material);
+            else tmp.add(arena.make<xz_rect>(x0, x1, z0, z1, 0, material));
+        }
+    }
+
+    if (set) {
+        set->build();
+        tmp.add(set);
+    }
+}
+
+void random_boxes(SceneArena& arena, HittableList& objects, LightSources& lights, int n, double max_size = 20) {
+    HittableList tmp;
+    random_boxes_objects(arena, tmp, lights, n, max_size);
+    TRACE_SCOPE("bvh build");
+    objects.add(arena.make<BVH>(tmp, &arena));
+}
+
+#endif
@@ -8,40 +8,211 @@
 #include <iostream>
 #include <vector>
 #include "LightSources.h"
+#include "Stats.h"
+#include "OccluderCache.h"
+#include "IrradianceCache.h"
+#include "PhotonMap.h"
+#include "Simd.h"
+#include <algorithm>
 
 /*
 As per the book, I define a shader but also make it do the ray intersection code
 
+the shadow rays of the light samples first test the object that blocked the same light nearby (OccluderCache.h)
+
+with an irradiance cache set, the light bouncing off matte surfaces is interpolated from the cache (IrradianceCache.h)
+instead of coming from one random scatter ray
+
+with a caustic map set, matte surfaces also get the light focused on them by glass (PhotonMap.h)
+
+camera rays carry ray differentials (Ray.h) => at the hit they give the footprint of the sample in (u, v) and the
+textures average over it (Texture::filtered_value), mirrors and glass pass them on to the ray they continue with
+
 the shader gets the best intersection, looks at the material type
 and based on the material type runs a blinn_phong, light emission or ray refraction routine to get a color
+
+trace() is const and only reads the scene so that all the render threads can share one shader
+
+the blinn-phong terms of the light samples are worked out 4 at a time (Simd.h) on batches of 16 samples
+stored as arrays of x, y, z => the powers with the big exponents of the metals are vpow() instead of one std::pow each
+and the shadow rays of a batch all start at the hit point => they go down the BVH together (ShadowPacket, Hittable.h)
+
+trace() can also report what the camera ray hit first (albedo, normal, depth, object) => these are the
+feature buffers that guide the denoiser
+
+shade_deferred() shades a hit without casting the rays that may reach geometry the world does not hold
+(OutOfCore.h, the world is then only what stays in memory): the shadow rays that get past the world and the ray the
+path goes on with are handed back in a DeferredShading, the caller intersects them in batches with the rest
+=> same sum as trace(), each piece comes back with the weight trace() would give it
 */
 
+// up to 16 light samples of one light, one array per coordinate => 4 samples load in a vfloat4 (see Shader::sample_light)
+struct LightSampleBatch {
+    static const int size = 16;
+    float x[size], y[size], z[size];  // unit vector towards the light
+    float weight[size];               // 1 / (pdf solid_angle), 0 => the sample does not count
+    float pdf[size];                  // of the light sampling, for the MIS weight
+    float term[size];                 // weight (diffuse + highlight) => what the sample brings if the shadow ray gets through
+    Vec3 direction[size];             // same vectors in Real for the shadow rays
+    Real distance[size];
+
+    // the lanes past count get a zero weight
+    void pad(int count) {
+        for (int s = count; s < (count + 3) / 4 * 4; s++) {
+            x[s] = y[s] = z[s] = 0;
+            weight[s] = pdf[s] = 0;
+        }
+    }
+};
+
+// light positions of emit_light() as arrays of x, y, z, padded to a multiple of 4 with the count kept apart
+struct LightPositions {
+    std::vector<float> x, y, z;
+    int count = 0;
+
+    LightPositions() {}
+    explicit LightPositions(const std::vector<Point3>& points) : count(static_cast<int>(points.size())) {
+        size_t padded = (points.size() + 3) / 4 * 4;
+        x.assign(padded, 0);
+        y.assign(padded, 0);
+        z.assign(padded, 0);
+        for (size_t i = 0; i < points.size(); i++) {
+            x[i] = static_cast<float>(points[i].x());
+            y[i] = static_cast<float>(points[i].y());
+            z[i] = static_cast<float>(points[i].z());
+        }
+    }
+};
+
+// a shadow ray of shade_deferred() => color counts if nothing is hit before t_max
+struct DeferredRay {
+    Ray ray;
+    Real t_max;
+    Color color;
+};
+
+// what shade_deferred() leaves to the caller
+struct DeferredShading {
+    Color color = Color(0, 0, 0);     // what is already known (ambient, emission, the lights the world alone decides)
+    std::vector<DeferredRay> shadows;
+    bool next = false;                // the path goes on with next_ray, what it brings back is multiplied by weight
+    Ray next_ray;
+    Color weight = Color(0, 0, 0);
+
+    void clear() {
+        color = Color(0, 0, 0);
+        shadows.clear();
+        next = false;
+    }
+};
+
+// which light samples of a first hit got through, kept by the G-buffer (GBuffer.h) => the next render skips their shadow rays
+// bit i * num_light_samples + s for sample s of light i
+struct FirstHitShadows {
+    static const int max_samples = 24; // lights x samples per light, more => nothing is kept
+    bool known = false;                // visible holds when the light samples start at dimension again
+    int dimension = -1;                // random_position() before the first light sample
+    uint32_t visible = 0;
+    bool recorded = false;             // the shader traced the shadow rays and filled visible => to be kept
+};
+
+// first hit of a camera ray, zeros if the ray escaped
+struct SurfaceFeatures {
+    Color albedo = Color(0, 0, 0);
+    Vec3 normal = Vec3(0, 0, 0);
+    float depth = 0;
+    const Hittable* object = nullptr;
+};
+
 class Shader
 {
 public:
     Shader(const Color &_background, const Hittable &_world, const LightSources &_light_sources, int _num_light_samples)
         : background(_background), light_sources(_light_sources), world(_world), num_light_samples(_num_light_samples) {
-        light_positions = light_sources.generate_random_positions(num_light_samples);
+        light_positions = LightPositions(light_sources.generate_random_positions(num_light_samples));
+    }
+
+    // the cache is filled while rendering => it has to outlive the render, nullptr turns it off
+    void set_irradiance_cache(IrradianceCache* cache) {
+        irradiance_cache = cache;
     }
 
-    Color trace(const Ray &r, int depth)
+    // built before the render (CausticMap::build), nullptr turns the caustics off
+    void set_caustics(const CausticMap* map) {
+        caustics = map;
+    }
+
+    // features is only given for camera rays
+    // mirrors and glass do not fill it, they hand it to the reflected/refracted ray => the denoiser sees what is in the mirror
+    // distance => set to how far the first hit is (infinity if none), the irradiance cache sizes its records with it
+    Color trace(const Ray &r, int depth, SurfaceFeatures* features = nullptr, Real* distance = nullptr) const
     {
         HitRecord rec;
+        if (distance) *distance = infinity;
         if (depth <= 0)
             return background;
 
+        // the lights are in the world => if a light is the closest hit, the light emit code below will be run...
         if (!world.hit(r, epsilon, infinity, rec))
             return background;
-        
-        light_sources.hit(r, epsilon, rec.t, rec); // if there is a hit, the light emit code below will be run...
+        if (distance) *distance = rec.t * r.direction().norm();
+        return shade_hit(r, rec, depth, features);
+    }
+
+    // same as trace() for a ray whose closest hit was found somewhere else, rec == nullptr if it hit nothing
+    // => the camera rays of the rasterizer and of the G-buffer are intersected first and shaded afterwards
+    // shadows => the light samples of this hit are read from it when it knows them, or traced and written to it
+    Color shade(const Ray &r, const HitRecord* rec, int depth, SurfaceFeatures* features = nullptr, FirstHitShadows* shadows = nullptr) const
+    {
+        if (depth <= 0 || !rec)
+            return background;
+        HitRecord copy = *rec; // the differentials write the footprint into it
+        return shade_hit(r, copy, depth, features, nullptr, shadows);
+    }
+
+    // what the light samples depend on besides the hit (the G-buffer drops its shadow masks when they change)
+    const LightSources& lights() const { return light_sources; }
+    int light_samples() const { return num_light_samples; }
+
+    // same as shade() for a ray that hit something, the rays it would cast are left in out (see above)
+    // => the irradiance cache is not used, its records would only trace through the world
+    void shade_deferred(const Ray &r, const HitRecord &rec, int depth, DeferredShading &out) const
+    {
+        out.clear();
+        if (depth <= 0) {
+            out.color = background;
+            return;
+        }
+        HitRecord copy = rec; // the differentials write the footprint into it
+        out.color = shade_hit(r, copy, depth, nullptr, &out);
+    }
+
+private:
+    Color shade_hit(const Ray &r, HitRecord &rec, int depth, SurfaceFeatures* features, DeferredShading* deferred = nullptr,
+                    FirstHitShadows* shadows = nullptr) const
+    {
+        RayDifferentials at_hit;
+        const RayDifferentials* differentials = nullptr;
+        if (r.has_differentials()) {
+            at_hit = hit_differentials(r, rec);
+            differentials = &at_hit;
+        }
+
+        if (features && !rec.mat_ptr->specular()) {
+            features->albedo = rec.mat_ptr->albedo(rec);
+            features->normal = rec.normal;
+            features->depth = rec.t * r.direction().norm();
+            features->object = rec.object;
+            features = nullptr;
+        }
 
         switch (rec.mat_ptr->type())
         {
         case blinn_phong:
-            return perform_blinn_phong(r, rec, depth);
+            return perform_blinn_phong(r, rec, depth, features, differentials, deferred, shadows);
             break;
         case glassy:
-            return refract_ray(r, rec, depth);
+            return refract_ray(r, rec, depth, features, differentials, deferred);
             break;
         case light_emitter:
             return emit_light(r, rec, depth);
@@ -51,71 +222,403 @@ public:
         }
     }
 
-private:
-    Color perform_blinn_phong(const Ray &r, const HitRecord &rec, int depth)
+    Color perform_blinn_phong(const Ray &r, const HitRecord &rec, int depth, SurfaceFeatures* features,
+                              const RayDifferentials* differentials, DeferredShading* deferred, FirstHitShadows* shadows = nullptr) const
     {
         ScatterRec srec = rec.mat_ptr->scatter(r, rec);
         Color local = srec.local_color;
         Ray reflected_ray = srec.ray_to_trace;
+        if (differentials && rec.mat_ptr->specular()) {
+            reflected_ray.set_differentials(leaving_differentials(r, rec, *differentials, reflected_ray.direction()));
+        }
         Vec3 view_vector = -r.direction();
+        view_vector.normalize(); // the lobe sampling needs unit vectors
         Vec3 normal = rec.normal;
 
         Color c = rec.mat_ptr->ka * local;
 
         // performing blinn bhong
         Color toAdd = rec.mat_ptr->emitted(rec.u, rec.v, rec.normal); // we add if the material emits a little bit
-        for (const auto& light_position : light_positions) {
-            Vec3 light_vector = light_position - rec.p;
-            light_vector.normalize();
+        int num_lights = light_sources.size();
+        size_t first_shadow = deferred ? deferred->shadows.size() : 0;
 
-            Ray shadow_ray(rec.p, light_vector);
-            HitRecord shadow_rec;
-            if (world.hit(shadow_ray, epsilon, infinity, shadow_rec)) continue;
+        // the light samples are the same as when the mask was made if they start at the same dimension of the sampler
+        // (a material that draws another number of scatter directions moves them)
+        bool replay = false;
+        if (shadows && num_lights * num_light_samples <= FirstHitShadows::max_samples && random_position() >= 0) {
+            replay = shadows->known && shadows->dimension == random_position();
+            if (!replay) {
+                shadows->dimension = random_position();
+                shadows->visible = 0;
+            }
+        } else shadows = nullptr;
+        for (int i = 0; i < num_lights; i++) {
+            toAdd += sample_light(i, rec, view_vector, local, deferred, shadows, replay);
+        }
+        // only the numbers below Sampler::max_dimensions come back on the next run
+        if (shadows && !replay) shadows->known = shadows->recorded = random_position() >= 0;
+
+        // light that reached p through glass => the shadow rays above count the glass as a blocker
+        if (caustics && rec.mat_ptr->diffuse()) {
+            toAdd += rec.mat_ptr->kd * caustics->irradiance(rec.p, rec.normal).cwiseProduct(local);
+        }
 
-            Vec3 half_vector = view_vector + light_vector;
-            half_vector.normalize();
-            
-            // multiplication is item by item => we are scaling floats between 0 and 1 => we scale to 255 at the end
-            toAdd += rec.mat_ptr->kd * local * std::max((float)0.0, rec.normal.dot(light_vector)) // diffusion
-                    + rec.mat_ptr->ks * local * std::pow(std::max((float)0.0, rec.normal.dot(half_vector)), rec.mat_ptr->p); // specular highlights
+        // the highlight of a glossy material is a small lobe => the light samples rarely land in it,
+        // so we also shoot rays from the lobe and keep the ones that reach a light
+        if (rec.mat_ptr->glossy()) {
+            for (int s = 0; s < num_light_samples; s++) {
+                toAdd += sample_highlight(rec, view_vector, local, deferred);
+            }
         }
 
+        // reflection does not depend on light position, only on material scatter
+        if (deferred) {
+            for (size_t k = first_shadow; k < deferred->shadows.size(); k++) deferred->shadows[k].color /= std::max(num_lights, 1);
+            if (depth > 1) STAT_INC(stat_secondary_rays);
+            deferred->next = true;
+            deferred->next_ray = reflected_ray;
+            deferred->weight = Color(1, 1, 1) * rec.mat_ptr->km;
+            return c + (toAdd / std::max(num_lights, 1));
+        }
+        Color reflected;
+        if (!cached_indirect(rec, depth, reflected)) {
+            if (depth > 1) STAT_INC(stat_secondary_rays); // depth 1 => the traced ray returns the background without being cast
+            reflected = trace(reflected_ray, depth - 1, features);
+        }
         return c 
-                + (toAdd / (light_positions.size()))  
-                + rec.mat_ptr->km * trace(reflected_ray, depth - 1); // reflection does not depend on light position, only on material scatter
+                + (toAdd / std::max(num_lights, 1))
+                + rec.mat_ptr->km * reflected;
+    }
+
+    /*
+    What the scatter ray of a matte hit would bring back on average, from the irradiance cache
+    => interpolated from the records around, or a new record is made here
+    false if there is no cache, the material is not diffuse, or this thread is already making a record
+    (the rays of a record use the records that exist but go back to the random scatter ray where there are none)
+    */
+    bool cached_indirect(const HitRecord &rec, int depth, Color &indirect) const
+    {
+        if (!irradiance_cache || depth <= 1 || !rec.mat_ptr->diffuse()) return false;
+        if (irradiance_cache->lookup(rec.p, rec.normal, indirect)) {
+            STAT_INC(stat_irradiance_cache_hits);
+            return true;
+        }
+        if (!irradiance_cache->can_add()) return false;
+
+        STAT_INC(stat_irradiance_records);
+        indirect = irradiance_cache->add(rec.p, rec.normal, [&](const Ray &ray, Real &distance) {
+            return trace(ray, depth - 1, nullptr, &distance);
+        });
+        return true;
+    }
+
+    /*
+    Direct light from light i, divided by the number of samples
+    
+    Each light counts as much as before (the old code averaged the blinn-phong terms over points of the lights)
+    but the average is now over the directions in which the light is seen, so the estimate of light i is
+        (1 / solid_angle) * integral over the light of f(l) V(l) dl
+    f is the blinn-phong sum (diffuse + highlight) and V says if the shadow ray gets through.
+    With l drawn with pdf_L, one sample is f(l) V(l) / (pdf_L * solid_angle).
+
+    For glossy materials the highlight is also estimated with directions drawn from the lobe (pdf_B),
+    both estimates are combined with the power heuristic => each one is trusted where its pdf is large
+        w_L = (n pdf_L)^2 / ((n pdf_L)^2 + (n pdf_B)^2)
+    A light that cannot be sampled like that (solid_angle() == 0) uses uniform points with weight 1, as before.
+
+    The samples go by batches of 16: the directions are drawn first (in the order of the random numbers of before),
+    then the blinn-phong terms of the batch are worked out 4 at a time, and the shadow rays are only cast
+    for the samples that bring something (a point of the light behind the surface costs no traversal),
+    all of them in one packet => the boxes of the BVH are tested once for the rays of the packet.
+
+    shadows => the first hit of a G-buffer sample: replay reads which rays got through from shadows->visible,
+    otherwise every sample is cast (the ones that bring nothing now may after a material change) and written to it.
+    */
+    Color sample_light(int i, const HitRecord& rec, const Vec3& view_vector, const Color& local, DeferredShading* deferred,
+                       FirstHitShadows* shadows = nullptr, bool replay = false) const {
+        const bool recording = shadows && !replay;
+        const Hittable& light = light_sources.light(i);
+        Real omega = light.solid_angle(rec.p);
+        LightSampleBatch batch;
+        Real sum = 0;
+        for (int first = 0; first < num_light_samples; first += LightSampleBatch::size) {
+            int count = std::min(LightSampleBatch::size, num_light_samples - first);
+            for (int s = 0; s < count; s++) {
+                Vec3 light_vector = light.random_direction(rec.p);
+                Real distance = light_vector.norm();
+                light_vector /= distance;
+
+                Real pdf = omega > 0 ? light.pdf_value(rec.p, light_vector) : 0;
+                batch.direction[s] = light_vector;
+                batch.distance[s] = distance;
+                batch.x[s] = static_cast<float>(light_vector.x());
+                batch.y[s] = static_cast<float>(light_vector.y());
+                batch.z[s] = static_cast<float>(light_vector.z());
+                batch.pdf[s] = static_cast<float>(pdf);
+                batch.weight[s] = omega <= 0 ? 1 : (pdf > 0 ? static_cast<float>(1 / (pdf * omega)) : 0);
+            }
+            batch.pad(count);
+            blinn_phong_terms(batch, count, rec, view_vector, rec.mat_ptr->glossy() && omega > 0);
+
+            // the shadow rays of the samples that count go down the tree together => the active mask says what got through
+            ShadowPacket packet;
+            packet.reset(rec.p, &light);
+            int sample_of[LightSampleBatch::size];
+            for (int s = 0; s < count; s++) {
+                if (batch.term[s] <= 0 && !recording) continue;
+                sample_of[packet.count] = s;
+                packet.add(batch.direction[s], batch.distance[s]);
+            }
+            const int bit = i * num_light_samples + first;
+            if (shadows && replay) {
+                for (int k = 0; k < packet.count; k++) {
+                    if (!((shadows->visible >> (bit + sample_of[k])) & 1)) packet.active &= ~(1u << k);
+                }
+            } else occluded(packet, i);
+            for (int k = 0; k < packet.count; k++) {
+                if (!(packet.active & (1u << k))) continue;
+                if (recording) shadows->visible |= 1u << (bit + sample_of[k]);
+                if (batch.term[sample_of[k]] <= 0) continue;
+                if (deferred) deferred->shadows.push_back(DeferredRay{packet.rays[k], packet.distance[k], batch.term[sample_of[k]] * local / num_light_samples});
+                else sum += batch.term[sample_of[k]];
+            }
+        }
+        return sum * local / num_light_samples;
+    }
+
+    // weight * (diffuse + highlight) of the samples of the batch, mis => the highlight gets the power heuristic against the lobe
+    static void blinn_phong_terms(LightSampleBatch& batch, int count, const HitRecord& rec, const Vec3& view_vector, bool mis) {
+        const Material& material = *rec.mat_ptr;
+        const vfloat4 nx(static_cast<float>(rec.normal.x())), ny(static_cast<float>(rec.normal.y())), nz(static_cast<float>(rec.normal.z()));
+        const vfloat4 vx(static_cast<float>(view_vector.x())), vy(static_cast<float>(view_vector.y())), vz(static_cast<float>(view_vector.z()));
+        const vfloat4 kd(material.kd), ks(material.ks), p(material.p), zero(0.0f);
+        const vfloat4 lobe_norm(static_cast<float>((material.p + 1) / (2 * pi) / 4)); // highlight_pdf = lobe_norm pow(n.h, p) / (v.h)
+
+        for (int s = 0; s < count; s += 4) {
+            vfloat4 lx = vfloat4::load(&batch.x[s]), ly = vfloat4::load(&batch.y[s]), lz = vfloat4::load(&batch.z[s]);
+            vfloat4 hx = vx + lx, hy = vy + ly, hz = vz + lz;
+            vfloat4 inv_length = vfloat4(1.0f) / vsqrt(hx * hx + hy * hy + hz * hz);
+            hx = hx * inv_length; hy = hy * inv_length; hz = hz * inv_length;
+
+            vfloat4 n_dot_l = nx * lx + ny * ly + nz * lz;
+            vfloat4 n_dot_h = nx * hx + ny * hy + nz * hz;
+            vfloat4 lobe = vpow(vmax(zero, n_dot_h), p);
+            vfloat4 highlight = ks * lobe;
+            if (mis) {
+                // the power heuristic of sample_highlight(), with Material::highlight_pdf from the same power
+                vfloat4 v_dot_h = vx * hx + vy * hy + vz * hz;
+                vfloat4 lobe_pdf = select((n_dot_h > zero) & (v_dot_h > zero), lobe_norm * lobe / v_dot_h, zero);
+                vfloat4 light_pdf = vfloat4::load(&batch.pdf[s]);
+                highlight = highlight * (light_pdf * light_pdf / (light_pdf * light_pdf + lobe_pdf * lobe_pdf));
+            }
+            vfloat4 term = vfloat4::load(&batch.weight[s]) * (kd * vmax(zero, n_dot_l) + highlight);
+            // NaN of the padding or of a 0 / 0 weight => 0
+            select(term > zero, term, zero).store(&batch.term[s]);
+        }
+    }
+
+    // one direction from the highlight lobe, it counts for the light it reaches (if any), see sample_light()
+    // deferred => the ray may still be blocked by what is not in the world before it reaches the light
+    Color sample_highlight(const HitRecord& rec, const Vec3& view_vector, const Color& local, DeferredShading* deferred) const {
+        Vec3 light_vector = rec.mat_ptr->sample_highlight(rec.normal, view_vector);
+        Real pdf = rec.mat_ptr->highlight_pdf(rec.normal, view_vector, light_vector);
+        if (pdf <= 0) return Color(0, 0, 0);
+
+        if (!light_sources.may_reach_light(rec.p, light_vector)) return Color(0, 0, 0);
+
+        // one traversal => the closest thing is either a light (so nothing is in the way) or what blocks the ray
+        HitRecord light_rec;
+        STAT_INC(stat_shadow_rays);
+        if (!world.hit(Ray(rec.p, light_vector), epsilon, infinity, light_rec)) return Color(0, 0, 0);
+        int i = light_sources.index_of(light_rec.object);
+        if (i < 0) {
+            STAT_INC(stat_shadow_occluded);
+            return Color(0, 0, 0);
+        }
+        const Hittable& light = light_sources.light(i);
+        Real omega = light.solid_angle(rec.p);
+        if (omega <= 0) return Color(0, 0, 0); // that light only uses its own samples
+
+        Vec3 half_vector = view_vector + light_vector;
+        half_vector.normalize();
+        Real highlight = rec.mat_ptr->ks * std::pow(std::max((Real)0.0, rec.normal.dot(half_vector)), rec.mat_ptr->p);
+        Real weight = power_heuristic(pdf, light.pdf_value(rec.p, light_vector)) / (pdf * omega);
+        if (deferred) {
+            deferred->shadows.push_back(DeferredRay{Ray(rec.p, light_vector), light_rec.t, weight * highlight * local / num_light_samples});
+            return Color(0, 0, 0);
+        }
+        return weight * highlight * local / num_light_samples;
+    }
+
+    // same number of samples for both strategies => the counts cancel out
+    static Real power_heuristic(Real pdf, Real other_pdf) {
+        return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
     }
 
-    Color refract_ray(const Ray &r, const HitRecord &rec, int depth)
+    // shadow rays from one point towards points of light i => the bits of the blocked rays are cleared from packet.active
+    // the light is in the world too => finding the light itself (rounding puts it a bit before distance) is not a block
+    // the object that last blocked that light near p is tested first (OccluderCache.h), one lookup for the whole packet
+    void occluded(ShadowPacket& packet, int light_index) const {
+        if (packet.count == 0) return;
+        STAT_ADD(stat_shadow_rays, packet.count);
+        STAT_INC(stat_shadow_packets);
+
+        const Hittable* occluder = occluder_cache.lookup(packet.origin, light_index);
+        int cache_hits = 0;
+        if (occluder) {
+            for (int k = 0; k < packet.count; k++) {
+                HitRecord shadow_rec;
+                if (occluder->hit(packet.rays[k], epsilon, packet.distance[k], shadow_rec)) {
+                    packet.block(k, occluder);
+                    cache_hits++;
+                }
+            }
+        }
+        STAT_ADD(stat_occluder_cache_hits, cache_hits);
+        STAT_ADD(stat_occluder_cache_misses, packet.count - cache_hits);
+
+        uint32_t tested = packet.active;
+        if (tested) world.occlude(packet);
+
+        // the cache keeps the last object the traversal found, and forgets the occluder when it blocked nothing
+        const Hittable* found = nullptr;
+        int blocked = cache_hits;
+        for (int k = 0; k < packet.count; k++) {
+            if ((tested & (1u << k)) && !(packet.active & (1u << k))) {
+                found = packet.blocker[k];
+                blocked++;
+            }
+        }
+        STAT_ADD(stat_shadow_occluded, blocked);
+        if (found) occluder_cache.store(packet.origin, light_index, found);
+        else if (occluder && cache_hits == 0) occluder_cache.store(packet.origin, light_index, nullptr);
+    }
+
+    Color refract_ray(const Ray &r, const HitRecord &rec, int depth, SurfaceFeatures* features,
+                      const RayDifferentials* differentials, DeferredShading* deferred) const
     {
         ScatterRec srec = rec.mat_ptr->scatter(r, rec);
         Color local = srec.local_color;
         Ray refracted_ray = srec.ray_to_trace;
+        if (differentials) {
+            refracted_ray.set_differentials(leaving_differentials(r, rec, *differentials, refracted_ray.direction()));
+        }
 
         // need to use c_wise product NOT *
-        return local.cwiseProduct(trace(refracted_ray, depth - 1));
+        if (depth > 1) STAT_INC(stat_secondary_rays);
+        if (deferred) {
+            deferred->next = true;
+            deferred->next_ray = refracted_ray;
+            deferred->weight = local;
+            return Color(0, 0, 0);
+        }
+        return local.cwiseProduct(trace(refracted_ray, depth - 1, features));
+    }
+
+    /*
+    Ray differentials at the hit (Igehy) => how the hit point moves to the next sample (dpdx, dpdy), the direction
+    derivatives are kept as they are. The offsets of the neighbouring rays are moved along them to the plane of the hit:
+        dp = dp_origin + t dd  then slid along d back onto the tangent plane
+    The footprint in (u, v) solves dp = du dpdu + dv dpdv on the two axes where the surface is the least foreshortened,
+    rec.du and rec.dv get the largest of the x and y footprints.
+    */
+    static RayDifferentials hit_differentials(const Ray &r, HitRecord &rec) {
+        const RayDifferentials& rd = r.differentials();
+        Real length = r.direction().norm();
+        Vec3 d = r.direction() / length;
+        Real t = rec.t * length;
+        Real d_dot_n = d.dot(rec.normal);
+
+        RayDifferentials at = rd;
+        at.dpdx = rd.dpdx + t * rd.dddx;
+        at.dpdy = rd.dpdy + t * rd.dddy;
+        if (std::fabs(d_dot_n) > 1e-6) {
+            at.dpdx -= (at.dpdx.dot(rec.normal) / d_dot_n) * d;
+            at.dpdy -= (at.dpdy.dot(rec.normal) / d_dot_n) * d;
+        }
+
+        int a = 0, b = 1;
+        Vec3 n = rec.normal.cwiseAbs();
+        if (n.x() >= n.y() && n.x() >= n.z()) a = 2;
+        else if (n.y() >= n.z()) b = 2;
+        Real det = rec.dpdu[a] * rec.dpdv[b] - rec.dpdv[a] * rec.dpdu[b];
+        if (std::fabs(det) > 1e-12) {
+            Real dudx = (rec.dpdv[b] * at.dpdx[a] - rec.dpdv[a] * at.dpdx[b]) / det;
+            Real dvdx = (rec.dpdu[a] * at.dpdx[b] - rec.dpdu[b] * at.dpdx[a]) / det;
+            Real dudy = (rec.dpdv[b] * at.dpdy[a] - rec.dpdv[a] * at.dpdy[b]) / det;
+            Real dvdy = (rec.dpdu[a] * at.dpdy[b] - rec.dpdu[b] * at.dpdy[a]) / det;
+            rec.du = std::max(std::fabs(dudx), std::fabs(dudy));
+            rec.dv = std::max(std::fabs(dvdx), std::fabs(dvdy));
+        }
+        return at;
     }
 
-    Color emit_light(const Ray &r, const HitRecord &rec, int depth) {
-        Color emitted(0, 0, 0);
+    /*
+    Differentials of the ray that leaves the hit along w (mirror reflection or refraction), at => hit_differentials()
+    The normal moves with the point on a curved surface: dn = curvature * dp (sphere of radius 1/curvature).
+    With d the unit incoming direction and n the normal facing it:
+        reflection  w = d - 2 (d.n) n               => dw = dd - 2 ((d.n) dn + d(d.n) n)
+        refraction  w = eta d - mu n, mu = eta (d.n) + cos_t
+                    => dw = eta dd - mu dn - dmu n, dmu = (eta - eta^2 (d.n) / (w.n)) d(d.n)
+    */
+    static RayDifferentials leaving_differentials(const Ray &r, const HitRecord &rec, const RayDifferentials &at, const Vec3 &direction) {
+        Vec3 d = r.direction().normalized();
+        Vec3 w = direction.normalized();
+        const Vec3& n = rec.normal;
+        Real side = rec.front_face ? 1 : -1; // rec.normal is the outward normal flipped towards the ray
+        Vec3 dndx = side * rec.curvature * at.dpdx;
+        Vec3 dndy = side * rec.curvature * at.dpdy;
+        Real d_dot_n = d.dot(n);
+        Real d_dot_n_dx = at.dddx.dot(n) + d.dot(dndx);
+        Real d_dot_n_dy = at.dddy.dot(n) + d.dot(dndy);
+
+        RayDifferentials out;
+        out.dpdx = at.dpdx;
+        out.dpdy = at.dpdy;
+        Real w_dot_n = w.dot(n);
+        if (w_dot_n > -1e-6) {
+            out.dddx = at.dddx - 2 * (d_dot_n * dndx + d_dot_n_dx * n);
+            out.dddy = at.dddy - 2 * (d_dot_n * dndy + d_dot_n_dy * n);
+        } else {
+            Real ior = rec.mat_ptr->index_of_refraction();
+            Real eta = rec.front_face ? 1 / ior : ior;
+            Real mu = eta * d_dot_n - w_dot_n;
+            Real dmu = eta - eta * eta * d_dot_n / w_dot_n;
+            out.dddx = eta * at.dddx - mu * dndx - dmu * d_dot_n_dx * n;
+            out.dddy = eta * at.dddy - mu * dndy - dmu * d_dot_n_dy * n;
+        }
+        return out;
+    }
+
+    // the light positions go 4 at a time, emitted() is the same for all of them => applied once at the end
+    Color emit_light(const Ray &r, const HitRecord &rec, int depth) const {
         Vec3 view_vector = -r.direction();
-        for (const auto& light_position : light_positions) {
-            Vec3 light_vector = light_position - rec.p;
-            light_vector.normalize();
-        
-            // give it some shape.
-            emitted += rec.mat_ptr->kd 
-                * rec.mat_ptr->emitted(rec.u, rec.v, rec.p) 
-                * ( 1 - std::max((float) 0.0, rec.normal.dot(light_vector)) );
+        const Material& material = *rec.mat_ptr;
+        const vfloat4 px(static_cast<float>(rec.p.x())), py(static_cast<float>(rec.p.y())), pz(static_cast<float>(rec.p.z()));
+        const vfloat4 nx(static_cast<float>(rec.normal.x())), ny(static_cast<float>(rec.normal.y())), nz(static_cast<float>(rec.normal.z()));
+        const vfloat4 vx(static_cast<float>(view_vector.x())), vy(static_cast<float>(view_vector.y())), vz(static_cast<float>(view_vector.z()));
+        const vfloat4 p(material.p), zero(0.0f), one(1.0f);
 
-            
-            Vec3 half_vector = view_vector + light_vector;
+        vfloat4 shape(0.0f), highlight(0.0f);
+        for (int k = 0; k < light_positions.count; k += 4) {
+            vfloat4 lx = vfloat4::load(&light_positions.x[k]) - px;
+            vfloat4 ly = vfloat4::load(&light_positions.y[k]) - py;
+            vfloat4 lz = vfloat4::load(&light_positions.z[k]) - pz;
+            vfloat4 inv_length = one / vsqrt(lx * lx + ly * ly + lz * lz);
+            lx = lx * inv_length; ly = ly * inv_length; lz = lz * inv_length;
 
-            emitted += rec.mat_ptr->ks *  
-                        rec.mat_ptr->emitted(rec.u, rec.v, rec.p) * 
-                        std::pow(std::max((float)0.0, rec.normal.dot(half_vector)), rec.mat_ptr->p);
+            // give it some shape.
+            vfloat4 n_dot_l = nx * lx + ny * ly + nz * lz;
+            // the half vector is not normalized here
+            vfloat4 n_dot_h = nx * (vx + lx) + ny * (vy + ly) + nz * (vz + lz);
+
+            vmask4 valid = vfloat4(float(k), float(k + 1), float(k + 2), float(k + 3)) < vfloat4(float(light_positions.count));
+            shape = shape + select(valid, one - vmax(zero, n_dot_l), zero);
+            highlight = highlight + select(valid, vpow(vmax(zero, n_dot_h), p), zero);
         }
-        return emitted / (light_positions.size());
-        
+        Color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+        return (material.kd * reduce_add(shape) + material.ks * reduce_add(highlight)) * emitted / light_positions.count;
+
         // can just do this if no shape -> return rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
     }
 
@@ -123,8 +626,11 @@ private:
     const Color &background;
     const Hittable &world;
     const LightSources &light_sources;
-    std::vector<Point3> light_positions;
+    LightPositions light_positions;
     const int num_light_samples;
+    OccluderCache occluder_cache; // cells of 16 units => about 1/35 of the side of the cornell box
+    IrradianceCache* irradiance_cache = nullptr;
+    const CausticMap* caustics = nullptr;
 };
 
 #endif
\ No newline at end of file
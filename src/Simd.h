@@ -0,0 +1,329 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define RT_SSE
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define RT_NEON
+    #include <arm_neon.h>
+#endif
+
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+/*
+4 floats that are worked on together => one SSE register on x86, one NEON register on ARM, 4 plain floats anywhere else
+
+Used by the primitive sets (PrimitiveSets.h) to intersect one ray against 4 spheres or 4 rects at a time:
+the spheres are stored as arrays of x, y, z, radius (structure of arrays) so that 4 neighbours load straight into a vfloat4.
+Also used as a 3D vector in one register (x, y, z and a 4th lane that is ignored) => the 3 slabs of a box test at once (aabb.h).
+
+A comparison gives a vmask4 with all the bits of a lane set when the lane is true, select(mask, a, b) picks per lane
+and bits(mask) gives one bit per lane to find which lanes are left.
+load_bytes(p) turns 4 bytes into 4 floats => the quantized boxes of the compressed BVH (CompressedBVH.h).
+vlog2, vexp2 and vpow => 4 powers at once for the blinn-phong highlights of the light samples (Shader.h).
+min, max and sqrt are called vmin, vmax and vsqrt so that they never get picked for plain floats.
+
+    vfloat4 t = (k - origin) * inv_direction;
+    vmask4 ok = (t > t_min) & (t < t_max);
+    t = select(ok, t, vfloat4(infinity));
+*/
+
+#if defined(RT_SSE)
+
+struct vmask4 {
+    __m128 m;
+    vmask4() {}
+    explicit vmask4(__m128 _m) : m(_m) {}
+};
+
+struct vfloat4 {
+    __m128 v;
+    vfloat4() {}
+    explicit vfloat4(__m128 _v) : v(_v) {}
+    vfloat4(float a) : v(_mm_set1_ps(a)) {}
+    vfloat4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+
+    static vfloat4 load(const float* p) { return vfloat4(_mm_loadu_ps(p)); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+    float operator[](int i) const { float f[4]; store(f); return f[i]; }
+};
+
+inline vfloat4 operator+(vfloat4 a, vfloat4 b) { return vfloat4(_mm_add_ps(a.v, b.v)); }
+inline vfloat4 operator-(vfloat4 a, vfloat4 b) { return vfloat4(_mm_sub_ps(a.v, b.v)); }
+inline vfloat4 operator*(vfloat4 a, vfloat4 b) { return vfloat4(_mm_mul_ps(a.v, b.v)); }
+inline vfloat4 operator/(vfloat4 a, vfloat4 b) { return vfloat4(_mm_div_ps(a.v, b.v)); }
+inline vfloat4 vmin(vfloat4 a, vfloat4 b) { return vfloat4(_mm_min_ps(a.v, b.v)); }
+inline vfloat4 vmax(vfloat4 a, vfloat4 b) { return vfloat4(_mm_max_ps(a.v, b.v)); }
+inline vfloat4 vsqrt(vfloat4 a) { return vfloat4(_mm_sqrt_ps(a.v)); }
+
+inline vmask4 operator<(vfloat4 a, vfloat4 b) { return vmask4(_mm_cmplt_ps(a.v, b.v)); }
+inline vmask4 operator<=(vfloat4 a, vfloat4 b) { return vmask4(_mm_cmple_ps(a.v, b.v)); }
+inline vmask4 operator>(vfloat4 a, vfloat4 b) { return vmask4(_mm_cmpgt_ps(a.v, b.v)); }
+inline vmask4 operator>=(vfloat4 a, vfloat4 b) { return vmask4(_mm_cmpge_ps(a.v, b.v)); }
+inline vmask4 operator==(vfloat4 a, vfloat4 b) { return vmask4(_mm_cmpeq_ps(a.v, b.v)); }
+inline vmask4 operator&(vmask4 a, vmask4 b) { return vmask4(_mm_and_ps(a.m, b.m)); }
+inline vmask4 operator|(vmask4 a, vmask4 b) { return vmask4(_mm_or_ps(a.m, b.m)); }
+
+inline vfloat4 select(vmask4 mask, vfloat4 a, vfloat4 b) {
+    return vfloat4(_mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v)));
+}
+inline int bits(vmask4 mask) { return _mm_movemask_ps(mask.m); }
+
+// 4 bytes => 4 floats (0..255), widened 8 -> 16 -> 32 bits then converted
+inline vfloat4 load_bytes(const uint8_t* p) {
+    int32_t word;
+    std::memcpy(&word, p, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(word), zero), zero);
+    return vfloat4(_mm_cvtepi32_ps(v));
+}
+
+// SSE2 has no floor => truncate, one less where that went up (negative numbers)
+inline vfloat4 vfloor(vfloat4 a) {
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+    return vfloat4(_mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a.v), _mm_set1_ps(1.0f))));
+}
+// a > 0 and normal => mantissa in [1, 2), exponent as a float
+inline vfloat4 vfrexp(vfloat4 a, vfloat4& exponent) {
+    __m128i b = _mm_castps_si128(a.v);
+    exponent = vfloat4(_mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(b, 23), _mm_set1_epi32(127))));
+    return vfloat4(_mm_castsi128_ps(_mm_or_si128(_mm_and_si128(b, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f800000))));
+}
+// 2^n for whole numbers n in [-126, 127]
+inline vfloat4 vexp2i(vfloat4 n) {
+    return vfloat4(_mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n.v), _mm_set1_epi32(127)), 23)));
+}
+
+#elif defined(RT_NEON)
+
+struct vmask4 {
+    uint32x4_t m;
+    vmask4() {}
+    explicit vmask4(uint32x4_t _m) : m(_m) {}
+};
+
+struct vfloat4 {
+    float32x4_t v;
+    vfloat4() {}
+    explicit vfloat4(float32x4_t _v) : v(_v) {}
+    vfloat4(float a) : v(vdupq_n_f32(a)) {}
+    vfloat4(float a, float b, float c, float d) { float f[4] = { a, b, c, d }; v = vld1q_f32(f); }
+
+    static vfloat4 load(const float* p) { return vfloat4(vld1q_f32(p)); }
+    void store(float* p) const { vst1q_f32(p, v); }
+    float operator[](int i) const { float f[4]; store(f); return f[i]; }
+};
+
+inline vfloat4 operator+(vfloat4 a, vfloat4 b) { return vfloat4(vaddq_f32(a.v, b.v)); }
+inline vfloat4 operator-(vfloat4 a, vfloat4 b) { return vfloat4(vsubq_f32(a.v, b.v)); }
+inline vfloat4 operator*(vfloat4 a, vfloat4 b) { return vfloat4(vmulq_f32(a.v, b.v)); }
+#if defined(__aarch64__)
+inline vfloat4 operator/(vfloat4 a, vfloat4 b) { return vfloat4(vdivq_f32(a.v, b.v)); }
+inline vfloat4 vsqrt(vfloat4 a) { return vfloat4(vsqrtq_f32(a.v)); }
+#else
+// 32 bit ARM has no vector divide => reciprocal estimate + 2 Newton steps
+inline vfloat4 operator/(vfloat4 a, vfloat4 b) {
+    float32x4_t r = vrecpeq_f32(b.v);
+    r = vmulq_f32(vrecpsq_f32(b.v, r), r);
+    r = vmulq_f32(vrecpsq_f32(b.v, r), r);
+    return vfloat4(vmulq_f32(a.v, r));
+}
+inline vfloat4 vsqrt(vfloat4 a) {
+    float f[4];
+    a.store(f);
+    return vfloat4(std::sqrt(f[0]), std::sqrt(f[1]), std::sqrt(f[2]), std::sqrt(f[3]));
+}
+#endif
+inline vfloat4 vmin(vfloat4 a, vfloat4 b) { return vfloat4(vminq_f32(a.v, b.v)); }
+inline vfloat4 vmax(vfloat4 a, vfloat4 b) { return vfloat4(vmaxq_f32(a.v, b.v)); }
+
+inline vmask4 operator<(vfloat4 a, vfloat4 b) { return vmask4(vcltq_f32(a.v, b.v)); }
+inline vmask4 operator<=(vfloat4 a, vfloat4 b) { return vmask4(vcleq_f32(a.v, b.v)); }
+inline vmask4 operator>(vfloat4 a, vfloat4 b) { return vmask4(vcgtq_f32(a.v, b.v)); }
+inline vmask4 operator>=(vfloat4 a, vfloat4 b) { return vmask4(vcgeq_f32(a.v, b.v)); }
+inline vmask4 operator==(vfloat4 a, vfloat4 b) { return vmask4(vceqq_f32(a.v, b.v)); }
+inline vmask4 operator&(vmask4 a, vmask4 b) { return vmask4(vandq_u32(a.m, b.m)); }
+inline vmask4 operator|(vmask4 a, vmask4 b) { return vmask4(vorrq_u32(a.m, b.m)); }
+
+inline vfloat4 select(vmask4 mask, vfloat4 a, vfloat4 b) { return vfloat4(vbslq_f32(mask.m, a.v, b.v)); }
+inline int bits(vmask4 mask) {
+    uint32_t m[4];
+    vst1q_u32(m, mask.m);
+    return (m[0] & 1) | ((m[1] & 1) << 1) | ((m[2] & 1) << 2) | ((m[3] & 1) << 3);
+}
+
+// 4 bytes => 4 floats (0..255)
+inline vfloat4 load_bytes(const uint8_t* p) {
+    uint32_t word;
+    std::memcpy(&word, p, 4);
+    uint16x8_t wide = vmovl_u8(vcreate_u8(word));
+    return vfloat4(vcvtq_f32_u32(vmovl_u16(vget_low_u16(wide))));
+}
+
+inline vfloat4 vfloor(vfloat4 a) {
+    float32x4_t t = vcvtq_f32_s32(vcvtq_s32_f32(a.v));
+    uint32x4_t one = vandq_u32(vcgtq_f32(t, a.v), vreinterpretq_u32_f32(vdupq_n_f32(1.0f)));
+    return vfloat4(vsubq_f32(t, vreinterpretq_f32_u32(one)));
+}
+inline vfloat4 vfrexp(vfloat4 a, vfloat4& exponent) {
+    uint32x4_t b = vreinterpretq_u32_f32(a.v);
+    exponent = vfloat4(vcvtq_f32_s32(vsubq_s32(vreinterpretq_s32_u32(vshrq_n_u32(b, 23)), vdupq_n_s32(127))));
+    return vfloat4(vreinterpretq_f32_u32(vorrq_u32(vandq_u32(b, vdupq_n_u32(0x007fffff)), vdupq_n_u32(0x3f800000))));
+}
+inline vfloat4 vexp2i(vfloat4 n) {
+    return vfloat4(vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n.v), vdupq_n_s32(127)), 23)));
+}
+
+#else
+
+// plain C++ => the compiler can still vectorize the small loops
+struct vmask4 {
+    bool m[4];
+};
+
+struct vfloat4 {
+    float v[4];
+    vfloat4() {}
+    vfloat4(float a) { v[0] = v[1] = v[2] = v[3] = a; }
+    vfloat4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+
+    static vfloat4 load(const float* p) { return vfloat4(p[0], p[1], p[2], p[3]); }
+    void store(float* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+    float operator[](int i) const { return v[i]; }
+};
+
+#define RT_VFLOAT4_OP(op) \
+    inline vfloat4 operator op(vfloat4 a, vfloat4 b) { return vfloat4(a.v[0] op b.v[0], a.v[1] op b.v[1], a.v[2] op b.v[2], a.v[3] op b.v[3]); }
+RT_VFLOAT4_OP(+)
+RT_VFLOAT4_OP(-)
+RT_VFLOAT4_OP(*)
+RT_VFLOAT4_OP(/)
+#undef RT_VFLOAT4_OP
+
+#define RT_VMASK4_CMP(op) \
+    inline vmask4 operator op(vfloat4 a, vfloat4 b) { vmask4 r; for (int i = 0; i < 4; i++) r.m[i] = a.v[i] op b.v[i]; return r; }
+RT_VMASK4_CMP(<)
+RT_VMASK4_CMP(<=)
+RT_VMASK4_CMP(>)
+RT_VMASK4_CMP(>=)
+RT_VMASK4_CMP(==)
+#undef RT_VMASK4_CMP
+
+inline vfloat4 vmin(vfloat4 a, vfloat4 b) { return vfloat4(std::min(a.v[0], b.v[0]), std::min(a.v[1], b.v[1]), std::min(a.v[2], b.v[2]), std::min(a.v[3], b.v[3])); }
+inline vfloat4 vmax(vfloat4 a, vfloat4 b) { return vfloat4(std::max(a.v[0], b.v[0]), std::max(a.v[1], b.v[1]), std::max(a.v[2], b.v[2]), std::max(a.v[3], b.v[3])); }
+inline vfloat4 vsqrt(vfloat4 a) { return vfloat4(std::sqrt(a.v[0]), std::sqrt(a.v[1]), std::sqrt(a.v[2]), std::sqrt(a.v[3])); }
+
+inline vmask4 operator&(vmask4 a, vmask4 b) { vmask4 r; for (int i = 0; i < 4; i++) r.m[i] = a.m[i] && b.m[i]; return r; }
+inline vmask4 operator|(vmask4 a, vmask4 b) { vmask4 r; for (int i = 0; i < 4; i++) r.m[i] = a.m[i] || b.m[i]; return r; }
+
+inline vfloat4 select(vmask4 mask, vfloat4 a, vfloat4 b) {
+    return vfloat4(mask.m[0] ? a.v[0] : b.v[0], mask.m[1] ? a.v[1] : b.v[1], mask.m[2] ? a.v[2] : b.v[2], mask.m[3] ? a.v[3] : b.v[3]);
+}
+inline int bits(vmask4 mask) { return mask.m[0] | (mask.m[1] << 1) | (mask.m[2] << 2) | (mask.m[3] << 3); }
+
+// 4 bytes => 4 floats (0..255)
+inline vfloat4 load_bytes(const uint8_t* p) { return vfloat4(p[0], p[1], p[2], p[3]); }
+
+inline vfloat4 vfloor(vfloat4 a) { return vfloat4(std::floor(a.v[0]), std::floor(a.v[1]), std::floor(a.v[2]), std::floor(a.v[3])); }
+inline vfloat4 vfrexp(vfloat4 a, vfloat4& exponent) {
+    vfloat4 m;
+    for (int i = 0; i < 4; i++) {
+        int e;
+        m.v[i] = 2 * std::frexp(a.v[i], &e); // frexp gives [0.5, 1)
+        exponent.v[i] = float(e - 1);
+    }
+    return m;
+}
+inline vfloat4 vexp2i(vfloat4 n) {
+    return vfloat4(std::ldexp(1.0f, int(n.v[0])), std::ldexp(1.0f, int(n.v[1])), std::ldexp(1.0f, int(n.v[2])), std::ldexp(1.0f, int(n.v[3])));
+}
+
+#endif
+
+// smallest and biggest lane
+#if defined(RT_SSE)
+inline float reduce_min(vfloat4 a) {
+    __m128 m = _mm_min_ps(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(_mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2))));
+}
+inline float reduce_max(vfloat4 a) {
+    __m128 m = _mm_max_ps(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(_mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2))));
+}
+#elif defined(RT_NEON) && defined(__aarch64__)
+inline float reduce_min(vfloat4 a) { return vminvq_f32(a.v); }
+inline float reduce_max(vfloat4 a) { return vmaxvq_f32(a.v); }
+#else
+inline float reduce_min(vfloat4 a) {
+    float f[4];
+    a.store(f);
+    return std::min(std::min(f[0], f[1]), std::min(f[2], f[3]));
+}
+inline float reduce_max(vfloat4 a) {
+    float f[4];
+    a.store(f);
+    return std::max(std::max(f[0], f[1]), std::max(f[2], f[3]));
+}
+#endif
+
+inline float reduce_add(vfloat4 a) {
+    float f[4];
+    a.store(f);
+    return (f[0] + f[1]) + (f[2] + f[3]);
+}
+
+/*
+x^p = 2^(p log2 x), the polynomials are the ones of the Cephes logf and exp2f
+log2 keeps its precision near x = 1 (the mantissa is taken in [0.707, 1.414) so that log(1 + f) is done on a small f)
+=> for the values of x^p that are not lost under 1e-8, p log2 x is within [-27, 0] and the relative error
+stays around 1e-6 even with p = 10000 (the mirrors).
+*/
+inline vfloat4 vlog2(vfloat4 x) {
+    vfloat4 e;
+    vfloat4 m = vfrexp(vmax(x, vfloat4(1.17549435e-38f)), e); // no denormals
+    vmask4 big = m > vfloat4(1.41421356f);
+    m = select(big, m * vfloat4(0.5f), m);
+    e = select(big, e + vfloat4(1.0f), e);
+    vfloat4 f = m - vfloat4(1.0f);
+    vfloat4 z = f * f;
+    vfloat4 y = vfloat4(7.0376836292e-2f);
+    y = y * f + vfloat4(-1.1514610310e-1f);
+    y = y * f + vfloat4(1.1676998740e-1f);
+    y = y * f + vfloat4(-1.2420140846e-1f);
+    y = y * f + vfloat4(1.4249322787e-1f);
+    y = y * f + vfloat4(-1.6668057665e-1f);
+    y = y * f + vfloat4(2.0000714765e-1f);
+    y = y * f + vfloat4(-2.4999993993e-1f);
+    y = y * f + vfloat4(3.3333331174e-1f);
+    y = y * f * z - vfloat4(0.5f) * z;
+    return (f + y) * vfloat4(1.44269504f) + e;
+}
+
+// 0 under 2^-126, infinity over 2^128
+inline vfloat4 vexp2(vfloat4 x) {
+    vfloat4 c = vmin(vmax(x, vfloat4(-126.0f)), vfloat4(127.49f));
+    vfloat4 n = vfloor(c + vfloat4(0.5f));
+    vfloat4 f = c - n; // [-0.5, 0.5]
+    vfloat4 y = vfloat4(1.535336188319500e-4f);
+    y = y * f + vfloat4(1.339887440266574e-3f);
+    y = y * f + vfloat4(9.618437357674640e-3f);
+    y = y * f + vfloat4(5.550332471162809e-2f);
+    y = y * f + vfloat4(2.402264791363012e-1f);
+    y = y * f + vfloat4(6.931472028550421e-1f);
+    y = y * f + vfloat4(1.0f);
+    vfloat4 res = y * vexp2i(n);
+    res = select(x < vfloat4(-126.0f), vfloat4(0.0f), res);
+    return select(x > vfloat4(128.0f), vfloat4(std::numeric_limits<float>::infinity()), res);
+}
+
+// x >= 0 and p > 0, 0 where x is 0 (or NaN)
+inline vfloat4 vpow(vfloat4 x, vfloat4 p) {
+    return select(x > vfloat4(0.0f), vexp2(p * vlog2(x)), vfloat4(0.0f));
+}
+
+#endif
@@ -4,37 +4,99 @@
 #include "Hittable.h"
 #include "Vec3.h"
 #include "string.h"
+#include "Stats.h"
 
 /*
 Defines a sphere as per the notes.
 Solves a quadratic equation to test for intersection...
+
+As a light, a sphere seen from a point o outside of it covers a cone of directions around the center:
+    sin(theta_max) = radius / distance to the center
+    solid angle of the cone = 2 pi (1 - cos(theta_max))
+random_direction() picks a direction uniformly in that cone => every sample lands on the cap that o can see
+(picking points on the whole surface wastes half of them on the far side of the light)
+and pdf_value() is 1 / solid angle for the directions in the cone.
+From inside the sphere every direction reaches it => uniform over all the directions.
 */
 
+// dp/du and dp/dv of the (u, v) of get_sphere_uv() at the point of outward unit normal n => ray differentials
+// u = (atan2(-z, x) + pi) / 2pi turns around the y axis, v = acos(-y) / pi goes from the bottom to the top
+inline void sphere_derivatives(const Vec3& n, Real radius, Vec3& dpdu, Vec3& dpdv) {
+    Real rho = std::max(std::sqrt(n.x() * n.x() + n.z() * n.z()), Real(1e-6)); // distance to the axis, 0 at the poles
+    dpdu = 2 * pi * radius * Vec3(n.z(), 0, -n.x());
+    dpdv = pi * radius * Vec3(-n.x() * n.y() / rho, rho, -n.y() * n.z() / rho);
+}
+
+// nearest t in [t_min, t_max] where the ray crosses the sphere => the test of Sphere::hit, also used by SphereSet
+// so that a sphere of a set is hit exactly where the same Sphere would be
+inline bool sphere_root(const Point3& center, Real radius, const Ray& r, Real t_min, Real t_max, Real& t) {
+    Vec3 oc = r.origin() - center;
+    auto a = r.direction().squaredNorm();
+    auto half_b = oc.dot(r.direction());
+    auto c = oc.squaredNorm() - radius*radius;
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    // Find the nearest root that lies in the acceptable range.
+    auto root = (-half_b - sqrtd) / a;
+    if (root < t_min || t_max < root) {
+        root = (-half_b + sqrtd) / a;
+        if (root < t_min || t_max < root)
+            return false;
+    }
+    t = root;
+    return true;
+}
+
 class Sphere : public Hittable {
     public:
         Sphere() {}
         Sphere(Point3 cen, double r, shared_ptr<Material> m)
         : center(cen), radius(r), mat_ptr(m) {};
 
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override;
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override;
         virtual bool bounding_box(aabb& output_box) const override;
         
         virtual std::string name() const override {
             return "sphere";
         }
 
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            out.add_sphere(to_world * center, radius, owner ? owner : this); // a rotation keeps the radius
+            return true;
+        }
+
         virtual Vec3 random_surface_point() const override {
-            return center + radius * random_in_unit_sphere();
+            return center + radius * random_unit_vector();
+        }
+
+        virtual Vec3 random_direction(const Point3& o) const override;
+        virtual Real pdf_value(const Point3& o, const Vec3& v) const override;
+        virtual Real solid_angle(const Point3& o) const override;
+
+        virtual Real random_emission_point(Point3& point, Vec3& normal) const override {
+            normal = random_unit_vector();
+            point = center + radius * normal;
+            return 4 * pi * radius * radius;
         }
 
     public:
         Point3 center;
-        double radius;
+        Real radius;
         shared_ptr<Material> mat_ptr;
     
     private:
         // required for texturing a sphere => given the point of intersection, it returns (u, v) by reference...
-        static void get_sphere_uv(const Point3& p, double& u, double& v) {
+        // 1 - cos(theta_max) of the cone seen from o, 0 if o is inside
+        // written as sin^2 / (1 + cos) => no cancellation when the light is small and far away
+        Real one_minus_cos_theta_max(const Point3& o) const {
+            Real sin2 = radius * radius / (center - o).squaredNorm();
+            if (sin2 >= 1) return 0;
+            return sin2 / (1 + std::sqrt(1 - sin2));
+        }
+
+        static void get_sphere_uv(const Point3& p, Real& u, Real& v) {
             // p: a given point on the sphere of radius one, centered at the origin.
             // u: returned value [0,1] of angle around the Y axis from X=-1.
             // v: returned value [0,1] of angle from Y=-1 to Y=+1.
@@ -57,22 +119,10 @@ bool Sphere::bounding_box(aabb& output_box) const {
     return true;
 }
 
-bool Sphere::hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const {
-    Vec3 oc = r.origin() - center;
-    auto a = r.direction().squaredNorm();
-    auto half_b = oc.dot(r.direction());
-    auto c = oc.squaredNorm() - radius*radius;
-    auto discriminant = half_b*half_b - a*c;
-    if (discriminant < 0) return false;
-    auto sqrtd = sqrt(discriminant);
-
-    // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
-    if (root < t_min || t_max < root) {
-        root = (-half_b + sqrtd) / a;
-        if (root < t_min || t_max < root)
-            return false;
-    }
+bool Sphere::hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const {
+    STAT_INC(stat_sphere_tests);
+    Real root;
+    if (!sphere_root(center, radius, r, t_min, t_max, root)) return false;
 
     rec.t = root;
     rec.p = r.at(rec.t);
@@ -82,12 +132,52 @@ bool Sphere::hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const
     // no need for this ->rec.normal = (rec.p - center) / radius;
 
     // set the material
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+    rec.object = this;
 
     // look up (u, v) coordinates
     get_sphere_uv(outward_normal, rec.u, rec.v);
+    sphere_derivatives(outward_normal, radius, rec.dpdu, rec.dpdv);
+    rec.curvature = 1 / radius;
 
     return true;
 }
 
+Real Sphere::solid_angle(const Point3& o) const {
+    Real h = one_minus_cos_theta_max(o);
+    return h > 0 ? 2 * pi * h : 4 * pi;
+}
+
+Real Sphere::pdf_value(const Point3& o, const Vec3& v) const {
+    Real h = one_minus_cos_theta_max(o);
+    if (h <= 0) return 1 / (4 * pi);
+    // inside the cone <=> the angle between v and the center is smaller than theta_max
+    Vec3 to_center = center - o;
+    Real cos_theta = v.dot(to_center) / (v.norm() * to_center.norm());
+    return cos_theta >= 1 - h ? 1 / (2 * pi * h) : 0;
+}
+
+Vec3 Sphere::random_direction(const Point3& o) const {
+    Vec3 to_center = center - o;
+    Real distance = to_center.norm();
+    Real h = one_minus_cos_theta_max(o);
+
+    if (h <= 0) {
+        // inside => any direction, up to where it leaves the sphere
+        Vec3 d = random_unit_vector();
+        Vec3 oc = o - center;
+        Real half_b = oc.dot(d);
+        Real t = -half_b + std::sqrt(std::max(Real(0), half_b * half_b - oc.squaredNorm() + radius * radius));
+        return t * d;
+    }
+
+    Real cos_theta = 1 - random_double() * h;
+    Vec3 d = direction_around(to_center / distance, cos_theta, 2 * pi * random_double());
+
+    // distance along d to the near side of the sphere
+    Real sin2 = std::max(Real(0), 1 - cos_theta * cos_theta);
+    Real t = distance * cos_theta - std::sqrt(std::max(Real(0), radius * radius - distance * distance * sin2));
+    return t * d;
+}
+
 #endif
\ No newline at end of file
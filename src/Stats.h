@@ -0,0 +1,211 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+/*
+Counters to find out where the time of a render goes
+
+Every thread has its own block of counters (thread_local) so incrementing one is a plain add,
+no atomics and no sharing of cache lines between threads.
+Each block registers itself once with a registry and the registry adds all of them together at the end of a render.
+
+The counters only exist when compiling with RT_STATS defined (cmake -DRT_STATS=ON).
+Otherwise STAT_INC expands to nothing and the release build does not pay anything for them.
+
+    STAT_INC(stat_bvh_nodes);       // count one event on the current thread
+    STAT_ADD(stat_sphere_tests, 4); // or several
+    RenderStats total = collect_stats();
+    print_stats(std::cerr, total);
+*/
+
+enum StatCounter {
+    // rays by type
+    stat_primary_rays,
+    stat_secondary_rays,
+    stat_shadow_rays,
+    stat_shadow_occluded, // shadow rays that hit something before reaching the light
+    stat_shadow_packets, // bundles of shadow rays from one point traced together (ShadowPacket in Hittable.h)
+    stat_occluder_cache_hits, // shadow rays blocked by the occluder found last time => no traversal (OccluderCache.h)
+    stat_occluder_cache_misses, // shadow rays that still needed a traversal
+    stat_irradiance_cache_hits, // matte bounces interpolated from the irradiance cache => no scatter ray (IrradianceCache.h)
+    stat_irradiance_records, // records made => M x N rays each
+    stat_raster_samples, // camera samples found by the rasterizer of the hybrid renderer => no traversal (Rasterizer.h)
+
+    // traversal
+    stat_bvh_nodes,
+    stat_aabb_tests,
+
+    // primitive tests by type
+    stat_sphere_tests,
+    stat_rect_tests,
+    stat_box_tests,
+    stat_instance_tests,
+
+    num_stat_counters
+};
+
+static const char* const stat_names[num_stat_counters] = {
+    "primary rays",
+    "secondary rays",
+    "shadow rays",
+    "shadow rays occluded",
+    "shadow packets",
+    "occluder cache hits",
+    "occluder cache misses",
+    "irradiance cache hits",
+    "irradiance records",
+    "rasterized samples",
+    "BVH nodes visited",
+    "AABB tests",
+    "sphere tests",
+    "rect tests",
+    "box tests",
+    "instance tests"
+};
+
+struct RenderStats {
+    uint64_t counters[num_stat_counters];
+
+    RenderStats() { reset(); }
+
+    void reset() {
+        for (int i = 0; i < num_stat_counters; i++) counters[i] = 0;
+    }
+
+    uint64_t operator[](int counter) const { return counters[counter]; }
+
+    RenderStats& operator+=(const RenderStats& other) {
+        for (int i = 0; i < num_stat_counters; i++) counters[i] += other.counters[i];
+        return *this;
+    }
+
+    RenderStats operator-(const RenderStats& other) const {
+        RenderStats res;
+        for (int i = 0; i < num_stat_counters; i++) res.counters[i] = counters[i] - other.counters[i];
+        return res;
+    }
+
+    // what the heatmap calls a traversal step and a primitive test
+    uint64_t traversal_steps() const { return counters[stat_bvh_nodes]; }
+    uint64_t primitive_tests() const { return counters[stat_sphere_tests] + counters[stat_rect_tests]; }
+};
+
+#ifdef RT_STATS
+
+// keeps a pointer to the counters of every live thread
+// counters of threads that exit are folded into 'retired' so that nothing is lost
+class StatsRegistry {
+    public:
+        static StatsRegistry& instance() {
+            static StatsRegistry registry;
+            return registry;
+        }
+
+        void add_thread(RenderStats* stats) {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(stats);
+        }
+
+        void remove_thread(RenderStats* stats) {
+            std::lock_guard<std::mutex> lock(mutex);
+            retired += *stats;
+            for (size_t i = 0; i < threads.size(); i++) {
+                if (threads[i] == stats) {
+                    threads.erase(threads.begin() + i);
+                    break;
+                }
+            }
+        }
+
+        // only meant to be called when no thread is rendering => reads the other threads' counters without syncing
+        RenderStats total() {
+            std::lock_guard<std::mutex> lock(mutex);
+            RenderStats res = retired;
+            for (const auto stats : threads) res += *stats;
+            return res;
+        }
+
+        void reset() {
+            std::lock_guard<std::mutex> lock(mutex);
+            retired.reset();
+            for (auto stats : threads) stats->reset();
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<RenderStats*> threads;
+        RenderStats retired;
+};
+
+struct ThreadStats {
+    RenderStats stats;
+    ThreadStats() { StatsRegistry::instance().add_thread(&stats); }
+    ~ThreadStats() { StatsRegistry::instance().remove_thread(&stats); }
+};
+
+inline RenderStats& thread_stats() {
+    static thread_local ThreadStats local;
+    return local.stats;
+}
+
+#define STAT_INC(counter) (++thread_stats().counters[counter])
+#define STAT_ADD(counter, n) (thread_stats().counters[counter] += (n))
+
+inline RenderStats collect_stats() { return StatsRegistry::instance().total(); }
+inline void reset_stats() { StatsRegistry::instance().reset(); }
+
+// snapshot of the current thread's counters => the difference at the end of a pixel is the cost of that pixel
+class PixelCost {
+    public:
+        PixelCost() : start(thread_stats()) {}
+        RenderStats so_far() const { return thread_stats() - start; }
+    private:
+        RenderStats start;
+};
+
+#else
+
+#define STAT_INC(counter) ((void)0)
+#define STAT_ADD(counter, n) ((void)0)
+
+inline RenderStats collect_stats() { return RenderStats(); }
+inline void reset_stats() {}
+
+class PixelCost {
+    public:
+        RenderStats so_far() const { return RenderStats(); }
+};
+
+#endif
+
+inline void print_stats(std::ostream& out, const RenderStats& stats) {
+#ifdef RT_STATS
+    out << "Render statistics\n";
+    for (int i = 0; i < num_stat_counters; i++) {
+        out << "    " << stat_names[i] << ": " << stats[i] << "\n";
+    }
+
+    uint64_t rays = stats[stat_primary_rays] + stats[stat_secondary_rays] + stats[stat_shadow_rays];
+    if (rays > 0) {
+        out << "    BVH nodes per ray: " << double(stats[stat_bvh_nodes]) / rays << "\n";
+        out << "    primitive tests per ray: " << double(stats.primitive_tests()) / rays << "\n";
+    }
+    if (stats[stat_shadow_rays] > 0) {
+        out << "    shadow occlusion rate: " << 100.0 * stats[stat_shadow_occluded] / stats[stat_shadow_rays] << "%\n";
+    }
+    uint64_t lookups = stats[stat_occluder_cache_hits] + stats[stat_occluder_cache_misses];
+    if (lookups > 0) {
+        out << "    occluder cache hit rate: " << 100.0 * stats[stat_occluder_cache_hits] / lookups << "%"
+            << " (" << 100.0 * stats[stat_occluder_cache_hits] / std::max<uint64_t>(stats[stat_shadow_occluded], 1) << "% of the occluded shadow rays)\n";
+    }
+#else
+    out << "Render statistics are disabled, build with -DRT_STATS=ON\n";
+#endif
+}
+
+#endif
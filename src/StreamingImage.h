@@ -0,0 +1,162 @@
+#ifndef STREAMING_IMAGE_H
+#define STREAMING_IMAGE_H
+
+#include "Color.h"
+#include "Renderer.h"
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+Streaming output for images that do not fit in memory
+
+render() keeps the whole frame (12 bytes a pixel) and the Image another copy (3 bytes a pixel) until cv::imwrite at the end
+=> a 32k x 32k poster needs 15 GB, and a crash loses everything.
+
+Here the file is the frame: a binary PPM (P6) has a fixed size header followed by the rows of RGB bytes,
+so the place of every pixel in the file is known before anything is rendered.
+    open()        => writes the header and sizes the file (the pixels not rendered yet read as black)
+    write_tile()  => a finished tile goes straight to its rows in the file and is flushed
+    good()        => false once a seek or a write failed (disk full...), the file is then missing tiles
+Every render thread only holds the tile it works on => memory grows with tile_size and the number of threads.
+The tiles are handed out row by row, so a render that dies leaves a valid PPM filled from the top.
+
+    StreamingImage out;
+    if (out.open("poster.ppm", width, height)) ok = render_to_file(camera, shader, settings, out) && out.close();
+*/
+
+class StreamingImage {
+    public:
+        StreamingImage() : width(0), height(0), file(nullptr), header_size(0), failed(false) {}
+        ~StreamingImage() { close(); }
+
+        StreamingImage(const StreamingImage&) = delete;
+        StreamingImage& operator=(const StreamingImage&) = delete;
+
+        bool open(const std::string& filename, int _width, int _height) {
+            close();
+            width = _width;
+            height = _height;
+            name = filename;
+            failed = false;
+            file = std::fopen(filename.c_str(), "wb");
+            if (!file) {
+                std::cerr << "cannot write " << filename << "\n";
+                return false;
+            }
+            char header[64];
+            header_size = std::snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+            bool ok = std::fwrite(header, 1, header_size, file) == static_cast<size_t>(header_size);
+
+            // last byte of the image => the file has its final size, the rest reads as zeros
+            long long size = header_size + 3LL * width * height;
+            if (ok && size > header_size) ok = seek(size - 1) && std::fputc(0, file) != EOF;
+            ok = ok && std::fflush(file) == 0;
+            if (!ok) {
+                std::cerr << "cannot write " << filename << " (" << 3LL * width * height << " bytes of pixels)\n";
+                close();
+            }
+            return ok;
+        }
+
+        // rgb => rows x cols pixels, 3 bytes each in R, G, B order, row 0 at the top of the tile
+        // several threads can write tiles at the same time, false if the tile did not make it to the file
+        bool write_tile(int row0, int col0, int rows, int cols, const std::vector<unsigned char>& rgb) {
+            TRACE_SCOPE("write tile"); // with the wait for the lock
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!file || failed) return false;
+            bool ok = true;
+            for (int r = 0; r < rows && ok; r++) {
+                ok = seek(header_size + 3LL * ((long long)(row0 + r) * width + col0))
+                    && std::fwrite(&rgb[3 * r * cols], 1, 3 * cols, file) == static_cast<size_t>(3 * cols);
+            }
+            ok = ok && std::fflush(file) == 0;
+            if (!ok) {
+                std::cerr << "\ncannot write the tile at row " << row0 << ", column " << col0 << " of " << name << "\n";
+                failed = true;
+            }
+            return ok;
+        }
+
+        bool good() const { return file && !failed; }
+
+        // false if the file was not written in full
+        bool close() {
+            bool ok = !failed;
+            if (file) ok = std::fclose(file) == 0 && ok;
+            file = nullptr;
+            return ok;
+        }
+
+    public:
+        int width, height;
+
+    private:
+        bool seek(long long offset) {
+            // fseek takes a long => 32 bits on Windows, images over 2 GB need the 64 bit versions
+#ifdef _WIN32
+            return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+            return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+        }
+
+        std::string name;
+        std::FILE* file;
+        long long header_size;
+        std::atomic<bool> failed; // a tile could not be written => the next ones are not rendered
+        std::mutex mutex;
+};
+
+// same tiles and samples as render() but each finished tile goes to out instead of a Framebuffer
+// false if a tile could not be written => the image in the file is not complete
+inline bool render_to_file(const Camera& cam, const Shader& shader, const RenderSettings& settings, StreamingImage& out) {
+    const int width = settings.image_width;
+    const int height = settings.image_height;
+    const int tile_size = settings.tile_size;
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+    const int num_tiles = tiles_x * tiles_y;
+
+    std::atomic<int> tiles_done(0);
+    std::mutex progress_mutex;
+
+    parallel_for(num_tiles, [&](int tile) {
+        if (!out.good()) return; // a tile was lost => the rest is not worth rendering
+        TRACE_SCOPE_ARG("tile", tile);
+        int row0 = (tile / tiles_x) * tile_size;
+        int col0 = (tile % tiles_x) * tile_size;
+        int rows = std::min(row0 + tile_size, height) - row0;
+        int cols = std::min(col0 + tile_size, width) - col0;
+
+        std::vector<unsigned char> rgb(3 * rows * cols);
+        std::unique_ptr<Sampler> sampler = make_sampler(settings.sampler, settings.sample_count());
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < cols; c++) {
+                // the image is flipped on both axes compared to the camera
+                int i = width - 1 - (col0 + c);
+                int j = height - 1 - (row0 + r);
+                RGB pixel = scale_color(render_pixel(cam, shader, settings, *sampler, i, j), 1); // OpenCV order => b, g, r
+                unsigned char* p = &rgb[3 * (r * cols + c)];
+                p[0] = pixel[2];
+                p[1] = pixel[1];
+                p[2] = pixel[0];
+            }
+        }
+        if (!out.write_tile(row0, col0, rows, cols, rgb)) return;
+
+        int done = ++tiles_done;
+        if (settings.show_progress) {
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            std::cerr << "\rTiles remaining: " << num_tiles - done << "    " << std::flush;
+        }
+    }, settings.num_threads);
+
+    if (settings.show_progress) std::cerr << "\n";
+    return out.good();
+}
+
+#endif
@@ -8,11 +8,19 @@
 Defines a texture abstract class which takes the coordinates and the point of intersection to return a color
 
 I only implemented away to add a checkerboard to a rectangle...
+
+filtered_value() is the average of the texture over the footprint of the pixel sample, a du x dv box around (u, v)
+(du and dv come from the ray differentials, see Shader::trace) => a checker that is finer than the pixels turns into its
+average color instead of aliasing. Textures that cannot do better just point sample.
 */
 
 class Texture {
     public:
         virtual Color value(double u, double v, const Vec3& p) const = 0;
+
+        virtual Color filtered_value(double u, double v, double du, double dv, const Vec3& p) const {
+            return value(u, v, p);
+        }
 };
 
 // materials that only have one color value
@@ -33,6 +41,25 @@ class SolidColor : public Texture {
         Color color_value;
 };
 
+// the texture of a material (or a checker) => either a shared texture or a plain color
+// a plain color is a SolidColor stored in the TextureRef itself, not an allocation of its own with a reference count
+// (same handle with an empty owner as SceneArena::make) => an object made in the arena makes no other allocation
+// the handle points into the object => TextureRef cannot be copied, the materials and textures are never copied anyway
+class TextureRef {
+    public:
+        TextureRef() {}
+        TextureRef(const Color& c) : solid(c), texture(shared_ptr<Texture>(), &solid) {}
+        TextureRef(shared_ptr<Texture> t) : texture(t) {}
+        TextureRef(const TextureRef&) = delete;
+        TextureRef& operator=(const TextureRef&) = delete;
+
+        const Texture* operator->() const { return texture.get(); }
+
+    private:
+        SolidColor solid;
+        shared_ptr<Texture> texture;
+};
+
 class RectCheckerTexture : public Texture {
     public:
         RectCheckerTexture() {}
@@ -41,7 +68,7 @@ class RectCheckerTexture : public Texture {
             : even(_even), odd(_odd), width(_width), height(_height), nx(_nx), ny(_ny) {}
 
         RectCheckerTexture(Color c1, Color c2, int _width, int _height, int _nx, int _ny)
-            : even(make_shared<SolidColor>(c1)) , odd(make_shared<SolidColor>(c2)), width(_width), height(_height), nx(_nx), ny(_ny) {}
+            : even(c1), odd(c2), width(_width), height(_height), nx(_nx), ny(_ny) {}
 
 
         virtual Color value(double u, double v, const Vec3& p) const override {
@@ -77,10 +104,35 @@ class RectCheckerTexture : public Texture {
             return even->value(u, v, p);
         }
 
+        // box filter of the checker => the fraction of the box on odd squares is known exactly
+        // along one axis: fraction of [x0, x1] on odd segments, and in 2D odd = odd along x XOR odd along y
+        virtual Color filtered_value(double u, double v, double du, double dv, const Vec3& p) const override {
+            double wx = du * nx, wy = dv * ny; // footprint in segments
+            if (wx < 1e-3 && wy < 1e-3) return value(u, v, p);
+
+            double ax = odd_fraction(u * nx, wx);
+            double ay = odd_fraction(v * ny, wy);
+            double odd_weight = ax + ay - 2 * ax * ay;
+            return (1 - odd_weight) * even->filtered_value(u, v, du, dv, p) + odd_weight * odd->filtered_value(u, v, du, dv, p);
+        }
+
+
+    private:
+        // integral from 0 to x of the square wave that is 1 on the odd segments [2k+1, 2k+2)
+        static double odd_integral(double x) {
+            double half = std::floor(x / 2);
+            return half + std::max(x - 2 * half - 1, 0.0);
+        }
+
+        // fraction of [x - w/2, x + w/2] on odd segments, w == 0 => 0 or 1
+        static double odd_fraction(double x, double w) {
+            if (w < 1e-3) return static_cast<int>(std::floor(x)) % 2 != 0 ? 1 : 0;
+            return (odd_integral(x + w / 2) - odd_integral(x - w / 2)) / w;
+        }
 
     public:
-        shared_ptr<Texture> odd;
-        shared_ptr<Texture> even;
+        TextureRef odd;
+        TextureRef even;
         int nx, ny;
         float width, height;
 
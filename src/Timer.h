@@ -0,0 +1,19 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <chrono>
+
+// wall clock time since the construction => used by the bench and the quality tools
+class Timer {
+    public:
+        Timer() : start(std::chrono::steady_clock::now()) {}
+
+        double seconds() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+    private:
+        std::chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+Timeline of a render => where the wall time of a frame goes (scene, BVH, tiles of each thread, waiting, saving)
+
+A scope is timed with
+    TRACE_SCOPE("bvh build");           // from here to the end of the block
+    TRACE_SCOPE_ARG("tile", tile);      // with a number shown in the viewer (the tile index)
+and the events go to a buffer of the thread that runs the scope (thread_local, like the counters of Stats.h)
+=> no lock and no atomic when recording, only the owner thread writes to its buffer.
+A thread that exits hands its events to the registry, the registry writes all of them at the end.
+
+Nothing is recorded until start_tracing() is called => a disabled scope is one relaxed load of a flag.
+The names must be string literals (only the pointer is kept).
+
+write_chrome_trace(file) writes the Chrome trace-event JSON ("X" events with a start and a duration in microseconds)
+that opens in chrome://tracing or https://ui.perfetto.dev, one row per thread.
+parallel_for() starts new threads on each call => its threads record under their worker slot (set_trace_worker_slot)
+and the worker k of every call goes to the same row "worker k" instead of one new row per call.
+parallel_for() also records the time the calling thread waits for the others at the end ("wait") => load imbalance.
+
+    TraceSession trace("trace.json"); // main => starts tracing, writes the file when main returns
+*/
+
+struct TraceEvent {
+    const char* name;
+    int64_t start;    // nanoseconds since the start of tracing
+    int64_t duration;
+    int64_t arg;      // -1 => none
+};
+
+class TraceRegistry {
+    public:
+        static TraceRegistry& instance() {
+            static TraceRegistry registry;
+            return registry;
+        }
+
+        bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+        void start() {
+            epoch = std::chrono::steady_clock::now();
+            on = true;
+        }
+
+        void stop() { on = false; }
+
+        int64_t now() const {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        // a thread id for the viewer, in the order the threads first record something
+        // slot > 0 => a worker of parallel_for, it takes over the row of the previous worker with the same slot once that one is gone
+        int add_thread(std::vector<TraceEvent>* events, int slot = -1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (slot > 0) {
+                for (Thread& thread : threads) {
+                    if (thread.slot == slot && !thread.live) {
+                        thread.live = events;
+                        return thread.id;
+                    }
+                }
+            }
+            if (slot <= 0) { // the first thread outside of the workers => main
+                slot = has_main ? -1 : 0;
+                has_main = true;
+            }
+            threads.push_back(Thread{next_id, slot, events, std::vector<TraceEvent>()});
+            return next_id++;
+        }
+
+        void remove_thread(std::vector<TraceEvent>* events) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Thread& thread : threads) {
+                if (thread.live == events) {
+                    thread.retired.insert(thread.retired.end(), events->begin(), events->end()); // after the earlier workers of the row
+                    events->clear();
+                    thread.live = nullptr;
+                }
+            }
+        }
+
+        // only meant to be called when no thread is recording => reads the other threads' buffers without syncing
+        bool write(const std::string& filename) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::ofstream out(filename);
+            if (!out) {
+                std::cerr << "cannot write " << filename << "\n";
+                return false;
+            }
+            out << std::fixed << std::setprecision(3); // microseconds with the nanoseconds, whatever the length of the run
+            out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+            bool first = true;
+            for (const Thread& thread : threads) {
+                if (thread.retired.empty() && (!thread.live || thread.live->empty())) continue;
+                out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread.id
+                    << ", \"args\": {\"name\": \"" << thread_name(thread) << "\"}}";
+                first = false;
+                const std::vector<TraceEvent>* parts[2] = {&thread.retired, thread.live}; // the workers gone, then the one running
+                for (const std::vector<TraceEvent>* events : parts) {
+                    if (!events) continue;
+                    for (const TraceEvent& e : *events) {
+                        out << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << thread.id
+                            << ", \"ts\": " << e.start / 1000.0 << ", \"dur\": " << e.duration / 1000.0;
+                        if (e.arg >= 0) out << ", \"args\": {\"index\": " << e.arg << "}";
+                        out << "}";
+                    }
+                }
+            }
+            out << "\n]}\n";
+            return bool(out);
+        }
+
+    private:
+        struct Thread {
+            int id;
+            int slot;                      // worker slot of parallel_for, 0 => main, -1 => any other thread
+            std::vector<TraceEvent>* live; // nullptr once the thread is gone
+            std::vector<TraceEvent> retired;
+        };
+
+        static std::string thread_name(const Thread& thread) {
+            if (thread.slot > 0) return "worker " + std::to_string(thread.slot);
+            return thread.slot == 0 ? "main" : "thread " + std::to_string(thread.id);
+        }
+
+        std::atomic<bool> on{false};
+        std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+        std::mutex mutex;
+        std::vector<Thread> threads;
+        int next_id = 0;
+        bool has_main = false;
+};
+
+// the worker slot of the current thread, set by parallel_for before its workers record anything
+inline int& trace_worker_slot() {
+    static thread_local int slot = -1;
+    return slot;
+}
+
+inline void set_trace_worker_slot(int slot) { trace_worker_slot() = slot; }
+
+struct ThreadTrace {
+    std::vector<TraceEvent> events;
+    ThreadTrace() {
+        events.reserve(1024);
+        TraceRegistry::instance().add_thread(&events, trace_worker_slot());
+    }
+    ~ThreadTrace() { TraceRegistry::instance().remove_thread(&events); }
+};
+
+inline std::vector<TraceEvent>& thread_trace() {
+    static thread_local ThreadTrace local;
+    return local.events;
+}
+
+inline bool tracing() { return TraceRegistry::instance().enabled(); }
+inline void start_tracing() { TraceRegistry::instance().start(); }
+inline void stop_tracing() { TraceRegistry::instance().stop(); }
+inline bool write_chrome_trace(const std::string& filename) { return TraceRegistry::instance().write(filename); }
+
+class ScopedTrace {
+    public:
+        explicit ScopedTrace(const char* _name, int64_t _arg = -1) : name(tracing() ? _name : nullptr), arg(_arg) {
+            if (name) start = TraceRegistry::instance().now();
+        }
+
+        ~ScopedTrace() {
+            if (!name) return;
+            int64_t end = TraceRegistry::instance().now();
+            thread_trace().push_back(TraceEvent{name, start, end - start, arg});
+        }
+
+        ScopedTrace(const ScopedTrace&) = delete;
+        ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+    private:
+        const char* name;
+        int64_t start = 0;
+        int64_t arg;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) ScopedTrace TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_SCOPE_ARG(name, arg) ScopedTrace TRACE_CONCAT(trace_scope_, __LINE__)(name, arg)
+
+// tracing for the lifetime of the object, the file is written when it goes away, empty filename => does nothing
+class TraceSession {
+    public:
+        explicit TraceSession(const std::string& _filename) : filename(_filename) {
+            if (!filename.empty()) start_tracing();
+        }
+
+        ~TraceSession() {
+            if (filename.empty()) return;
+            stop_tracing();
+            if (write_chrome_trace(filename)) std::cerr << "trace written to " << filename << "\n";
+        }
+
+        TraceSession(const TraceSession&) = delete;
+        TraceSession& operator=(const TraceSession&) = delete;
+
+    private:
+        std::string filename;
+};
+
+#endif
@@ -7,9 +7,19 @@
 File to encapsulate an Eigen vector
 
 I created it so that I could include it and turn off IDE errors...
+
+Real is the precision of the whole geometry kernel => points, directions, t of the hits, sizes of the primitives.
+It is float by default so that nothing is converted back and forth between float and double in the hit methods.
+cmake -DRT_DOUBLE_PRECISION=ON switches everything to double (slower, for scenes where float is not precise enough).
 */
 
-typedef Eigen::Matrix<float, 3, 1> Vec3;
+#ifdef RT_DOUBLE_PRECISION
+typedef double Real;
+#else
+typedef float Real;
+#endif
+
+typedef Eigen::Matrix<Real, 3, 1> Vec3;
 using Point3 = Vec3; // 3D point
 
-#endif // VEC3_H
\ No newline at end of file
+#endif // VEC3_H
@@ -2,6 +2,9 @@
 #define AABB_H
 
 #include "utility.h"
+#include "Ray.h"
+#include "Simd.h"
+#include "Stats.h"
 
 /*
 an aabb is a bounding box around a primitive
@@ -55,7 +58,7 @@ Peter Shirley does some defensive programming stuff to prevent errors
             this calculates the maximum of [tx1, ty1, tz1]
         Notice that there is an intersection => all three subsets overlap if min(t0) < max(t1)
 
-            bool hit(const ray& r, double t_min, double t_max) const {
+            bool hit(const ray& r, Real t_min, Real t_max) const {
             for (int a = 0; a < 3; a++) {
                 auto t0 = fmin((minimum[a] - r.origin()[a]) / r.direction()[a],
                                (maximum[a] - r.origin()[a]) / r.direction()[a]);
@@ -71,6 +74,14 @@ Peter Shirley does some defensive programming stuff to prevent errors
 
         Peter Shirley then presents an optimised version of that hit method...
 
+The version below goes one step further:
+    the ray carries 1/direction (see Ray.h) => (minimum - origin) * inv_dir, no division per box
+    in the float build the box is kept in two vfloat4 (x, y, z and a 4th lane at -inf/+inf)
+        => the 6 ts are 2 subtractions and 2 multiplications, the 3 intervals are merged with one min and one max
+        => max over the lanes of the entering ts, min over the lanes of the leaving ts
+    the 4th lane of the ray is origin 0 and inv_dir 1 => it gives -inf and +inf and never changes the result
+    when d.x = 0, inv_dir.x = +-inf and the interval is (-inf, +inf) if the origin is inside the slab => same as Peter's
+
 To implement the BVH data strucuture => you need to have all of your geometric primitives return a bounding box
     Each geometric primitive will have a different way to calculate the box
         Sphere => each side is 2*radius => to get llc and urc => you just need to go 
@@ -88,34 +99,90 @@ To implement the BVH data strucuture => you need to have all of your geometric p
 class aabb {
     public:
         aabb() {}
-        aabb(const Point3& a, const Point3& b) { minimum = a; maximum = b;}
+        aabb(const Point3& a, const Point3& b) {
+#ifdef RT_DOUBLE_PRECISION
+            minimum = a; maximum = b;
+#else
+            lo = vfloat4(a.x(), a.y(), a.z(), -infinity);
+            hi = vfloat4(b.x(), b.y(), b.z(), infinity);
+#endif
+        }
 
+#ifdef RT_DOUBLE_PRECISION
         Point3 min() const {return minimum; }
         Point3 max() const {return maximum; }
+#else
+        Point3 min() const {return Point3(lo[0], lo[1], lo[2]); }
+        Point3 max() const {return Point3(hi[0], hi[1], hi[2]); }
+#endif
+
+        // used by the SAH => probability that a ray going through a parent box also goes through this one
+        double surface_area() const {
+            Vec3 d = max() - min();
+            return 2.0 * (d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+        }
 
-        // optimised hit method from Peter Shirley's book, does the same thing as explained above...
-       inline bool hit(const Ray& r, double t_min, double t_max) const {
+        inline bool hit(const Ray& r, Real t_min, Real t_max) const {
+            STAT_INC(stat_aabb_tests);
+#ifdef RT_DOUBLE_PRECISION
+            // the sign of the direction says which plane of the slab is hit first => no min/max per axis
+            const Vec3& inv = r.inverse_direction();
             for (int a = 0; a < 3; a++) {
-                auto t0 = fmin((minimum[a] - r.origin()[a]) / r.direction()[a],
-                               (maximum[a] - r.origin()[a]) / r.direction()[a]);
-                auto t1 = fmax((minimum[a] - r.origin()[a]) / r.direction()[a],
-                               (maximum[a] - r.origin()[a]) / r.direction()[a]);
-                t_min = fmax(t0, t_min);
-                t_max = fmin(t1, t_max);
+                int s = r.direction_sign(a);
+                Real t0 = ((s ? maximum : minimum)[a] - r.origin()[a]) * inv[a];
+                Real t1 = ((s ? minimum : maximum)[a] - r.origin()[a]) * inv[a];
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
                 if (t_max <= t_min)
                     return false;
             }
             return true;
+#else
+            vfloat4 t0 = (lo - r.origin4()) * r.inverse_direction4();
+            vfloat4 t1 = (hi - r.origin4()) * r.inverse_direction4();
+            Real t_near = std::max(t_min, reduce_max(vmin(t0, t1)));
+            Real t_far = std::min(t_max, reduce_min(vmax(t0, t1)));
+            return t_near < t_far;
+#endif
+        }
+
+        // same test, t_enter => where the ray enters the box (t_min if it starts inside)
+        inline bool hit(const Ray& r, Real t_min, Real t_max, Real& t_enter) const {
+            STAT_INC(stat_aabb_tests);
+#ifdef RT_DOUBLE_PRECISION
+            const Vec3& inv = r.inverse_direction();
+            for (int a = 0; a < 3; a++) {
+                int s = r.direction_sign(a);
+                Real t0 = ((s ? maximum : minimum)[a] - r.origin()[a]) * inv[a];
+                Real t1 = ((s ? minimum : maximum)[a] - r.origin()[a]) * inv[a];
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if (t_max <= t_min)
+                    return false;
+            }
+            t_enter = t_min;
             return true;
-        }       
+#else
+            vfloat4 t0 = (lo - r.origin4()) * r.inverse_direction4();
+            vfloat4 t1 = (hi - r.origin4()) * r.inverse_direction4();
+            t_enter = std::max(t_min, reduce_max(vmin(t0, t1)));
+            return t_enter < std::min(t_max, reduce_min(vmax(t0, t1)));
+#endif
+        }
 
+#ifdef RT_DOUBLE_PRECISION
         Point3 minimum;
         Point3 maximum;
+#else
+        vfloat4 lo;
+        vfloat4 hi;
+#endif
 };
 
 // merge boxes => given two boxes => ths code returns a box that contains both boxes
 // basically find the lowest llc and the biggest urc
-aabb surrounding_box(aabb box0, aabb box1) {
+inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+#ifdef RT_DOUBLE_PRECISION
     Vec3 small(fmin(box0.min().x(), box1.min().x()),
                fmin(box0.min().y(), box1.min().y()),
                fmin(box0.min().z(), box1.min().z()));
@@ -125,5 +192,11 @@ aabb surrounding_box(aabb box0, aabb box1) {
                fmax(box0.max().z(), box1.max().z()));
 
     return aabb(small,big);
+#else
+    aabb box;
+    box.lo = vmin(box0.lo, box1.lo);
+    box.hi = vmax(box0.hi, box1.hi);
+    return box;
+#endif
 }
-#endif
\ No newline at end of file
+#endif
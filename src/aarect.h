@@ -3,6 +3,7 @@
 
 #include "utility.h"
 #include "Hittable.h"
+#include "Stats.h"
 
 /*
 this file defines axis aligned rectangles.
@@ -14,8 +15,46 @@ To build an axis aligned rectangle only the z-axis for example
      => we need to  store the llc and urc to know which range is fine => (x0, y0) to (x1, y1)
      to intersect => we do plane intersection, then check the range
      a boudning box => just need to give some space around k
+
+As a light, a rect picks a point uniformly on its area. Seen from o, a small piece of area dA at distance d
+covers a solid angle dA * cos / d^2 (cos between the normal of the rect and the direction) so
+    pdf in solid angle = d^2 / (cos * area)
+=> the points seen at a grazing angle or from far away get a big pdf and count less.
+The solid angle of the whole rect is the sum of the solid angles of its two triangles.
 */
 
+// solid angle of the triangle (a, b, c), the corners are given relative to the point looking at it (Van Oosterom and Strackee)
+inline Real triangle_solid_angle(const Vec3& a, const Vec3& b, const Vec3& c) {
+    Real la = a.norm(), lb = b.norm(), lc = c.norm();
+    Real numerator = std::fabs(a.dot(b.cross(c)));
+    Real denominator = la * lb * lc + a.dot(b) * lc + a.dot(c) * lb + b.dot(c) * la;
+    return 2 * std::atan2(numerator, denominator);
+}
+
+// pdf in solid angle of going from o along v when a point is picked uniformly on the rect
+inline Real area_sampling_pdf(const Hittable& rect, Real area, const Point3& o, const Vec3& v) {
+    HitRecord rec;
+    if (!rect.hit(Ray(o, v), epsilon, infinity, rec)) return 0;
+    Real distance_squared = rec.t * rec.t * v.squaredNorm();
+    Real cosine = std::fabs(v.dot(rec.normal)) / v.norm();
+    return cosine > 0 ? distance_squared / (cosine * area) : 0;
+}
+
+// t in [t_min, t_max] where the ray crosses the axis=k rectangle (a0, a1) x (b0, b1), the a and b axes in the order of the
+// aarects (xy => x, y  xz => x, z  yz => y, z) => the same arithmetic as their hit(), used by RectSet to get the same hits
+inline bool rect_root(int axis, Real a0, Real a1, Real b0, Real b1, Real k, const Ray& r, Real t_min, Real t_max, Real& t) {
+    int a_axis = axis == 0 ? 1 : 0;
+    int b_axis = axis == 2 ? 1 : 2;
+    Real root = (k - r.origin()[axis]) / r.direction()[axis];
+    if (root < t_min || root > t_max) return false;
+
+    Real a = r.origin()[a_axis] + root*r.direction()[a_axis];
+    Real b = r.origin()[b_axis] + root*r.direction()[b_axis];
+    if (a < a0 || a > a1 || b < b0 || b > b1) return false;
+    t = root;
+    return true;
+}
+
 // z=k rectangle in region (x0, x1) to (y0, y1)
 class xy_rect : public Hittable {
     public:
@@ -25,7 +64,8 @@ class xy_rect : public Hittable {
             shared_ptr<Material> mat)
             : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override {
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            STAT_INC(stat_rect_tests);
             auto t = (k-r.origin().z()) / r.direction().z(); // match z component
             if (t < t_min || t > t_max) return false;
 
@@ -38,7 +78,11 @@ class xy_rect : public Hittable {
             rec.t = t;
             auto outward_normal = Vec3(0, 0, 1);
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mp;
+            rec.dpdu = Vec3(x1-x0, 0, 0);
+            rec.dpdv = Vec3(0, y1-y0, 0);
+            rec.curvature = 0;
+            rec.mat_ptr = mp.get();
+            rec.object = this;
             rec.p = r.at(t);
             return true;
         }
@@ -53,6 +97,27 @@ class xy_rect : public Hittable {
             return "xy rect";
         }
 
+        virtual Real pdf_value(const Point3& o, const Vec3& v) const override {
+            return area_sampling_pdf(*this, (x1-x0)*(y1-y0), o, v);
+        }
+
+        virtual Real solid_angle(const Point3& o) const override {
+            Vec3 a = Point3(x0, y0, k) - o, b = Point3(x1, y0, k) - o, c = Point3(x1, y1, k) - o, d = Point3(x0, y1, k) - o;
+            return triangle_solid_angle(a, b, c) + triangle_solid_angle(a, c, d);
+        }
+
+        // both faces emit => the side is picked at random and the area counts twice
+        virtual Real random_emission_point(Point3& point, Vec3& normal) const override {
+            point = random_surface_point();
+            normal = random_double() < 0.5 ? Vec3(0, 0, 1) : Vec3(0, 0, -1);
+            return 2 * (x1-x0) * (y1-y0);
+        }
+
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            out.add_rect(to_world, 2, x0, x1, y0, y1, k, owner ? owner : this);
+            return true;
+        }
+
         virtual Vec3 random_surface_point() const override {
             return Vec3(
                 x0 + (x1-x0) * random_double(0, 1),
@@ -63,7 +128,7 @@ class xy_rect : public Hittable {
 
     public:
         shared_ptr<Material> mp;
-        double x0, x1, y0, y1, k;
+        Real x0, x1, y0, y1, k;
 };
 
 // y=k rectangle
@@ -75,7 +140,8 @@ class xz_rect : public Hittable {
             shared_ptr<Material> mat)
             : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override {
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            STAT_INC(stat_rect_tests);
             auto t = ( k - r.origin().y()) / r.direction().y(); // check y component for t
 
             if (t < t_min || t > t_max)  return false;
@@ -92,7 +158,11 @@ class xz_rect : public Hittable {
             rec.t = t;
             auto outward_normal = Vec3(0, 1, 0);
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mp;
+            rec.dpdu = Vec3(x1-x0, 0, 0);
+            rec.dpdv = Vec3(0, 0, z1-z0);
+            rec.curvature = 0;
+            rec.mat_ptr = mp.get();
+            rec.object = this;
             rec.p = r.at(t);
             return true;
         }
@@ -108,6 +178,26 @@ class xz_rect : public Hittable {
             return "xz rect";
         }
 
+        virtual Real pdf_value(const Point3& o, const Vec3& v) const override {
+            return area_sampling_pdf(*this, (x1-x0)*(z1-z0), o, v);
+        }
+
+        virtual Real solid_angle(const Point3& o) const override {
+            Vec3 a = Point3(x0, k, z0) - o, b = Point3(x1, k, z0) - o, c = Point3(x1, k, z1) - o, d = Point3(x0, k, z1) - o;
+            return triangle_solid_angle(a, b, c) + triangle_solid_angle(a, c, d);
+        }
+
+        virtual Real random_emission_point(Point3& point, Vec3& normal) const override {
+            point = random_surface_point();
+            normal = random_double() < 0.5 ? Vec3(0, 1, 0) : Vec3(0, -1, 0);
+            return 2 * (x1-x0) * (z1-z0);
+        }
+
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            out.add_rect(to_world, 1, x0, x1, z0, z1, k, owner ? owner : this);
+            return true;
+        }
+
         virtual Vec3 random_surface_point() const override {
             return Vec3(
                 x0 + (x1-x0) * random_double(0, 1),
@@ -118,7 +208,7 @@ class xz_rect : public Hittable {
 
     public:
         shared_ptr<Material> mp;
-        double x0, x1, z0, z1, k;
+        Real x0, x1, z0, z1, k;
 };
 
 // x=k rectangle
@@ -130,7 +220,8 @@ class yz_rect : public Hittable {
             shared_ptr<Material> mat)
             : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override {
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            STAT_INC(stat_rect_tests);
             auto t = (k-r.origin().x()) / r.direction().x(); // match x component for t
             if (t < t_min || t > t_max) return false;
 
@@ -145,7 +236,11 @@ class yz_rect : public Hittable {
             rec.t = t;
             auto outward_normal = Vec3(1, 0, 0);
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mp;
+            rec.dpdu = Vec3(0, y1-y0, 0);
+            rec.dpdv = Vec3(0, 0, z1-z0);
+            rec.curvature = 0;
+            rec.mat_ptr = mp.get();
+            rec.object = this;
             rec.p = r.at(t);
     
             return true;
@@ -161,6 +256,26 @@ class yz_rect : public Hittable {
         virtual std::string name() const override {
             return "yz rect";
         }
+
+        virtual Real pdf_value(const Point3& o, const Vec3& v) const override {
+            return area_sampling_pdf(*this, (y1-y0)*(z1-z0), o, v);
+        }
+
+        virtual Real solid_angle(const Point3& o) const override {
+            Vec3 a = Point3(k, y0, z0) - o, b = Point3(k, y1, z0) - o, c = Point3(k, y1, z1) - o, d = Point3(k, y0, z1) - o;
+            return triangle_solid_angle(a, b, c) + triangle_solid_angle(a, c, d);
+        }
+        virtual Real random_emission_point(Point3& point, Vec3& normal) const override {
+            point = random_surface_point();
+            normal = random_double() < 0.5 ? Vec3(1, 0, 0) : Vec3(-1, 0, 0);
+            return 2 * (y1-y0) * (z1-z0);
+        }
+
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            out.add_rect(to_world, 0, y0, y1, z0, z1, k, owner ? owner : this);
+            return true;
+        }
+
         virtual Vec3 random_surface_point() const override {
             return Vec3(
                 k,
@@ -171,6 +286,6 @@ class yz_rect : public Hittable {
 
     public:
         shared_ptr<Material> mp;
-        double y0, y1, z0, z1, k;
+        Real y0, y1, z0, z1, k;
 };
 #endif
\ No newline at end of file
@@ -11,174 +11,206 @@
 #include "Image.h"
 #include "BVH.h"
 #include "rotation.h"
+#include "Scenes.h"
+#include "Arena.h"
+#include "Stats.h"
+#include "Heatmap.h"
+#include "Renderer.h"
+#include "Batch.h"
+#include "Denoiser.h"
+#include "Preview.h"
+#include "StreamingImage.h"
+#include "Trace.h"
+#include "Rasterizer.h"
+#include "GBuffer.h"
+#include <memory>
+#include <string>
+
+int main(int argc, char** argv) {
+    // --heatmap        => also save per-pixel cost images (needs a build with -DRT_STATS=ON)
+    // --batch FILE     => headless, render every camera of FILE (see Batch.h)
+    // --turntable N    => headless, N cameras around the default view (after the cameras of --batch if both are given)
+    // --threads N      => number of render threads, all the cores by default
+    // --spp N          => N x N jittered samples per pixel
+    // --samples N      => N samples per pixel, any count (overrides --spp)
+    // --sampler NAME   => independent, stratified (default), halton, sobol or blue-noise (see Sampler.h)
+    // --denoise        => save the feature buffers and run the edge-aware denoiser (use with a low --spp, 2 or 3)
+    // --irradiance-cache => interpolate the light bouncing off matte surfaces (see IrradianceCache.h)
+    // --caustics       => photon pass for the light focused by the glass (see PhotonMap.h)
+    // --interactive    => window where the camera can be moved, the image refines progressively (see Preview.h)
+    // --width N        => image width (and height), 1000 by default
+    // --output FILE    => headless, tiles are written to the PPM file as they finish (see StreamingImage.h)
+    // --trace FILE     => timeline of the scene build, the tiles of every thread and the saving as Chrome trace JSON (see Trace.h)
+    // --raster         => the camera rays are rasterized instead of traced (see Rasterizer.h), not with --heatmap or --denoise
+    // --gbuffer FILE   => first hits of the camera samples taken from FILE, captured and saved there when it is missing or stale
+    //                     => a material or light tweak re-renders without the camera rays (see GBuffer.h), same limits as --raster
+    bool make_heatmap = false;
+    bool run_denoiser = false;
+    bool use_irradiance_cache = false;
+    bool use_caustics = false;
+    bool interactive = false;
+    bool rasterize = false;
+    int image_width = 1000;
+    std::string output_file;
+    std::string trace_file;
+    std::string gbuffer_file;
+    int samples_per_pixel = 7;
+    int samples = 0;
+    SamplerType sampler = stratified_sampler;
+    std::string batch_file;
+    int turntable_frames = 0;
+    int num_threads = 0;
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        if (arg == "--heatmap") make_heatmap = true;
+        else if (arg == "--batch" && a + 1 < argc) batch_file = argv[++a];
+        else if (arg == "--turntable" && a + 1 < argc) turntable_frames = atoi(argv[++a]);
+        else if (arg == "--threads" && a + 1 < argc) num_threads = atoi(argv[++a]);
+        else if (arg == "--spp" && a + 1 < argc) samples_per_pixel = atoi(argv[++a]);
+        else if (arg == "--samples" && a + 1 < argc) samples = atoi(argv[++a]);
+        else if (arg == "--sampler" && a + 1 < argc && parse_sampler_type(argv[a + 1], sampler)) a++;
+        else if (arg == "--denoise") run_denoiser = true;
+        else if (arg == "--irradiance-cache") use_irradiance_cache = true;
+        else if (arg == "--caustics") use_caustics = true;
+        else if (arg == "--interactive") interactive = true;
+        else if (arg == "--width" && a + 1 < argc) image_width = atoi(argv[++a]);
+        else if (arg == "--output" && a + 1 < argc) output_file = argv[++a];
+        else if (arg == "--trace" && a + 1 < argc) trace_file = argv[++a];
+        else if (arg == "--raster") rasterize = true;
+        else if (arg == "--gbuffer" && a + 1 < argc) gbuffer_file = argv[++a];
+        else {
+            std::cerr << "usage: src [--heatmap] [--batch FILE] [--turntable N] [--threads N] [--spp N] [--samples N] [--sampler NAME] [--denoise] [--irradiance-cache] [--caustics] [--interactive] [--width N] [--output FILE.ppm] [--trace FILE.json] [--raster] [--gbuffer FILE]\n";
+            return 1;
+        }
+    }
 
-void cornell_box(HittableList& objects, LightSources& lights) {
-    auto cube_side = 555; // can change the size of the box right here
-    
-    // light sources
-    auto light = make_shared<DiffuseLight>(create_color(255, 255, 255));    
-    
-    // far away light => required to add  reflections if other lights are behind the reflective sphere
-    Point3 light_position(80, 200, -800);
-    shared_ptr<Hittable> light_object = make_shared<Sphere>(light_position, 20, light);
-    lights.add(light_object);
-    
-    // light sphere inside the room
-    Point3 third_light_position(80, 370, 150);
-    shared_ptr<Hittable> third_light_object = make_shared<Sphere>(third_light_position, 50, light);
-    lights.add(third_light_object);
-    
-    /*
-    // light rectangle
-    double size_light = cube_side/3;
-    shared_ptr<Hittable> light_rect = make_shared<xz_rect>(
-            cube_side/2 - size_light/2, 
-            cube_side/2 + size_light/2,  // x points from right to left, y points along vertical, z points deeper into the box..
-            cube_side/2 - size_light/2, 
-            cube_side/2 + size_light/2, 
-            cube_side - 10, light);
-    lights.add(light_rect);
-    */
-
-    // objects
-    auto ue_red = create_color(193, 2, 6);
-    auto carmine_red = create_color(165, 1, 19);
-    auto floral_white = create_color(255, 251, 242);
-    auto chinese_grey = create_color(223, 226, 219);
-    auto raisin_black = create_color(33, 29, 33);
-    auto rich_black = create_color(1, 10, 16);
-
-    // Materials --- I made all materials have default ka, kd, km, ks, p that I wanted    
-    auto glass = make_shared<Dielectric>(1.5); // refraction -> basically glass
-    auto fuzzy_red = make_shared<FuzzyMetal>(ue_red, 0.2);
-    auto metal_red = make_shared<FuzzyMetal>(carmine_red, 0.1);
-    auto matte_white = make_shared<Matte>(floral_white);
-    auto matte_black = make_shared<Matte>(rich_black);
-    auto metal_grey = make_shared<Metal>(chinese_grey); 
-
-    HittableList tmp; // temporary list to build up BVH
-    
-    // the sides => give range and k example => the plane x = k  is [y0, z0] [y1, z1] and k creates the plane
-    tmp.add(make_shared<yz_rect>(0, cube_side, 0, cube_side, cube_side, matte_black));
-    tmp.add(make_shared<yz_rect>(0, cube_side, 0, cube_side, 0, matte_white));
-    // roof
-    tmp.add(make_shared<xz_rect>(0, cube_side, 0, cube_side, cube_side, metal_grey));
-    // back
-    tmp.add(make_shared<xy_rect>(0, cube_side, 0, cube_side, cube_side, metal_red));
-    
-    // make floor textured
-    auto num_squares_along_side = 20; // can change the grid pattern
-    auto checker = make_shared<RectCheckerTexture>(floral_white, raisin_black, cube_side, cube_side, num_squares_along_side, num_squares_along_side);
-    tmp.add(make_shared<xz_rect>(0, cube_side, 0, cube_side, 0, make_shared<Matte>(checker)));
-
-    // reflective metal sphere
-    tmp.add(make_shared<Sphere>(Point3(150, 100, 400), 120, metal_grey));    
-    // glass sphere
-    tmp.add(make_shared<Sphere>(Point3(385, 80, 195), 80, glass));
-    // small Matte sphere
-    tmp.add(make_shared<Sphere>(Point3(90, 40, 60), 40, fuzzy_red));
-
-    // two small rotated boxes
-    tmp.add(
-        make_shared<rotate_x> (
-            make_shared<rotate_y> (
-                //make_shared<Box>(Point3(100, 350, 400), Point3(150, 400, 450), metal_red, matte_black),
-                make_shared<Box>(Point3(200, 350, 350), Point3(250, 400, 400), metal_red, matte_black),
-                30
-            ),
-            300
-        )
-    );
-
-    tmp.add(
-        make_shared<rotate_y> (
-            make_shared<rotate_z> (
-                make_shared<Box>(Point3(250, 360, 350), Point3(300, 420, 400), metal_red, matte_white),
-                45
-            ), 
-            45
-        )
-    );
-
-    // big box inside the room with one side checkered
-    auto num_squares_along_box = 3; // can change the grid pattern
-    auto box_size = 120;
-    auto box_checker = make_shared<RectCheckerTexture>(floral_white, carmine_red, box_size, box_size, num_squares_along_box, num_squares_along_box);
-    //auto x = 200, y = 400, z = 150;
-    auto x = -20, y = 100, z = 350;
-    tmp.add(
-        make_shared<rotate_x>(
-            make_shared<rotate_y> (
-                make_shared<Box>(Point3(x, y, z), Point3(x + box_size, y+box_size, z+box_size), make_shared<Matte>(box_checker), fuzzy_red),
-                45
-            ),
-            315
-        )
-    );
-
-    objects.add(make_shared<BVH>(tmp));
-}
+#ifndef RT_STATS
+    if (make_heatmap) {
+        std::cerr << "--heatmap needs the render counters (build with -DRT_STATS=ON), no heatmap is saved\n";
+        make_heatmap = false;
+    }
+#endif
 
+    TraceSession trace(trace_file); // written when main returns
 
-int main(int, char**) {
     // Image
     const auto aspect_ratio = 1.0;
-    const int image_width = 1000;
-    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    RenderSettings settings;
+    settings.image_width = image_width;
+    settings.image_height = static_cast<int>(settings.image_width / aspect_ratio);
 
     // use 3, 3, 3 with 400 width during presentation...
-    const int samples_per_pixel = 7;
-    const int max_depth = 5;
+    settings.samples_per_pixel = samples_per_pixel;
+    settings.samples = samples;
+    settings.sampler = sampler;
+    settings.max_depth = 5;
+    settings.num_threads = num_threads;
     const int num_sample_lights = 8;
-    // OpenCV (0, 0) is top-left = so I address the code by image(j, i)...
-    Image image(image_height, image_width);
 
     // Camera
-    double field_of_view = 40.0; // can change how wide the camera view is => WE DO NOT PASS IN THE viewport width and height..
-    Point3 lookfrom(278, 278, -800);
-    Point3 lookat(278, 278, 0);
+    FrameSpec view;
+    view.settings = settings;
+    view.field_of_view = 40.0; // can change how wide the camera view is => WE DO NOT PASS IN THE viewport width and height..
+    view.lookfrom = Point3(278, 278, -800);
+    view.lookat = Point3(278, 278, 0);
 
     // CAN CHANGE CAMERA POSITION and field of view
     // wide view from inside the room => can see the reflective material roof..
-    // double field_of_view = 60.0;
-    // Point3 lookfrom(150, 50, -200);
-    // Point3 lookat(370, 350, 400);
-
-    Vec3 view_direction = -(lookat - lookfrom);
-    Vec3 vup(0,1,0);
-    float focus_dist = 1.0;
-    Camera cam(lookfrom, lookat, vup, field_of_view, aspect_ratio, focus_dist);
+    // view.field_of_view = 60.0;
+    // view.lookfrom = Point3(150, 50, -200);
+    // view.lookat = Point3(370, 350, 400);
 
-    // Scene
+    // Scene => built once, even in batch mode
     Color background(0, 0, 0); // ambient light
+    SceneArena arena; // owns every object of the scene => declared before everything that points into it
     LightSources lights;
     HittableList objects;
-    cornell_box(objects, lights);
+    cornell_box(arena, objects, lights);
     
     // encapsulates blinn_phong, refraction, light object => we no multiple iterations for each light source
     // we do even more iterations to add
     Shader shader(background, objects, lights, num_sample_lights); 
+    std::unique_ptr<IrradianceCache> irradiance_cache; // filled while rendering, shared by every frame of a batch (the scene does not move)
+    if (use_irradiance_cache) {
+        irradiance_cache.reset(new IrradianceCache());
+        shader.set_irradiance_cache(irradiance_cache.get());
+    }
+    std::unique_ptr<CausticMap> caustics;
+    if (use_caustics) {
+        PhotonMapSettings photon_settings;
+        photon_settings.num_threads = num_threads;
+        caustics.reset(new CausticMap(lights, photon_settings));
+        caustics->build(objects);
+        std::cerr << "caustics: " << caustics->size() << " photons stored\n";
+        shader.set_caustics(caustics.get());
+    }
+
+    if (interactive) {
+        InteractivePreview preview(shader, view);
+        preview.run();
+        return 0;
+    }
 
-    for (int j = image_height-1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << " " << std::flush;
-        for (int i = 0; i < image_width; ++i) {
-            Color pixel_color(0, 0, 0); // JUST A Vec3 of floats
+    if (!output_file.empty()) {
+        StreamingImage out;
+        if (!out.open(output_file, settings.image_width, settings.image_height)) return 1;
+        bool written = render_to_file(view.camera(), shader, settings, out);
+        written = out.close() && written;
+        print_stats(std::cerr, collect_stats());
+        if (!written) std::cerr << output_file << " is missing tiles\n";
+        return written ? 0 : 1;
+    }
 
-            // jittering antialiasing
-            for (int p = 0; p < samples_per_pixel; p++) {
-                for (int q = 0; q < samples_per_pixel; q++) {
-                    // generate ray at (u, v), random_double is in [0, 1)
-                    auto u = (i + (p + random_double())/samples_per_pixel ) / (image_width-1);
-                    auto v = (j + (q + random_double())/samples_per_pixel ) / (image_height-1);
-                    Ray r = cam.get_ray(u, v);
-                    pixel_color += shader.trace(r, max_depth); 
-                }
-            }
+    if (!batch_file.empty() || turntable_frames > 0) {
+        std::vector<FrameSpec> frames;
+        if (!batch_file.empty() && !read_batch_file(batch_file, view, frames)) return 1;
+        if (turntable_frames > 0) {
+            std::vector<FrameSpec> spin = turntable(view, turntable_frames, static_cast<int>(frames.size()));
+            frames.insert(frames.end(), spin.begin(), spin.end());
+        }
+        render_batch(frames, shader);
+        print_stats(std::cerr, collect_stats());
+        return 0;
+    }
 
-            RGB color = scale_color(pixel_color, samples_per_pixel * samples_per_pixel); // actual RGB values in uchar
-            image(image_height - 1 - j, image_width - 1 -i) = color;
+    std::unique_ptr<Heatmap> heatmap;
+    if (make_heatmap) heatmap.reset(new Heatmap(settings.image_height, settings.image_width));
+    Framebuffer frame;
+    FeatureBuffers features;
+    bool rendered = false;
+    if ((rasterize || !gbuffer_file.empty()) && (make_heatmap || run_denoiser)) std::cerr << "--raster and --gbuffer are ignored with --heatmap and --denoise\n";
+    else if (!gbuffer_file.empty()) {
+        GBuffer gbuffer;
+        bool bound = gbuffer.load(gbuffer_file) && gbuffer.bind(view.camera(), objects, settings);
+        bool captured = false;
+        if (!bound) {
+            std::cerr << "capturing the first hits to " << gbuffer_file << "\n";
+            gbuffer.capture(view.camera(), objects, settings);
+            bound = gbuffer.bind(view.camera(), objects, settings);
+            captured = true;
         }
+        if (bound) {
+            // saved after the render => the shadow masks made by the first render from the cache are kept too
+            size_t new_masks = render_from_gbuffer(view.camera(), shader, gbuffer, settings, frame);
+            if ((captured || new_masks > 0) && !gbuffer.save(gbuffer_file)) std::cerr << "cannot save the first hits, they are captured again on the next run\n";
+            rendered = true;
+        } else std::cerr << "the first hits do not match the scene, tracing the camera rays\n";
+    } else if (rasterize) {
+        rendered = render_hybrid(view.camera(), shader, objects, settings, frame);
+        if (!rendered) std::cerr << "the scene cannot be rasterized, tracing the camera rays\n";
     }
+    if (!rendered) render(view.camera(), shader, settings, frame, heatmap.get(), run_denoiser ? &features : nullptr);
+
+    print_stats(std::cerr, collect_stats());
+    if (heatmap) heatmap->save("heatmap");
+    if (run_denoiser) {
+        features.save("features");
+        denoise(frame, features);
+    }
+
+    // OpenCV (0, 0) is top-left = the framebuffer is already stored that way
+    Image image(settings.image_width, settings.image_height);
+    to_image(frame, image);
     image.display();
     image.save("result.png");
 }
@@ -6,6 +6,7 @@
 #include "utility"
 #include "math.h"
 #include "Vec3.h"
+#include "Stats.h"
 /*
 We use rotations to make boxes no longer axis aligned
 
@@ -79,7 +80,8 @@ class rotate_y : public Hittable {
             bbox = aabb(min, max);
         }
 
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override {
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            STAT_INC(stat_instance_tests);
             auto origin = r.origin();
             auto direction = r.direction();
 
@@ -110,6 +112,10 @@ class rotate_y : public Hittable {
 
             rec.p = p;
             rec.set_face_normal(rotated_r, normal);
+            rec.object = this;
+            // the texture derivatives turn with the surface (ray differentials, see Shader::trace)
+            rec.dpdu = to_world(rec.dpdu);
+            rec.dpdv = to_world(rec.dpdv);
 
             return true;
         }
@@ -125,6 +131,12 @@ class rotate_y : public Hittable {
             return "rotate y";
         }
 
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            Mat3 rotation;
+            rotation << this->to_world(Vec3(1, 0, 0)), this->to_world(Vec3(0, 1, 0)), this->to_world(Vec3(0, 0, 1));
+            return ptr->rasterize(out, owner ? owner : this, to_world * rotation);
+        }
+
         virtual Vec3 random_surface_point() const override {
             auto p = ptr->random_surface_point();
 
@@ -133,10 +145,16 @@ class rotate_y : public Hittable {
             return p;
         }
 
+    private:
+        // from the frame of the object to the world, same as the normal in hit()
+        Vec3 to_world(const Vec3& v) const {
+            return Vec3(cos_theta*v[0] + sin_theta*v[2], v[1], -sin_theta*v[0] + cos_theta*v[2]);
+        }
+
     public:
         shared_ptr<Hittable> ptr;
-        double sin_theta;
-        double cos_theta;
+        Real sin_theta;
+        Real cos_theta;
         bool has_box; // can only contruct a rotated bounding box if the original item had a bounding box
         aabb bbox;
 };
@@ -178,7 +196,8 @@ class rotate_x : public Hittable {
             bbox = aabb(min, max);
         }
 
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override {
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            STAT_INC(stat_instance_tests);
             auto origin = r.origin();
             auto direction = r.direction();
 
@@ -209,6 +228,10 @@ class rotate_x : public Hittable {
 
             rec.p = p;
             rec.set_face_normal(rotated_r, normal);
+            rec.object = this;
+            // the texture derivatives turn with the surface (ray differentials, see Shader::trace)
+            rec.dpdu = to_world(rec.dpdu);
+            rec.dpdv = to_world(rec.dpdv);
 
             return true;
         }
@@ -224,6 +247,12 @@ class rotate_x : public Hittable {
             return "rotate x";
         }
 
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            Mat3 rotation;
+            rotation << this->to_world(Vec3(1, 0, 0)), this->to_world(Vec3(0, 1, 0)), this->to_world(Vec3(0, 0, 1));
+            return ptr->rasterize(out, owner ? owner : this, to_world * rotation);
+        }
+
         virtual Vec3 random_surface_point() const override {
             auto p = ptr->random_surface_point();
 
@@ -232,10 +261,16 @@ class rotate_x : public Hittable {
             return p;
         }
 
+    private:
+        // from the frame of the object to the world, same as the normal in hit()
+        Vec3 to_world(const Vec3& v) const {
+            return Vec3(v[0], cos_theta*v[1] - sin_theta*v[2], sin_theta*v[1] + cos_theta*v[2]);
+        }
+
     public:
         shared_ptr<Hittable> ptr;
-        double sin_theta;
-        double cos_theta;
+        Real sin_theta;
+        Real cos_theta;
         bool has_box; // can only contruct a rotated bounding box if the original item had a bounding box
         aabb bbox;
 };
@@ -276,7 +311,8 @@ class rotate_z : public Hittable {
             bbox = aabb(min, max);
         }
 
-        virtual bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec) const override {
+        virtual bool hit(const Ray& r, Real t_min, Real t_max, HitRecord& rec) const override {
+            STAT_INC(stat_instance_tests);
             auto origin = r.origin();
             auto direction = r.direction();
 
@@ -312,6 +348,10 @@ class rotate_z : public Hittable {
 
             rec.p = p;
             rec.set_face_normal(rotated_r, normal);
+            rec.object = this;
+            // the texture derivatives turn with the surface (ray differentials, see Shader::trace)
+            rec.dpdu = to_world(rec.dpdu);
+            rec.dpdv = to_world(rec.dpdv);
 
             return true;
         }
@@ -327,6 +367,12 @@ class rotate_z : public Hittable {
             return "rotate x";
         }
 
+        virtual bool rasterize(RasterPrimitives& out, const Hittable* owner, const Mat3& to_world) const override {
+            Mat3 rotation;
+            rotation << this->to_world(Vec3(1, 0, 0)), this->to_world(Vec3(0, 1, 0)), this->to_world(Vec3(0, 0, 1));
+            return ptr->rasterize(out, owner ? owner : this, to_world * rotation);
+        }
+
         virtual Vec3 random_surface_point() const override {
             auto p = ptr->random_surface_point();
 
@@ -337,10 +383,16 @@ class rotate_z : public Hittable {
             return p;
         }
 
+    private:
+        // from the frame of the object to the world, same as the normal in hit()
+        Vec3 to_world(const Vec3& v) const {
+            return Vec3(cos_theta*v[0] - sin_theta*v[1], sin_theta*v[0] + cos_theta*v[1], v[2]);
+        }
+
     public:
         shared_ptr<Hittable> ptr;
-        double sin_theta;
-        double cos_theta;
+        Real sin_theta;
+        Real cos_theta;
         bool has_box; // can only contruct a rotated bounding box if the original item had a bounding box
         aabb bbox;
 };
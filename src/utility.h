@@ -6,7 +6,10 @@
 #include <cmath> 
 #include <limits> // gives INT_MAX, ...
 #include <memory> // gives shared_ptr
-#include <cstdlib> // gives rand()
+#include <cstdlib>
+#include <random> // gives mt19937
+#include <atomic>
+#include <algorithm>
 
 // Usings
 
@@ -26,10 +29,46 @@ inline double degrees_to_radians(double degrees) {
 
 // random number generators
 
+// every thread gets its own generator => rand() is shared between threads and locks on every call
+// the threads get different seeds so that two tiles never use the same sequence
+inline std::mt19937& random_engine() {
+    static std::atomic<unsigned> next_seed(5489u);
+    static thread_local std::mt19937 engine(next_seed++);
+    return engine;
+}
+
+// seeds the generator of the calling thread => used to get the same scene and rays on every run
+inline void seed_random(unsigned seed) {
+    random_engine().seed(seed);
+}
+
+// where random_double() takes its numbers from instead of the engine
+// => the renderer points it at the Sampler of the pixel sample being traced (Sampler.h), so the camera jitter,
+// the light samples and the scatter directions of a path all come from one well spread sequence
+class RandomSource {
+    public:
+        virtual ~RandomSource() {}
+        virtual double next() = 0; // in [0, 1)
+        virtual int position() const { return -1; } // numbers taken since the sample started, -1 => another run would not draw the same ones
+};
+
+// nullptr => the mt19937 engine of the thread
+inline RandomSource*& thread_random_source() {
+    static thread_local RandomSource* source = nullptr;
+    return source;
+}
+
 inline double random_double() {
     // Returns a random real in [0,1).
-    // rand gives an integer between 0 to RAND_MAX, divide to get a real
-    return rand() / (RAND_MAX + 1.0);
+    if (RandomSource* source = thread_random_source()) return source->next();
+    // the engine gives a 32 bit integer, divide by 2^32 to get a real
+    return random_engine()() / 4294967296.0;
+}
+
+// position() of the thread's source, -1 for the engine
+inline int random_position() {
+    RandomSource* source = thread_random_source();
+    return source ? source->position() : -1;
 }
 
 inline double random_double(double min, double max) {
@@ -64,12 +103,33 @@ Vec3 random_in_unit_sphere() {
 }
 
 // to add randomness to a vector
+// uniform on the sphere from exactly two numbers (z uniform in [-1, 1], any angle around z)
+// => no rejection loop, every matte bounce uses the same two dimensions of the sampler
 Vec3 random_unit_vector() {
-    Vec3 res = (random_in_unit_sphere());
-    res.normalize();
-    return res;
+    Real z = 1 - 2 * random_double();
+    Real phi = 2 * pi * random_double();
+    Real r = std::sqrt(std::max(Real(0), 1 - z * z));
+    return Vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+
+// two unit vectors s and t such that (s, t, n) is an orthonormal basis, n has to be a unit vector
+// used to turn a direction sampled around the z axis into a direction around n (Duff et al. => no branch, no cross product)
+inline void orthonormal_basis(const Vec3& n, Vec3& s, Vec3& t) {
+    Real sign = std::copysign(Real(1), n.z());
+    Real a = -1 / (sign + n.z());
+    Real b = n.x() * n.y() * a;
+    s = Vec3(1 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+    t = Vec3(b, sign + n.y() * n.y() * a, -n.y());
 }
 
+// direction around the unit vector n given by the cosine of its angle with n and an angle phi around n
+inline Vec3 direction_around(const Vec3& n, Real cos_theta, Real phi) {
+    Vec3 s, t;
+    orthonormal_basis(n, s, t);
+    Real sin_theta = std::sqrt(std::max(Real(0), 1 - cos_theta * cos_theta));
+    return sin_theta * std::cos(phi) * s + sin_theta * std::sin(phi) * t + cos_theta * n;
+}
 
 // assumes all the vectors are unit vectors
 Vec3 reflect(const Vec3& v, const Vec3& n) {